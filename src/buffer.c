@@ -0,0 +1,75 @@
+#include "buffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "xmalloc.h"
+
+#define BUFFER_MIN_SIZE 1024
+
+void buffer_init(struct buffer *buf) {
+    buf->data = NULL;
+    buf->size = 0;
+    buf->start = buf->end = 0;
+}
+
+void buffer_free(struct buffer *buf) {
+    free(buf->data);
+    buffer_init(buf);
+}
+
+void buffer_append(struct buffer *buf, const char *data, size_t n) {
+    memcpy(buffer_reserve(buf, n), data, n);
+    buffer_commit(buf, n);
+}
+
+char *buffer_reserve(struct buffer *buf, size_t n) {
+    if (buf->size - buf->end < n) {
+        size_t len = buf->end - buf->start;
+
+        // Move pending data to the front of the buffer
+        if (buf->start) {
+            memmove(buf->data, buf->data + buf->start, len);
+
+            buf->start = 0;
+            buf->end = len;
+        }
+
+        if (buf->size - len < n) {
+            size_t size = buf->size ? buf->size : BUFFER_MIN_SIZE;
+
+            while (size - len < n) {
+                size *= 2;
+            }
+
+            buf->data = xrealloc(buf->data, size);
+            buf->size = size;
+        }
+    }
+
+    return buf->data + buf->end;
+}
+
+void buffer_commit(struct buffer *buf, size_t n) {
+    assert(n <= buf->size - buf->end);
+    buf->end += n;
+}
+
+const char *buffer_data(const struct buffer *buf) {
+    return buf->data + buf->start;
+}
+
+size_t buffer_len(const struct buffer *buf) {
+    return buf->end - buf->start;
+}
+
+void buffer_consume(struct buffer *buf, size_t n) {
+    assert(n <= buffer_len(buf));
+
+    buf->start += n;
+
+    if (buf->start == buf->end) {
+        buf->start = buf->end = 0;
+    }
+}
@@ -0,0 +1,95 @@
+#ifndef OAPROXY_BUFFER_H
+#define OAPROXY_BUFFER_H
+
+#include <stddef.h>
+
+/**
+ * Growable byte buffer holding data which is pending to be sent.
+ */
+struct buffer {
+    /** Buffer memory */
+    char *data;
+    /** Size of buffer memory */
+    size_t size;
+
+    /** Offset of first pending byte */
+    size_t start;
+    /** Offset one past the last pending byte */
+    size_t end;
+};
+
+/**
+ * Initialize an empty buffer.
+ *
+ * @param buf Buffer.
+ */
+void buffer_init(struct buffer *buf);
+
+/**
+ * Free the memory held by a buffer.
+ *
+ * @param buf Buffer.
+ */
+void buffer_free(struct buffer *buf);
+
+/**
+ * Append data to the end of a buffer.
+ *
+ * @param buf  Buffer.
+ * @param data Data to append.
+ * @param n    Number of bytes to append.
+ */
+void buffer_append(struct buffer *buf, const char *data, size_t n);
+
+/**
+ * Reserve space at the end of a buffer, into which data can be
+ * received directly.
+ *
+ * The data is only added to the buffer once buffer_commit() is
+ * called. The space remains valid until the buffer is next modified.
+ *
+ * @param buf Buffer.
+ * @param n   Number of bytes to reserve.
+ *
+ * @return Pointer to the reserved space.
+ */
+char *buffer_reserve(struct buffer *buf, size_t n);
+
+/**
+ * Add data, written to the space reserved by buffer_reserve(), to
+ * the end of a buffer.
+ *
+ * @param buf Buffer.
+ * @param n   Number of bytes written, at most the number of bytes
+ *   reserved.
+ */
+void buffer_commit(struct buffer *buf, size_t n);
+
+/**
+ * Return a pointer to the first pending byte in the buffer.
+ *
+ * @param buf Buffer.
+ *
+ * @return Pointer to pending data.
+ */
+const char *buffer_data(const struct buffer *buf);
+
+/**
+ * Return the number of pending bytes in the buffer.
+ *
+ * @param buf Buffer.
+ *
+ * @return Number of bytes.
+ */
+size_t buffer_len(const struct buffer *buf);
+
+/**
+ * Remove bytes from the front of the buffer, after they have been
+ * sent.
+ *
+ * @param buf Buffer.
+ * @param n   Number of bytes to remove.
+ */
+void buffer_consume(struct buffer *buf, size_t n);
+
+#endif /* OAPROXY_BUFFER_H */
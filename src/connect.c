@@ -0,0 +1,804 @@
+#include "connect.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "xmalloc.h"
+
+/**
+ * Delay, in milliseconds, before starting the next connection
+ * attempt while the previous attempts are still in progress. This is
+ * the recommended value from RFC 8305.
+ */
+#define CONNECT_ATTEMPT_DELAY 250
+
+/**
+ * Connection attempt to a single address
+ */
+struct attempt {
+    /** Socket file descriptor */
+    int fd;
+    /** Index of the address */
+    size_t addr;
+    /**
+     * Time at which the attempt was started. For a Fast Open attempt,
+     * the time at which the connection was initiated.
+     */
+    struct timespec start;
+
+    /** True if the attempt uses TCP Fast Open */
+    bool fastopen;
+    /**
+     * True if the connection has been initiated. A Fast Open
+     * connection is only initiated by the first write, until which
+     * the socket is not watched.
+     */
+    bool initiated;
+};
+
+/**
+ * Connection BIO state
+ */
+struct connect_state {
+    /** Server being connected to */
+    struct upstream *upstream;
+
+    /** Addresses, in the order in which they are tried */
+    struct upstream_addr addrs[UPSTREAM_MAX_ADDRS];
+    /** Number of addresses */
+    size_t n_addrs;
+    /** Index of the next address to try */
+    size_t next;
+
+    /** Attempts in progress */
+    struct attempt attempts[UPSTREAM_MAX_ADDRS];
+    /** Number of attempts in progress */
+    size_t n_attempts;
+
+    /**
+     * Epoll instance watching the attempts in progress, the attempt
+     * delay timer and the resolution notification. Returned by
+     * BIO_get_fd() until connected.
+     */
+    int race_fd;
+    /** Attempt delay timer */
+    int timer_fd;
+    /**
+     * Eventfd signalled once the server's host has been resolved, -1
+     * unless waiting for the addresses.
+     */
+    int resolve_fd;
+
+    /**
+     * Connected socket, -1 until connected. Owned by the socket BIO
+     * which is pushed onto the BIO once connected.
+     */
+    int fd;
+    /** Index of the connected address */
+    size_t addr;
+
+    /**
+     * Data written to the Fast Open attempt, before any attempt was
+     * connected. It is resent on the connected socket if another
+     * attempt wins the race. NULL if there is no such data.
+     */
+    char *early;
+    /** Number of bytes of early data */
+    size_t early_len;
+    /** Number of bytes of early data sent on the connected socket */
+    size_t early_sent;
+};
+
+/**
+ * Return the connection BIO method, creating it on the first call.
+ */
+static BIO_METHOD *connect_method(void);
+
+/**
+ * Create the connection BIO method. Called once.
+ */
+static void create_method(void);
+
+/**
+ * BIO write method. Continues the connection attempts, and writes to
+ * the socket BIO once connected.
+ */
+static int connect_write(BIO *bio, const char *data, int len);
+
+/**
+ * BIO read method. Continues the connection attempts, and reads from
+ * the socket BIO once connected.
+ */
+static int connect_read(BIO *bio, char *data, int len);
+
+/**
+ * BIO control method. Once connected, all controls are passed to the
+ * socket BIO, which allows OpenSSL to enable kernel TLS on the
+ * socket.
+ */
+static long connect_ctrl(BIO *bio, int cmd, long num, void *ptr);
+
+/**
+ * BIO destroy method. Closes the connection attempts in progress and
+ * frees the state.
+ */
+static int connect_destroy(BIO *bio);
+
+/**
+ * Continue the connection attempts.
+ *
+ * @param bio   The BIO.
+ * @param state Connection state.
+ *
+ * @return 1 if connected, 0 if the attempts are still in progress, -1
+ *   if all attempts failed.
+ */
+static int race(BIO *bio, struct connect_state *state);
+
+/**
+ * Wait for the server's host to be resolved in the background, when
+ * no addresses are cached.
+ *
+ * @param state Connection state.
+ *
+ * @return True if successful.
+ */
+static bool wait_resolve(struct connect_state *state);
+
+/**
+ * Retrieve the server's addresses once resolved, and stop waiting for
+ * them.
+ *
+ * @param state Connection state.
+ */
+static void resolved(struct connect_state *state);
+
+/**
+ * Start a connection attempt to the next address which can be tried,
+ * and arm the attempt delay timer if addresses remain.
+ *
+ * @param state Connection state.
+ *
+ * @return True if an attempt was started.
+ */
+static bool start_attempt(struct connect_state *state);
+
+/**
+ * Use an attempt as the connection and close the remaining attempts.
+ *
+ * A socket BIO for the attempt's socket is pushed onto the BIO.
+ *
+ * @param bio   The BIO.
+ * @param state Connection state.
+ * @param index Index of the attempt.
+ *
+ * @return True if successful, false if the socket BIO could not be
+ *   created, in which case the attempt is left unchanged, and is
+ *   closed by the caller as a failed attempt.
+ */
+static bool win(BIO *bio, struct connect_state *state, size_t index);
+
+/**
+ * Close a connection attempt and remove it from the attempts in
+ * progress.
+ *
+ * @param state Connection state.
+ * @param index Index of the attempt.
+ */
+static void close_attempt(struct connect_state *state, size_t index);
+
+/**
+ * Enable TCP Fast Open on a socket, before it is connected.
+ *
+ * The connection is then only initiated by the first write, which is
+ * sent with the SYN if the kernel holds a Fast Open cookie for the
+ * address. Otherwise a cookie is requested for the next connection.
+ *
+ * @param fd Socket file descriptor.
+ *
+ * @return True if Fast Open was enabled.
+ */
+static bool enable_fastopen(int fd);
+
+/**
+ * Initiate the Fast Open attempt, if any, by writing the first data
+ * to its socket.
+ *
+ * The attempt only wins the race once its connection is established,
+ * thus the remaining attempts continue in the meantime.
+ *
+ * @param state Connection state.
+ * @param data  Data to write.
+ * @param len   Number of bytes of data.
+ *
+ * @return Number of bytes written, which are kept as early data. 0 if
+ *   no data was written.
+ */
+static int fastopen_write(struct connect_state *state, const char *data, int len);
+
+/**
+ * Send the early data, written to the Fast Open attempt, on the
+ * connected socket.
+ *
+ * @param state Connection state.
+ *
+ * @return 1 if all early data was sent, 0 if the socket is not ready
+ *   and -1 on error.
+ */
+static int send_early(struct connect_state *state);
+
+/**
+ * Free a connection state and close all its descriptors.
+ *
+ * @param state Connection state.
+ */
+static void free_state(struct connect_state *state);
+
+/**
+ * Compare two addresses by their past connection attempts.
+ *
+ * @return True if @a a should be tried before @a b.
+ */
+static bool addr_before(const struct upstream_addr *a, const struct upstream_addr *b);
+
+/**
+ * Return the time, in milliseconds, elapsed since a given time.
+ *
+ * @param start Time read from the monotonic clock.
+ */
+static long elapsed_ms(const struct timespec *start);
+
+
+/* Implementation */
+
+static BIO_METHOD *method;
+static pthread_once_t method_once = PTHREAD_ONCE_INIT;
+
+BIO *connect_bio_new(struct upstream *upstream) {
+    BIO_METHOD *meth = connect_method();
+    if (!meth) return NULL;
+
+    struct connect_state *state = xmalloc(sizeof(struct connect_state));
+
+    state->upstream = upstream_ref(upstream);
+    state->next = 0;
+    state->n_attempts = 0;
+    state->fd = -1;
+    state->n_addrs = 0;
+
+    state->early = NULL;
+    state->early_len = 0;
+    state->early_sent = 0;
+
+    state->resolve_fd = -1;
+
+    state->race_fd = epoll_create1(EPOLL_CLOEXEC);
+    state->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (state->race_fd < 0 || state->timer_fd < 0) {
+        syslog(LOG_ERR, "Error creating connection descriptors: %m");
+        goto free_state;
+    }
+
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.fd = state->timer_fd
+    };
+
+    if (epoll_ctl(state->race_fd, EPOLL_CTL_ADD, state->timer_fd, &ev)) {
+        syslog(LOG_ERR, "Error adding file descriptor to epoll instance: %m");
+        goto free_state;
+    }
+
+    if (!wait_resolve(state))
+        goto free_state;
+
+    if (state->resolve_fd < 0 && !start_attempt(state)) {
+        syslog(LOG_ERR, "Error connecting to host: %s", upstream->host);
+        goto free_state;
+    }
+
+    BIO *bio = BIO_new(meth);
+
+    if (!bio) {
+        syslog(LOG_ERR, "Error creating connection BIO");
+        goto free_state;
+    }
+
+    BIO_set_data(bio, state);
+    BIO_set_init(bio, 1);
+
+    return bio;
+
+free_state:
+    free_state(state);
+    return NULL;
+}
+
+
+/* BIO Method */
+
+BIO_METHOD *connect_method(void) {
+    pthread_once(&method_once, create_method);
+    return method;
+}
+
+void create_method(void) {
+    int type = BIO_get_new_index();
+    if (type == -1) return;
+
+    method = BIO_meth_new(type | BIO_TYPE_FILTER, "upstream connection");
+    if (!method) return;
+
+    BIO_meth_set_write(method, connect_write);
+    BIO_meth_set_read(method, connect_read);
+    BIO_meth_set_ctrl(method, connect_ctrl);
+    BIO_meth_set_destroy(method, connect_destroy);
+}
+
+int connect_write(BIO *bio, const char *data, int len) {
+    struct connect_state *state = BIO_get_data(bio);
+
+    BIO_clear_retry_flags(bio);
+
+    int ret = race(bio, state);
+
+    if (!ret) {
+        int n = fastopen_write(state, data, len);
+        if (n > 0) return n;
+
+        // The Fast Open attempt may have failed
+        ret = state->n_attempts || state->resolve_fd >= 0 ? 0 : -1;
+    }
+
+    if (ret <= 0) {
+        if (!ret) BIO_set_retry_write(bio);
+        return -1;
+    }
+
+    int n = BIO_write(BIO_next(bio), data, len);
+
+    if (n <= 0)
+        BIO_copy_next_retry(bio);
+
+    return n;
+}
+
+int connect_read(BIO *bio, char *data, int len) {
+    struct connect_state *state = BIO_get_data(bio);
+
+    BIO_clear_retry_flags(bio);
+
+    int ret = race(bio, state);
+
+    if (ret <= 0) {
+        if (!ret) BIO_set_retry_read(bio);
+        return -1;
+    }
+
+    int n = BIO_read(BIO_next(bio), data, len);
+
+    if (n < 0)
+        BIO_copy_next_retry(bio);
+
+    return n;
+}
+
+long connect_ctrl(BIO *bio, int cmd, long num, void *ptr) {
+    struct connect_state *state = BIO_get_data(bio);
+
+    if (BIO_next(bio))
+        return BIO_ctrl(BIO_next(bio), cmd, num, ptr);
+
+    switch (cmd) {
+    case BIO_C_GET_FD:
+        if (ptr) *(int *)ptr = state->race_fd;
+        return state->race_fd;
+
+    case BIO_CTRL_FLUSH:
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+int connect_destroy(BIO *bio) {
+    struct connect_state *state = BIO_get_data(bio);
+
+    if (state) {
+        free_state(state);
+
+        BIO_set_data(bio, NULL);
+        BIO_set_init(bio, 0);
+    }
+
+    return 1;
+}
+
+
+/* Racing Connection Attempts */
+
+int race(BIO *bio, struct connect_state *state) {
+    if (state->fd >= 0)
+        return state->early ? send_early(state) : 1;
+
+    struct epoll_event events[UPSTREAM_MAX_ADDRS + 1];
+    int n = epoll_wait(state->race_fd, events, UPSTREAM_MAX_ADDRS + 1, 0);
+
+    // New attempts are only started once all events have been
+    // handled, since a new socket may reuse the descriptor of an
+    // attempt closed in this iteration.
+    bool start = false;
+
+    for (int i = 0; i < n; ++i) {
+        int fd = events[i].data.fd;
+
+        if (fd == state->timer_fd) {
+            uint64_t expirations;
+
+            if (read(fd, &expirations, sizeof(expirations)) > 0)
+                start = true;
+
+            continue;
+        }
+
+        if (fd == state->resolve_fd) {
+            resolved(state);
+            start = true;
+
+            continue;
+        }
+
+        size_t index = 0;
+
+        while (index < state->n_attempts && state->attempts[index].fd != fd)
+            index++;
+
+        if (index == state->n_attempts)
+            continue;
+
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len))
+            err = errno;
+
+        if (!err && (events[i].events & EPOLLOUT) && win(bio, state, index))
+            return 1;
+
+        upstream_report_addr(state->upstream, &state->addrs[state->attempts[index].addr], -1);
+        close_attempt(state, index);
+
+        start = true;
+    }
+
+    if (start)
+        start_attempt(state);
+
+    return state->n_attempts || state->resolve_fd >= 0 ? 0 : -1;
+}
+
+bool wait_resolve(struct connect_state *state) {
+    state->resolve_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (state->resolve_fd < 0) {
+        syslog(LOG_ERR, "Error creating eventfd: %m");
+        return false;
+    }
+
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.fd = state->resolve_fd
+    };
+
+    if (epoll_ctl(state->race_fd, EPOLL_CTL_ADD, state->resolve_fd, &ev)) {
+        syslog(LOG_ERR, "Error adding file descriptor to epoll instance: %m");
+
+        close(state->resolve_fd);
+        state->resolve_fd = -1;
+
+        return false;
+    }
+
+    state->n_addrs = upstream_get_addrs(state->upstream, state->addrs, UPSTREAM_MAX_ADDRS, state->resolve_fd);
+
+    // The addresses are only waited for if none are cached
+    if (state->n_addrs) {
+        connect_order_addrs(state->addrs, state->n_addrs);
+
+        close(state->resolve_fd);
+        state->resolve_fd = -1;
+    }
+
+    return true;
+}
+
+void resolved(struct connect_state *state) {
+    close(state->resolve_fd);
+    state->resolve_fd = -1;
+
+    state->n_addrs = upstream_get_addrs(state->upstream, state->addrs, UPSTREAM_MAX_ADDRS, -1);
+    connect_order_addrs(state->addrs, state->n_addrs);
+
+    if (!state->n_addrs)
+        syslog(LOG_ERR, "Error connecting to host: %s", state->upstream->host);
+}
+
+bool start_attempt(struct connect_state *state) {
+    while (state->next < state->n_addrs) {
+        size_t index = state->next++;
+        struct upstream_addr *addr = &state->addrs[index];
+
+        int fd = socket(addr->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) continue;
+
+        // Fast Open sends the first data with the SYN, thus is only
+        // used for the first attempt, when it is to an address which
+        // was connected to before without failures.
+        bool fastopen = !index && addr->rtt && !addr->failures && enable_fastopen(fd);
+
+        if (connect(fd, (struct sockaddr *)&addr->addr, addr->len) && errno != EINPROGRESS) {
+            upstream_report_addr(state->upstream, addr, -1);
+            close(fd);
+            continue;
+        }
+
+        // A Fast Open socket is writable before the connection is
+        // initiated, thus it is only watched once initiated.
+        struct epoll_event ev = {
+            .events = EPOLLOUT,
+            .data.fd = fd
+        };
+
+        if (!fastopen && epoll_ctl(state->race_fd, EPOLL_CTL_ADD, fd, &ev)) {
+            close(fd);
+            continue;
+        }
+
+        struct attempt *attempt = &state->attempts[state->n_attempts++];
+
+        attempt->fd = fd;
+        attempt->addr = index;
+        attempt->fastopen = fastopen;
+        attempt->initiated = !fastopen;
+        clock_gettime(CLOCK_MONOTONIC, &attempt->start);
+
+        if (state->next < state->n_addrs) {
+            struct itimerspec delay = {
+                .it_value.tv_sec = CONNECT_ATTEMPT_DELAY / 1000,
+                .it_value.tv_nsec = (CONNECT_ATTEMPT_DELAY % 1000) * 1000000L
+            };
+
+            timerfd_settime(state->timer_fd, 0, &delay, NULL);
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+bool win(BIO *bio, struct connect_state *state, size_t index) {
+    struct attempt *attempt = &state->attempts[index];
+
+    BIO *sock = BIO_new_socket(attempt->fd, BIO_CLOSE);
+
+    if (!sock) {
+        syslog(LOG_ERR, "Error creating socket BIO");
+        return false;
+    }
+
+    BIO_push(bio, sock);
+
+    state->fd = attempt->fd;
+    state->addr = attempt->addr;
+
+    upstream_report_addr(state->upstream, &state->addrs[attempt->addr], elapsed_ms(&attempt->start));
+
+    // The early data was already sent on the Fast Open socket
+    if (attempt->fastopen) {
+        free(state->early);
+        state->early = NULL;
+    }
+
+    epoll_ctl(state->race_fd, EPOLL_CTL_DEL, state->fd, NULL);
+
+    // Remove the winner, so that only the losers are closed
+    state->attempts[index] = state->attempts[--state->n_attempts];
+
+    while (state->n_attempts)
+        close_attempt(state, 0);
+
+    // The race descriptor remains open, since it may still be watched
+    // by the caller, until the BIO is freed.
+    close(state->timer_fd);
+    state->timer_fd = -1;
+
+    return true;
+}
+
+int fastopen_write(struct connect_state *state, const char *data, int len) {
+    if (state->early)
+        return 0;
+
+    size_t index = 0;
+
+    while (index < state->n_attempts && state->attempts[index].initiated)
+        index++;
+
+    if (index == state->n_attempts)
+        return 0;
+
+    struct attempt *attempt = &state->attempts[index];
+
+    struct epoll_event ev = {
+        .events = EPOLLOUT,
+        .data.fd = attempt->fd
+    };
+
+    // Without a Fast Open cookie, only the SYN is sent and the write
+    // fails with EINPROGRESS. The data is then written once connected.
+    ssize_t n = send(attempt->fd, data, len, MSG_NOSIGNAL);
+
+    if ((n < 0 && errno != EINPROGRESS) ||
+        epoll_ctl(state->race_fd, EPOLL_CTL_ADD, attempt->fd, &ev)) {
+
+        upstream_report_addr(state->upstream, &state->addrs[attempt->addr], -1);
+        close_attempt(state, index);
+
+        start_attempt(state);
+        return 0;
+    }
+
+    attempt->initiated = true;
+    clock_gettime(CLOCK_MONOTONIC, &attempt->start);
+
+    if (n <= 0)
+        return 0;
+
+    state->early = xmalloc(n);
+    memcpy(state->early, data, n);
+
+    state->early_len = n;
+    state->early_sent = 0;
+
+    return n;
+}
+
+int send_early(struct connect_state *state) {
+    while (state->early_sent < state->early_len) {
+        ssize_t n = send(state->fd, state->early + state->early_sent,
+                         state->early_len - state->early_sent, MSG_NOSIGNAL);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            syslog(LOG_ERR, "Error sending data to host %s: %m", state->upstream->host);
+            return -1;
+        }
+
+        state->early_sent += n;
+    }
+
+    free(state->early);
+    state->early = NULL;
+
+    return 1;
+}
+
+bool enable_fastopen(int fd) {
+#ifdef TCP_FASTOPEN_CONNECT
+    int on = 1;
+    return !setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on));
+#else
+    return false;
+#endif
+}
+
+void close_attempt(struct connect_state *state, size_t index) {
+    close(state->attempts[index].fd);
+    state->attempts[index] = state->attempts[--state->n_attempts];
+}
+
+void free_state(struct connect_state *state) {
+    while (state->n_attempts)
+        close_attempt(state, 0);
+
+    if (state->resolve_fd >= 0) {
+        upstream_cancel_notify(state->upstream, state->resolve_fd);
+        close(state->resolve_fd);
+    }
+
+    if (state->timer_fd >= 0) close(state->timer_fd);
+    if (state->race_fd >= 0) close(state->race_fd);
+
+    free(state->early);
+
+    upstream_unref(state->upstream);
+    free(state);
+}
+
+
+/* Address Ordering */
+
+void connect_order_addrs(struct upstream_addr *addrs, size_t n) {
+    // Insertion sort, keeping the resolver's order for equal addresses
+
+    for (size_t i = 1; i < n; ++i) {
+        struct upstream_addr addr = addrs[i];
+        size_t j = i;
+
+        for (; j > 0 && addr_before(&addr, &addrs[j-1]); --j) {
+            addrs[j] = addrs[j-1];
+        }
+
+        addrs[j] = addr;
+    }
+
+    // Alternate between families, starting with the family of the
+    // preferred address
+
+    struct upstream_addr ordered[UPSTREAM_MAX_ADDRS];
+    bool used[UPSTREAM_MAX_ADDRS] = {false};
+
+    int family = n ? addrs[0].family : AF_UNSPEC;
+
+    for (size_t i = 0; i < n; ++i) {
+        size_t next = n;
+
+        for (size_t j = 0; j < n; ++j) {
+            if (used[j]) continue;
+
+            if (next == n) next = j;
+
+            if (addrs[j].family == family) {
+                next = j;
+                break;
+            }
+        }
+
+        used[next] = true;
+        ordered[i] = addrs[next];
+
+        family = addrs[next].family == AF_INET6 ? AF_INET : AF_INET6;
+    }
+
+    memcpy(addrs, ordered, n * sizeof(struct upstream_addr));
+}
+
+bool addr_before(const struct upstream_addr *a, const struct upstream_addr *b) {
+    if (a->failures != b->failures)
+        return a->failures < b->failures;
+
+    // Addresses which were connected to before untried addresses
+    if (!a->rtt || !b->rtt)
+        return a->rtt && !b->rtt;
+
+    return a->rtt < b->rtt;
+}
+
+long elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
@@ -0,0 +1,50 @@
+#ifndef OAPROXY_CONNECT_H
+#define OAPROXY_CONNECT_H
+
+#include <openssl/bio.h>
+
+#include "upstream.h"
+
+/**
+ * Create a BIO which connects to an upstream server.
+ *
+ * Connection attempts to the server's resolved addresses are raced
+ * against each other, as described in RFC 8305 (Happy Eyeballs).
+ * Addresses are tried in order of their past connection times,
+ * alternating between IPv6 and IPv4. Each attempt is started after a
+ * short delay, or as soon as the previous attempt fails, without
+ * cancelling the attempts in progress. The first attempt to connect
+ * is used and the remaining attempts are closed.
+ *
+ * Until connected, BIO_get_fd() returns a descriptor which becomes
+ * readable when the connection attempts should be continued, by
+ * reading from or writing to the BIO. Once connected, a socket BIO
+ * for the connected socket is pushed onto the BIO, to which all
+ * operations are passed. BIO_get_fd() then returns the connected
+ * socket, thus callers waiting for events on the descriptor must
+ * switch to the new descriptor.
+ *
+ * If no addresses of the server are cached, the attempts are only
+ * started once its host has been resolved in the background. The
+ * calling thread is not blocked.
+ *
+ * @param upstream The upstream server.
+ *
+ * @return The BIO, NULL if no connection attempt could be started.
+ */
+BIO *connect_bio_new(struct upstream *upstream);
+
+/**
+ * Order addresses by their past connection attempts, alternating
+ * between address families.
+ *
+ * Addresses with fewer consecutive failures come first, then
+ * addresses which were connected to, by connection time, then
+ * untried addresses. Equal addresses keep their order.
+ *
+ * @param addrs Array of addresses.
+ * @param n     Number of addresses, at most UPSTREAM_MAX_ADDRS.
+ */
+void connect_order_addrs(struct upstream_addr *addrs, size_t n);
+
+#endif /* OAPROXY_CONNECT_H */
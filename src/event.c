@@ -0,0 +1,378 @@
+#include "event.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <syslog.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "xmalloc.h"
+
+/**
+ * Maximum number of events handled per epoll_wait() call.
+ */
+#define EVENT_BATCH_SIZE 64
+
+/**
+ * Task posted to an event loop.
+ */
+struct event_task {
+    /** Task callback */
+    event_task_cb cb;
+    /** Task data pointer */
+    void *data;
+
+    /** Next task in stack */
+    struct event_task *next;
+};
+
+struct event_loop {
+    /** Epoll file descriptor */
+    int epoll_fd;
+
+    /** Eventfd used to wake the loop when a task is posted */
+    int wake_fd;
+
+    /** Number of watched file descriptors, excluding wake_fd */
+    size_t n_watches;
+
+    /** Number of holds acquired with event_loop_hold() */
+    size_t n_holds;
+
+    /** True if the loop should stop */
+    atomic_bool stop;
+
+    /**
+     * Stack of posted tasks, most recently posted first.
+     *
+     * Tasks are pushed by any thread and the entire stack is taken
+     * by the loop thread, thus no lock is required.
+     */
+    _Atomic(struct event_task *) tasks;
+};
+
+/**
+ * Run all tasks queued on an event loop.
+ *
+ * @param loop Event loop.
+ *
+ * @return True if at least one task was run.
+ */
+static bool run_tasks(struct event_loop *loop);
+
+/**
+ * Clear the wake eventfd counter.
+ *
+ * @param loop Event loop.
+ */
+static void clear_wake(struct event_loop *loop);
+
+/**
+ * Wake the event loop if it is blocked in epoll_wait().
+ *
+ * @param loop Event loop.
+ */
+static void wake(struct event_loop *loop);
+
+/**
+ * Event callback for a timer file descriptor.
+ *
+ * @param loop   Event loop.
+ * @param events Epoll events.
+ * @param data   Pointer to the event_timer struct.
+ */
+static void timer_event(struct event_loop *loop, uint32_t events, void *data);
+
+
+/* Implementation */
+
+struct event_loop *event_loop_create(void) {
+    struct event_loop *loop = xmalloc(sizeof(struct event_loop));
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        syslog(LOG_ERR, "Error creating epoll instance: %m");
+        goto free_loop;
+    }
+
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wake_fd < 0) {
+        syslog(LOG_ERR, "Error creating eventfd: %m");
+        goto close_epoll;
+    }
+
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.ptr = NULL
+    };
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev)) {
+        syslog(LOG_ERR, "Error adding eventfd to epoll instance: %m");
+        goto close_wake;
+    }
+
+    loop->n_watches = 0;
+    loop->n_holds = 0;
+    atomic_init(&loop->stop, false);
+
+    atomic_init(&loop->tasks, NULL);
+
+    return loop;
+
+close_wake:
+    close(loop->wake_fd);
+
+close_epoll:
+    close(loop->epoll_fd);
+
+free_loop:
+    free(loop);
+    return NULL;
+}
+
+void event_loop_free(struct event_loop *loop) {
+    assert(loop != NULL);
+
+    struct event_task *task = atomic_exchange(&loop->tasks, NULL);
+
+    while (task) {
+        struct event_task *next = task->next;
+        free(task);
+        task = next;
+    }
+
+    close(loop->wake_fd);
+    close(loop->epoll_fd);
+
+    free(loop);
+}
+
+bool event_loop_add(struct event_loop *loop, struct event_watch *watch, int fd, uint32_t events, event_cb cb, void *data) {
+    watch->fd = fd;
+    watch->cb = cb;
+    watch->data = data;
+
+    struct epoll_event ev = {
+        .events = events,
+        .data.ptr = watch
+    };
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+        syslog(LOG_ERR, "Error adding file descriptor to epoll instance: %m");
+        return false;
+    }
+
+    loop->n_watches++;
+    return true;
+}
+
+void event_loop_remove(struct event_loop *loop, struct event_watch *watch) {
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL)) {
+        syslog(LOG_ERR, "Error removing file descriptor from epoll instance: %m");
+    }
+
+    assert(loop->n_watches > 0);
+    loop->n_watches--;
+}
+
+bool event_loop_move(struct event_loop *loop, struct event_watch *watch, int fd, uint32_t events) {
+    struct epoll_event ev = {
+        .events = events,
+        .data.ptr = watch
+    };
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+        syslog(LOG_ERR, "Error adding file descriptor to epoll instance: %m");
+        return false;
+    }
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL)) {
+        syslog(LOG_ERR, "Error removing file descriptor from epoll instance: %m");
+    }
+
+    watch->fd = fd;
+    return true;
+}
+
+bool event_loop_post(struct event_loop *loop, event_task_cb cb, void *data) {
+    struct event_task *task = xmalloc(sizeof(struct event_task));
+
+    task->cb = cb;
+    task->data = data;
+    task->next = atomic_load(&loop->tasks);
+
+    while (!atomic_compare_exchange_weak(&loop->tasks, &task->next, task));
+
+    // The loop only needs to be woken when the first task is posted,
+    // since it takes all tasks at once.
+    if (!task->next)
+        wake(loop);
+
+    return true;
+}
+
+void event_loop_hold(struct event_loop *loop) {
+    loop->n_holds++;
+}
+
+void event_loop_release(struct event_loop *loop) {
+    assert(loop->n_holds > 0);
+    loop->n_holds--;
+}
+
+void event_loop_run(struct event_loop *loop, bool exit_idle) {
+    struct epoll_event events[EVENT_BATCH_SIZE];
+
+    while (!atomic_load(&loop->stop)) {
+        if (run_tasks(loop))
+            continue;
+
+        if (exit_idle && !loop->n_watches && !loop->n_holds)
+            break;
+
+        int n = epoll_wait(loop->epoll_fd, events, EVENT_BATCH_SIZE, -1);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            syslog(LOG_ERR, "epoll_wait() error: %m");
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            struct event_watch *watch = events[i].data.ptr;
+
+            if (!watch) {
+                clear_wake(loop);
+                continue;
+            }
+
+            watch->cb(loop, events[i].events, watch->data);
+        }
+    }
+}
+
+void event_loop_stop(struct event_loop *loop) {
+    atomic_store(&loop->stop, true);
+    wake(loop);
+}
+
+bool event_set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK)) {
+        syslog(LOG_ERR, "Error setting O_NONBLOCK on file descriptor: %m");
+        return false;
+    }
+
+    return true;
+}
+
+
+/* Timers */
+
+bool event_timer_start(struct event_loop *loop, struct event_timer *timer, unsigned interval, event_task_cb cb, void *data) {
+    timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (timer->fd < 0) {
+        syslog(LOG_ERR, "Error creating timer: %m");
+        return false;
+    }
+
+    timer->cb = cb;
+    timer->data = data;
+
+    struct itimerspec spec = {
+        .it_interval = {
+            .tv_sec = interval / 1000,
+            .tv_nsec = (interval % 1000) * 1000000L
+        }
+    };
+
+    spec.it_value = spec.it_interval;
+
+    if (timerfd_settime(timer->fd, 0, &spec, NULL)) {
+        syslog(LOG_ERR, "Error setting timer: %m");
+        goto close_timer;
+    }
+
+    if (!event_loop_add(loop, &timer->watch, timer->fd, EPOLLIN, timer_event, timer))
+        goto close_timer;
+
+    return true;
+
+close_timer:
+    close(timer->fd);
+    return false;
+}
+
+void event_timer_stop(struct event_loop *loop, struct event_timer *timer) {
+    event_loop_remove(loop, &timer->watch);
+
+    close(timer->fd);
+    timer->fd = -1;
+}
+
+void timer_event(struct event_loop *loop, uint32_t events, void *data) {
+    struct event_timer *timer = data;
+    uint64_t expirations;
+
+    // Timer stopped in the current iteration
+    if (timer->fd < 0)
+        return;
+
+    if (read(timer->fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    timer->cb(loop, timer->data);
+}
+
+
+/* Tasks */
+
+bool run_tasks(struct event_loop *loop) {
+    struct event_task *stack = atomic_exchange(&loop->tasks, NULL);
+
+    if (!stack)
+        return false;
+
+    // Reverse the stack to run tasks in the order they were posted
+    struct event_task *task = NULL;
+
+    while (stack) {
+        struct event_task *next = stack->next;
+
+        stack->next = task;
+        task = stack;
+
+        stack = next;
+    }
+
+    while (task) {
+        struct event_task *next = task->next;
+
+        task->cb(loop, task->data);
+        free(task);
+
+        task = next;
+    }
+
+    return true;
+}
+
+void clear_wake(struct event_loop *loop) {
+    eventfd_t value;
+    eventfd_read(loop->wake_fd, &value);
+}
+
+void wake(struct event_loop *loop) {
+    if (eventfd_write(loop->wake_fd, 1)) {
+        syslog(LOG_ERR, "Error waking event loop: %m");
+    }
+}
@@ -0,0 +1,216 @@
+#ifndef OAPROXY_EVENT_H
+#define OAPROXY_EVENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/epoll.h>
+
+/**
+ * Event loop multiplexing a set of file descriptors with epoll.
+ *
+ * Each loop is driven by a single thread. Tasks may be posted to a
+ * loop from any thread.
+ */
+struct event_loop;
+
+/**
+ * Event handler callback.
+ *
+ * @param loop   Event loop on which the event occurred.
+ * @param events Epoll event flags (EPOLLIN, EPOLLOUT, ...).
+ * @param data   Handler data pointer.
+ */
+typedef void (*event_cb)(struct event_loop *loop, uint32_t events, void *data);
+
+/**
+ * Task callback, for tasks posted to an event loop.
+ *
+ * @param loop Event loop on which the task is run.
+ * @param data Task data pointer.
+ */
+typedef void (*event_task_cb)(struct event_loop *loop, void *data);
+
+/**
+ * A file descriptor watched by an event loop.
+ *
+ * This struct is embedded in the object owning the file descriptor
+ * and must remain valid until it is removed from the loop.
+ */
+struct event_watch {
+    /** Watched file descriptor */
+    int fd;
+
+    /** Handler callback */
+    event_cb cb;
+    /** Handler data pointer */
+    void *data;
+};
+
+/**
+ * Create an event loop.
+ *
+ * @return The event loop, NULL if it could not be created.
+ */
+struct event_loop *event_loop_create(void);
+
+/**
+ * Free an event loop.
+ *
+ * Tasks which have not been run yet are discarded. File descriptors
+ * which are still being watched are not closed.
+ *
+ * @param loop The event loop.
+ */
+void event_loop_free(struct event_loop *loop);
+
+/**
+ * Watch a file descriptor for events.
+ *
+ * @param loop   Event loop.
+ * @param watch  Watch struct, initialized by this function.
+ * @param fd     File descriptor to watch.
+ * @param events Epoll events to watch for. Include EPOLLET for
+ *   edge-triggered notification.
+ * @param cb     Callback invoked when an event occurs.
+ * @param data   Data pointer passed to @a cb.
+ *
+ * @return True if the file descriptor was added to the loop.
+ */
+bool event_loop_add(struct event_loop *loop, struct event_watch *watch, int fd, uint32_t events, event_cb cb, void *data);
+
+/**
+ * Stop watching a file descriptor.
+ *
+ * Events for the file descriptor that were received in the current
+ * iteration of the loop may still be delivered, thus the owner of
+ * the watch should be freed using a task posted with
+ * event_loop_post().
+ *
+ * @param loop  Event loop.
+ * @param watch Watch struct passed to event_loop_add().
+ */
+void event_loop_remove(struct event_loop *loop, struct event_watch *watch);
+
+/**
+ * Move a watch to a different file descriptor, keeping its callback
+ * and data pointer.
+ *
+ * @param loop   Event loop.
+ * @param watch  Watch struct passed to event_loop_add().
+ * @param fd     New file descriptor to watch.
+ * @param events Epoll events to watch for.
+ *
+ * @return True if successful. If false is returned, the watch still
+ *   watches the previous file descriptor.
+ */
+bool event_loop_move(struct event_loop *loop, struct event_watch *watch, int fd, uint32_t events);
+
+/**
+ * Post a task to an event loop.
+ *
+ * The task is run by the loop's thread after the events received in
+ * the current iteration have been handled. This function may be
+ * called from any thread.
+ *
+ * @param loop Event loop.
+ * @param cb   Task callback.
+ * @param data Data pointer passed to @a cb.
+ *
+ * @return True if the task was queued.
+ */
+bool event_loop_post(struct event_loop *loop, event_task_cb cb, void *data);
+
+/**
+ * Prevent an event loop, run with exit_idle, from returning until
+ * event_loop_release() is called.
+ *
+ * Used by work, running on another thread, which posts a task to the
+ * loop once complete. Must be called on the loop's thread.
+ *
+ * @param loop Event loop.
+ */
+void event_loop_hold(struct event_loop *loop);
+
+/**
+ * Release a hold acquired with event_loop_hold().
+ *
+ * Must be called on the loop's thread.
+ *
+ * @param loop Event loop.
+ */
+void event_loop_release(struct event_loop *loop);
+
+/**
+ * Run the event loop.
+ *
+ * @param loop Event loop.
+ *
+ * @param exit_idle If true the loop returns when there are no file
+ *   descriptors left to watch, no pending tasks and no holds. Otherwise
+ *   the loop only returns when stopped by event_loop_stop().
+ */
+void event_loop_run(struct event_loop *loop, bool exit_idle);
+
+/**
+ * Stop an event loop.
+ *
+ * May be called from any thread.
+ *
+ * @param loop Event loop.
+ */
+void event_loop_stop(struct event_loop *loop);
+
+/**
+ * Periodic timer run by an event loop.
+ *
+ * This struct is embedded in the object owning the timer.
+ */
+struct event_timer {
+    /** Timer file descriptor */
+    int fd;
+    /** Timer file descriptor watch */
+    struct event_watch watch;
+
+    /** Callback invoked when the timer expires */
+    event_task_cb cb;
+    /** Data pointer passed to the callback */
+    void *data;
+};
+
+/**
+ * Start a periodic timer.
+ *
+ * @param loop     Event loop on which the timer callback is run.
+ * @param timer    Timer struct, initialized by this function.
+ * @param interval Interval between timer expirations, in
+ *   milliseconds.
+ * @param cb       Callback invoked each time the timer expires.
+ * @param data     Data pointer passed to @a cb.
+ *
+ * @return True if the timer was started.
+ */
+bool event_timer_start(struct event_loop *loop, struct event_timer *timer, unsigned interval, event_task_cb cb, void *data);
+
+/**
+ * Stop a timer started with event_timer_start().
+ *
+ * As with event_loop_remove(), an expiration received in the current
+ * iteration of the loop may still be delivered.
+ *
+ * @param loop  Event loop.
+ * @param timer Timer.
+ */
+void event_timer_stop(struct event_loop *loop, struct event_timer *timer);
+
+/**
+ * Put a file descriptor in non-blocking mode.
+ *
+ * @param fd File descriptor.
+ *
+ * @return True if successful.
+ */
+bool event_set_nonblocking(int fd);
+
+#endif /* OAPROXY_EVENT_H */
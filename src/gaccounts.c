@@ -1,68 +1,545 @@
 #include "gaccounts.h"
 
+#include <stdlib.h>
 #include <assert.h>
 #include <syslog.h>
+#include <string.h>
 
-static _Thread_local GoaClient *client = NULL;
+#include <pthread.h>
+
+#include "xmalloc.h"
+
+/**
+ * Function call queued to the GOA thread.
+ */
+struct goa_call {
+    /** Function */
+    goa_func func;
+    /** Data passed to the function */
+    void *data;
+
+    /** Lock protecting the done flag */
+    pthread_mutex_t lock;
+    /** Condition signalled when the function has returned */
+    pthread_cond_t cond;
+    /** True once the function has returned */
+    bool done;
+};
+
+/**
+ * Function queued to the GOA thread, which is not waited for.
+ */
+struct goa_task {
+    /** Function */
+    goa_func func;
+    /** Data passed to the function */
+    void *data;
+};
+
+/**
+ * Function called for each indexed account.
+ */
+struct foreach_call {
+    /** Function */
+    goa_account_func func;
+    /** Data passed to the function */
+    void *data;
+};
+
+/**
+ * Access token request in flight to the GOA daemon.
+ */
+struct token_call {
+    /** Account object */
+    GoaObject *account;
+
+    /** Callback receiving the token */
+    access_token_cb cb;
+    /** Data passed to the callback */
+    void *data;
+};
+
+/**
+ * State of a request creating the GOA client.
+ */
+struct client_request {
+    /** Receives the error information if an error occurs */
+    GError **error;
+    /** True if the client was created */
+    bool created;
+};
+
+/**
+ * GOA client, only used by the GOA thread.
+ */
+static GoaClient *client = NULL;
+
+/**
+ * Index of the client's accounts, mapping presentation identities to
+ * account objects. Only used by the GOA thread.
+ */
+static GHashTable *accounts = NULL;
+
+/**
+ * Main context of the GOA thread, through which the client receives
+ * its D-Bus messages.
+ */
+static GMainContext *context = NULL;
+
+/**
+ * Main loop run by the GOA thread.
+ */
+static GMainLoop *loop = NULL;
+
+/**
+ * True if the GOA thread is running.
+ */
+static bool running = false;
+
+/**
+ * Ensures the GOA thread is only started once.
+ */
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Run a function on the GOA thread, and wait for it to return.
+ *
+ * May be called from any thread other than the GOA thread.
+ *
+ * @param func Function to run
+ * @param data Data pointer passed to @a func
+ *
+ * @return True if the function was run, false if the GOA thread could
+ *   not be started.
+ */
+static bool call_sync(goa_func func, void *data);
+
+/**
+ * Start the GOA thread.
+ */
+static void start_thread(void);
+
+/**
+ * GOA thread routine. Runs the main loop.
+ *
+ * @param arg Unused
+ *
+ * @return NULL
+ */
+static void *goa_thread(void *arg);
+
+/**
+ * Queue a function to be dispatched by the GOA thread's main loop.
+ *
+ * @param func Function
+ * @param data Data pointer passed to @a func
+ */
+static void queue(GSourceFunc func, gpointer data);
+
+/**
+ * Run a queued function call, and signal the thread waiting for it.
+ *
+ * @param data The goa_call.
+ *
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean run_call(gpointer data);
+
+/**
+ * Run a queued task, and free it.
+ *
+ * @param data The goa_task.
+ *
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean run_task(gpointer data);
+
+/**
+ * Call the function of a foreach_call for an index entry.
+ *
+ * @param key   Presentation identity
+ * @param value Account object
+ * @param data  The foreach_call
+ */
+static void foreach_entry(gpointer key, gpointer value, gpointer data);
+
+/**
+ * Create the GOA client, if it has not been created already.
+ *
+ * @param data The client_request.
+ */
+static void create_client(void *data);
+
+/**
+ * Create the account index from the client's accounts, and watch the
+ * client for changes to the accounts.
+ */
+static void index_accounts(void);
+
+/**
+ * Add an account to the index.
+ *
+ * @param object Account object
+ */
+static void index_add(GoaObject *object);
+
+/**
+ * Remove an account from the index.
+ *
+ * @param object Account object
+ */
+static void index_remove(GoaObject *object);
+
+/**
+ * Check whether an index entry refers to a given account object.
+ *
+ * @param key    Presentation identity
+ * @param value  Account object of the entry
+ * @param object Account object
+ *
+ * @return True if @a value is @a object.
+ */
+static gboolean is_object(gpointer key, gpointer value, gpointer object);
+
+/**
+ * Handler for the client's account-added signal.
+ *
+ * @param client GOA client
+ * @param object Added account object
+ * @param data   Unused
+ */
+static void account_added(GoaClient *client, GoaObject *object, gpointer data);
+
+/**
+ * Handler for the client's account-removed signal.
+ *
+ * @param client GOA client
+ * @param object Removed account object
+ * @param data   Unused
+ */
+static void account_removed(GoaClient *client, GoaObject *object, gpointer data);
+
+/**
+ * Handler for the client's account-changed signal. The account is
+ * indexed again, since its presentation identity may have changed.
+ *
+ * @param client GOA client
+ * @param object Changed account object
+ * @param data   Unused
+ */
+static void account_changed(GoaClient *client, GoaObject *object, gpointer data);
+
+/**
+ * Completion callback of the request ensuring that an account's
+ * credentials are valid. Requests the access token if they are.
+ *
+ * @param source GOA account
+ * @param result Result of the request
+ * @param data   The token_call
+ */
+static void credentials_ready(GObject *source, GAsyncResult *result, gpointer data);
+
+/**
+ * Completion callback of the access token request.
+ *
+ * @param source OAuth2 interface of the account
+ * @param result Result of the request
+ * @param data   The token_call
+ */
+static void token_ready(GObject *source, GAsyncResult *result, gpointer data);
+
+/**
+ * Pass the result of an access token request to its callback, and
+ * free it.
+ *
+ * @param call       The token_call
+ * @param token      Access token, NULL on error
+ * @param expires_in Number of seconds for which the token is valid
+ * @param error      goa_error constant, if @a token is NULL
+ */
+static void complete_call(struct token_call *call, const gchar *token, gint expires_in, goa_error error);
+
+
+/* Implementation */
+
+bool gaccounts_start(GError **error) {
+    struct client_request req = {
+        .error = error,
+        .created = false
+    };
+
+    if (!call_sync(create_client, &req)) {
+        syslog(LOG_CRIT, "Could not start GOA thread");
+        return false;
+    }
+
+    return req.created;
+}
+
+bool call_sync(goa_func func, void *data) {
+    pthread_once(&start_once, start_thread);
+
+    if (!running) return false;
+
+    struct goa_call call = {
+        .func = func,
+        .data = data,
+        .done = false
+    };
+
+    pthread_mutex_init(&call.lock, NULL);
+    pthread_cond_init(&call.cond, NULL);
+
+    queue(run_call, &call);
+
+    pthread_mutex_lock(&call.lock);
+
+    while (!call.done)
+        pthread_cond_wait(&call.cond, &call.lock);
+
+    pthread_mutex_unlock(&call.lock);
+
+    pthread_cond_destroy(&call.cond);
+    pthread_mutex_destroy(&call.lock);
+
+    return true;
+}
+
+bool gaccounts_post(goa_func func, void *data) {
+    pthread_once(&start_once, start_thread);
+
+    if (!running) return false;
+
+    struct goa_task *task = xmalloc(sizeof(struct goa_task));
+
+    task->func = func;
+    task->data = data;
+
+    queue(run_task, task);
+    return true;
+}
 
 GoaClient *get_goaclient(GError ** error) {
     if (!client) {
         client = goa_client_new_sync(NULL, error);
+
+        if (client)
+            index_accounts();
     }
 
     return client;
 }
 
-GList * find_goaccount(GList *accounts, const char *user) {
-    GList *l;
+void start_thread(void) {
+    context = g_main_context_new();
+    loop = g_main_loop_new(context, FALSE);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
-    for (l = accounts; l != NULL; l = l->next) {
-        GoaAccount *account = goa_object_get_account(GOA_OBJECT(l->data));
-        const char *acc_id = goa_account_get_presentation_identity(account);
+    int err = pthread_create(&thread, &attr, goa_thread, NULL);
+    pthread_attr_destroy(&attr);
 
-        if (!strcmp(user, acc_id)) {
-            break;
-        }
+    if (err) {
+        syslog(LOG_ERR, "Error creating GOA thread: %s", strerror(err));
+        return;
     }
 
-    return l;
+    running = true;
 }
 
-gchar *get_access_token(GList *account, goa_error *gerr) {
-    GError *error = NULL;
-    gchar *access_token = NULL;
+void *goa_thread(void *arg) {
+    // The client dispatches its D-Bus messages, and signals, to the
+    // thread-default context of the thread in which it is created.
+    g_main_context_push_thread_default(context);
+    g_main_loop_run(loop);
 
-    GoaAccount *acc = goa_object_get_account(GOA_OBJECT(account->data));
-    assert(acc);
+    return NULL;
+}
 
-    if (!goa_account_call_ensure_credentials_sync(acc, NULL, NULL, &error)) {
-        *gerr = ACCOUNT_ERROR_CRED;
-        syslog(LOG_ERR, "Could not verify gnome online account credentials: %s", error->message);
+void queue(GSourceFunc func, gpointer data) {
+    // An idle source is always dispatched by the thread running the
+    // context, unlike g_main_context_invoke() which may call the
+    // function in the calling thread.
+    GSource *source = g_idle_source_new();
+    g_source_set_callback(source, func, data, NULL);
+    g_source_attach(source, context);
+    g_source_unref(source);
+}
+
+gboolean run_call(gpointer data) {
+    struct goa_call *call = data;
+
+    call->func(call->data);
+
+    pthread_mutex_lock(&call->lock);
+
+    call->done = true;
+    pthread_cond_signal(&call->cond);
+
+    pthread_mutex_unlock(&call->lock);
+
+    return G_SOURCE_REMOVE;
+}
+
+gboolean run_task(gpointer data) {
+    struct goa_task *task = data;
+
+    task->func(task->data);
+    free(task);
+
+    return G_SOURCE_REMOVE;
+}
+
+void create_client(void *data) {
+    struct client_request *req = data;
+    req->created = get_goaclient(req->error) != NULL;
+}
+
+GoaObject * find_goaccount(const char *user, goa_error *gerr) {
+    GError *error = NULL;
+
+    if (!get_goaclient(&error)) {
+        *gerr = ACCOUNT_ERROR_TOKEN;
+        syslog(LOG_ERR, "Could not create GoaClient: %s", error->message);
 
         g_error_free(error);
         return NULL;
     }
 
-    GoaOAuth2Based *oauth2 =
-        goa_object_get_oauth2_based(GOA_OBJECT(account->data));
+    GoaObject *object = g_hash_table_lookup(accounts, user);
+
+    if (!object)
+        *gerr = ACCOUNT_ERROR_USER;
+
+    return object;
+}
 
-    if (oauth2) {
-        if (!goa_oauth2_based_call_get_access_token_sync(oauth2,
-                                                         &access_token,
-                                                         NULL,
-                                                         NULL,
-                                                         NULL)) {
-            access_token = NULL;
-            *gerr = ACCOUNT_ERROR_TOKEN;
+void foreach_goaccount(goa_account_func func, void *data) {
+    if (!get_goaclient(NULL)) return;
 
-            syslog(LOG_ERR, "Error obtaining OAUTH2 object for gnome online account");
-        }
+    struct foreach_call call = {
+        .func = func,
+        .data = data
+    };
 
-        g_clear_object(&oauth2);
+    g_hash_table_foreach(accounts, foreach_entry, &call);
+}
+
+void foreach_entry(gpointer key, gpointer value, gpointer data) {
+    struct foreach_call *call = data;
+    call->func(key, GOA_OBJECT(value), call->data);
+}
+
+void index_accounts(void) {
+    accounts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_object_unref);
+
+    GList *objects = goa_client_get_accounts(client);
+
+    for (GList *l = objects; l != NULL; l = l->next) {
+        index_add(GOA_OBJECT(l->data));
     }
-    else {
-        *gerr = ACCOUNT_ERROR_TOKEN;
+
+    g_list_free_full(objects, (GDestroyNotify)g_object_unref);
+
+    g_signal_connect(client, "account-added", G_CALLBACK(account_added), NULL);
+    g_signal_connect(client, "account-removed", G_CALLBACK(account_removed), NULL);
+    g_signal_connect(client, "account-changed", G_CALLBACK(account_changed), NULL);
+}
+
+void index_add(GoaObject *object) {
+    GoaAccount *account = goa_object_peek_account(object);
+    if (!account) return;
+
+    const gchar *identity = goa_account_get_presentation_identity(account);
+    if (!identity) return;
+
+    g_hash_table_replace(accounts, g_strdup(identity), g_object_ref(object));
+}
+
+void index_remove(GoaObject *object) {
+    g_hash_table_foreach_remove(accounts, is_object, object);
+}
+
+gboolean is_object(gpointer key, gpointer value, gpointer object) {
+    return value == object;
+}
+
+void account_added(GoaClient *client, GoaObject *object, gpointer data) {
+    index_add(object);
+}
+
+void account_removed(GoaClient *client, GoaObject *object, gpointer data) {
+    index_remove(object);
+}
+
+void account_changed(GoaClient *client, GoaObject *object, gpointer data) {
+    index_remove(object);
+    index_add(object);
+}
+
+void request_access_token(GoaObject *account, access_token_cb cb, void *data) {
+    struct token_call *call = xmalloc(sizeof(struct token_call));
+
+    call->account = g_object_ref(account);
+    call->cb = cb;
+    call->data = data;
+
+    GoaAccount *acc = goa_object_peek_account(account);
+    assert(acc);
+
+    goa_account_call_ensure_credentials(acc, NULL, credentials_ready, call);
+}
+
+void credentials_ready(GObject *source, GAsyncResult *result, gpointer data) {
+    struct token_call *call = data;
+    GError *error = NULL;
+
+    if (!goa_account_call_ensure_credentials_finish(GOA_ACCOUNT(source), NULL, result, &error)) {
+        syslog(LOG_ERR, "Could not verify gnome online account credentials: %s", error->message);
+        g_error_free(error);
+
+        complete_call(call, NULL, 0, ACCOUNT_ERROR_CRED);
+        return;
+    }
+
+    GoaOAuth2Based *oauth2 = goa_object_peek_oauth2_based(call->account);
+
+    if (!oauth2) {
+        complete_call(call, NULL, 0, ACCOUNT_ERROR_TOKEN);
+        return;
+    }
+
+    goa_oauth2_based_call_get_access_token(oauth2, NULL, token_ready, call);
+}
+
+void token_ready(GObject *source, GAsyncResult *result, gpointer data) {
+    struct token_call *call = data;
+
+    gchar *token = NULL;
+    gint expires_in = 0;
+
+    if (!goa_oauth2_based_call_get_access_token_finish(GOA_OAUTH2_BASED(source),
+                                                       &token,
+                                                       &expires_in,
+                                                       result,
+                                                       NULL)) {
+        syslog(LOG_ERR, "Error obtaining OAUTH2 object for gnome online account");
+
+        complete_call(call, NULL, 0, ACCOUNT_ERROR_TOKEN);
+        return;
     }
 
-    return access_token;
+    complete_call(call, token, expires_in, 0);
+    g_free(token);
+}
+
+void complete_call(struct token_call *call, const gchar *token, gint expires_in, goa_error error) {
+    call->cb(token, expires_in, error, call->data);
+
+    g_object_unref(call->account);
+    free(call);
 }
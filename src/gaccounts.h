@@ -1,6 +1,8 @@
 #ifndef OAPROXY_GACCOUNTS_H
 #define OAPROXY_GACCOUNTS_H
 
+#include <stdbool.h>
+
 #define GOA_API_IS_SUBJECT_TO_CHANGE
 #include <goa/goa.h>
 
@@ -20,11 +22,59 @@ typedef enum goa_error {
      * Error obtaining token/oauth2 object.
      */
     ACCOUNT_ERROR_TOKEN,
+
+    /**
+     * No account found for the username.
+     */
+    ACCOUNT_ERROR_USER
 } goa_error;
 
+/**
+ * Function run on the GOA thread.
+ *
+ * @param data Data pointer passed to gaccounts_post().
+ */
+typedef void (*goa_func)(void *data);
+
+/**
+ * Start the GOA thread and create the Gnome Online Accounts client.
+ *
+ * A single client is shared by all sessions. It is owned by a
+ * dedicated thread, running a GLib main loop which dispatches the
+ * client's D-Bus messages. Account lookups are queued to this
+ * thread with gaccounts_post(), and access tokens are requested on
+ * it asynchronously with request_access_token().
+ *
+ * The thread is started by the first call to gaccounts_post() if this
+ * function is not called.
+ *
+ * @param error If given pointer to a GError which is filled with the
+ *   error information if an error occurs.
+ *
+ * @return True if the client was created. If false, creating the
+ *   client is retried by the next request.
+ */
+bool gaccounts_start(GError **error);
+
+/**
+ * Queue a function to be run on the GOA thread, without waiting for
+ * it to run.
+ *
+ * May be called from any thread.
+ *
+ * @param func Function to run
+ * @param data Data pointer passed to @a func
+ *
+ * @return True if the function was queued, false if the GOA thread
+ *   could not be started.
+ */
+bool gaccounts_post(goa_func func, void *data);
+
 /**
  * Retrieve the Gnome Online Accounts client.
  *
+ * Must be called on the GOA thread.
+ *
  * @param error If given pointer to a GError which is filled with the
  *   error information if an error occurs.
  *
@@ -35,25 +85,70 @@ GoaClient *get_goaclient(GError ** error);
 /**
  * Find a GOA account for a particular user.
  *
- * @param accounts List of all accounts
+ * Accounts are looked up in an index, by presentation identity, which
+ * is kept up to date from the client's account signals.
+ *
+ * Must be called on the GOA thread.
+ *
  * @param user Username
  *
- * @return Pointer to the node containing the account, NULL if no
- *   account was found for the given username.
+ * @param error Pointer to variable receiving goa_error constant on
+ *   error.
+ *
+ * @return The account object, NULL if no account was found for the
+ *   given username. The object is owned by the index, and remains
+ *   valid until control returns to the GOA thread's main loop.
  */
-GList * find_goaccount(GList *accounts, const char *user);
+GoaObject * find_goaccount(const char *user, goa_error *error);
 
 /**
- * Retrieve the access token for a particular GOA account.
+ * Function called for each GOA account by foreach_goaccount().
  *
- * @param account GOA account
+ * @param user    Presentation identity of the account
+ * @param account Account object
+ * @param data    Data pointer passed to foreach_goaccount()
+ */
+typedef void (*goa_account_func)(const char *user, GoaObject *account, void *data);
+
+/**
+ * Call a function for each GOA account in the index.
  *
- * @param error Pointer to variable receiving goa_error constant on
- *   error.
+ * Must be called on the GOA thread. The function must not return
+ * control to the GOA thread's main loop.
  *
- * @return Access token, or NULL if their was an error.
+ * @param func Function to call
+ * @param data Data pointer passed to @a func
+ */
+void foreach_goaccount(goa_account_func func, void *data);
+
+/**
+ * Callback receiving the access token requested with
+ * request_access_token().
+ *
+ * @param token      Access token, NULL if there was an error. Only
+ *   valid until the callback returns.
+ * @param expires_in Number of seconds for which the token is valid,
+ *   0 if unknown.
+ * @param error      goa_error constant, if @a token is NULL.
+ * @param data       Data pointer passed to request_access_token().
+ */
+typedef void (*access_token_cb)(const gchar *token, gint expires_in, goa_error error, void *data);
+
+/**
+ * Request the access token for a particular GOA account.
+ *
+ * The token is requested asynchronously, and @a cb is called on the
+ * GOA thread once it has been obtained. Each call makes its own
+ * request to the GOA daemon; concurrent requests for the same user
+ * are coalesced by the token cache (tokens.h).
+ *
+ * Must be called on the GOA thread.
+ *
+ * @param account GOA account
+ * @param cb      Callback receiving the token
+ * @param data    Data pointer passed to @a cb
  */
-gchar *get_access_token(GList *account, goa_error *error);
+void request_access_token(GoaObject *account, access_token_cb cb, void *data);
 
 
 #endif /* OAPROXY_GACCOUNTS_H */
@@ -0,0 +1,268 @@
+#include "handshake.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <syslog.h>
+
+#include <pthread.h>
+
+#include "xmalloc.h"
+#include "ssl.h"
+
+/**
+ * Stack size of handshake threads.
+ */
+#define HANDSHAKE_STACK_SIZE (256 * 1024)
+
+/**
+ * Epoll events watched on the server connection
+ */
+#define HANDSHAKE_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+/**
+ * Thread performing handshakes
+ */
+struct handshake_thread {
+    /** Event loop driving the handshakes */
+    struct event_loop *loop;
+    /** Thread */
+    pthread_t thread;
+};
+
+/**
+ * Offloaded handshake
+ */
+struct handshake_job {
+    /** Event loop from which the handshake was offloaded */
+    struct event_loop *origin;
+
+    /** Server connection */
+    BIO *bio;
+    /** Server host */
+    const char *host;
+
+    /** Server socket event loop watch */
+    struct event_watch watch;
+
+    /** True once the handshake has completed or failed */
+    bool done;
+    /** Result passed to the callback */
+    int result;
+
+    /** Completion callback */
+    handshake_cb cb;
+    /** Callback data pointer */
+    void *data;
+};
+
+/**
+ * Handshake threads
+ */
+static struct {
+    /** Array of threads */
+    struct handshake_thread *threads;
+    /** Number of threads */
+    size_t n;
+
+    /** Index of the thread to assign the next handshake to */
+    atomic_size_t next;
+} threads;
+
+/**
+ * Thread start routine of a handshake thread.
+ *
+ * @param thread Pointer to the handshake_thread struct.
+ * @return NULL
+ */
+static void *run_thread(void *thread);
+
+/**
+ * Event loop task which starts watching the server connection of a
+ * handshake, run by the handshake thread.
+ *
+ * @param loop Handshake event loop.
+ * @param job  The handshake_job.
+ */
+static void job_start(struct event_loop *loop, void *job);
+
+/**
+ * Event loop callback for the server socket of a handshake.
+ *
+ * @param loop   Handshake event loop.
+ * @param events Epoll events.
+ * @param job    The handshake_job.
+ */
+static void job_event(struct event_loop *loop, uint32_t events, void *job);
+
+/**
+ * Stop watching the server connection of a completed handshake, and
+ * return it to the origin event loop.
+ *
+ * @param loop   Handshake event loop.
+ * @param job    The handshake.
+ * @param result Result of the handshake.
+ */
+static void job_finish(struct event_loop *loop, struct handshake_job *job, int result);
+
+/**
+ * Event loop task which returns a handshake to its origin event loop.
+ * Run by the handshake thread once the events of the current
+ * iteration have been handled.
+ *
+ * @param loop Handshake event loop.
+ * @param job  The handshake_job.
+ */
+static void job_return(struct event_loop *loop, void *job);
+
+/**
+ * Event loop task which invokes the callback of a completed
+ * handshake, run by the origin event loop.
+ *
+ * @param loop Origin event loop.
+ * @param job  The handshake_job.
+ */
+static void job_done(struct event_loop *loop, void *job);
+
+
+/* Implementation */
+
+bool handshake_threads_start(size_t n) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+
+    if (pthread_attr_setstacksize(&attr, HANDSHAKE_STACK_SIZE)) {
+        syslog(LOG_WARNING, "Could not set handshake thread stack size");
+    }
+
+    threads.threads = xmalloc(n * sizeof(struct handshake_thread));
+    threads.n = 0;
+    atomic_init(&threads.next, 0);
+
+    for (size_t i = 0; i < n; ++i) {
+        struct handshake_thread *thread = &threads.threads[threads.n];
+
+        thread->loop = event_loop_create();
+        if (!thread->loop) break;
+
+        if (pthread_create(&thread->thread, &attr, run_thread, thread)) {
+            syslog(LOG_ERR, "Error creating handshake thread: %m");
+
+            event_loop_free(thread->loop);
+            break;
+        }
+
+        threads.n++;
+    }
+
+    pthread_attr_destroy(&attr);
+
+    if (!threads.n) {
+        handshake_threads_stop();
+        return false;
+    }
+
+    return true;
+}
+
+void handshake_threads_stop(void) {
+    for (size_t i = 0; i < threads.n; ++i) {
+        event_loop_stop(threads.threads[i].loop);
+        pthread_join(threads.threads[i].thread, NULL);
+
+        event_loop_free(threads.threads[i].loop);
+    }
+
+    free(threads.threads);
+
+    threads.threads = NULL;
+    threads.n = 0;
+}
+
+void *run_thread(void *obj) {
+    struct handshake_thread *thread = obj;
+
+    event_loop_run(thread->loop, false);
+    return NULL;
+}
+
+bool handshake_offload(struct event_loop *loop, BIO *bio, const char *host, handshake_cb cb, void *data) {
+    if (!threads.n)
+        return false;
+
+    struct handshake_job *job = xmalloc(sizeof(struct handshake_job));
+
+    job->origin = loop;
+    job->bio = bio;
+    job->host = host;
+    job->done = false;
+    job->result = 0;
+    job->cb = cb;
+    job->data = data;
+
+    size_t index = atomic_fetch_add(&threads.next, 1) % threads.n;
+
+    if (!event_loop_post(threads.threads[index].loop, job_start, job)) {
+        free(job);
+        return false;
+    }
+
+    return true;
+}
+
+
+/* Handshake Thread */
+
+void job_start(struct event_loop *loop, void *obj) {
+    struct handshake_job *job = obj;
+
+    // The initial event reports the socket as writable, which
+    // continues the handshake.
+    if (!event_loop_add(loop, &job->watch, BIO_get_fd(job->bio, NULL), HANDSHAKE_EVENTS, job_event, job)) {
+        job->result = -1;
+        event_loop_post(job->origin, job_done, job);
+    }
+}
+
+void job_event(struct event_loop *loop, uint32_t events, void *obj) {
+    struct handshake_job *job = obj;
+
+    if (job->done)
+        return;
+
+    int ret = server_handshake(job->bio, job->host);
+
+    // The descriptor changes once the connection is established
+    int fd = BIO_get_fd(job->bio, NULL);
+
+    if (!ret && fd != job->watch.fd && !event_loop_move(loop, &job->watch, fd, HANDSHAKE_EVENTS))
+        ret = -1;
+
+    if (ret)
+        job_finish(loop, job, ret);
+}
+
+void job_finish(struct event_loop *loop, struct handshake_job *job, int result) {
+    job->done = true;
+    job->result = result;
+
+    event_loop_remove(loop, &job->watch);
+
+    // Events for the socket may still be delivered in this iteration,
+    // thus the job is only handed back afterwards.
+    event_loop_post(loop, job_return, job);
+}
+
+void job_return(struct event_loop *loop, void *obj) {
+    struct handshake_job *job = obj;
+    event_loop_post(job->origin, job_done, job);
+}
+
+
+/* Origin Thread */
+
+void job_done(struct event_loop *loop, void *obj) {
+    struct handshake_job *job = obj;
+
+    job->cb(loop, job->result, job->data);
+    free(job);
+}
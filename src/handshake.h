@@ -0,0 +1,62 @@
+#ifndef OAPROXY_HANDSHAKE_H
+#define OAPROXY_HANDSHAKE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <openssl/bio.h>
+
+#include "event.h"
+
+/**
+ * Callback function invoked when an offloaded handshake completes.
+ *
+ * @param loop   Event loop from which the handshake was offloaded.
+ * @param result 1 if the handshake completed, -1 if it failed.
+ * @param data   Data pointer passed to handshake_offload().
+ */
+typedef void (*handshake_cb)(struct event_loop *loop, int result, void *data);
+
+/**
+ * Start the threads on which TLS handshakes with the remote servers
+ * are performed, so that they do not delay the sessions running on
+ * the worker event loops.
+ *
+ * Must be called before handshake_offload() is called from any other
+ * thread.
+ *
+ * @param n Number of threads.
+ *
+ * @return True if at least one thread was started.
+ */
+bool handshake_threads_start(size_t n);
+
+/**
+ * Stop the handshake threads.
+ *
+ * Handshakes in progress are abandoned, and their callbacks are not
+ * invoked. Must only be called once no more handshakes are offloaded.
+ */
+void handshake_threads_stop(void);
+
+/**
+ * Perform the TLS handshake of a server connection on a handshake
+ * thread.
+ *
+ * Until @a cb is invoked, the connection is owned by the handshake
+ * thread and must not be used.
+ *
+ * @param loop Event loop on which @a cb is invoked.
+ * @param bio  Server connection returned by server_connect().
+ * @param host Server host, used for error reporting. Must remain
+ *   valid until @a cb is invoked.
+ * @param cb   Callback invoked when the handshake completes.
+ * @param data Data pointer passed to @a cb.
+ *
+ * @return True if the handshake was offloaded, false if the
+ *   handshake threads are not running, in which case the handshake
+ *   should be performed by the caller.
+ */
+bool handshake_offload(struct event_loop *loop, BIO *bio, const char *host, handshake_cb cb, void *data);
+
+#endif /* OAPROXY_HANDSHAKE_H */
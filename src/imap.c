@@ -6,6 +6,7 @@
 #include <syslog.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <errno.h>
 #include <assert.h>
 
 #include <sys/types.h>
@@ -18,15 +19,14 @@
 
 #include "xmalloc.h"
 #include "ssl.h"
+#include "relay.h"
 #include "gaccounts.h"
-#include "xoauth2.h"
+#include "tokens.h"
 #include "b64.h"
 
 #include "imap_cmd.h"
 #include "imap_reply.h"
 
-#define RECV_BUF_SIZE 512 * 4
-
 #define IMAP_CAP_AUTH "AUTH="
 #define IMAP_CAP_AUTH_LEN 5
 
@@ -34,71 +34,90 @@
 #define IMAP_CAP_LOGINDISABLED_LEN 13
 
 /**
- * Perform the initial IMAP authentication step.
+ * IMAP protocol state of a session, only used while the client
+ * authenticates.
+ */
+struct imap_session {
+    /** Client command stream */
+    struct imap_cmd_stream *c_stream;
+    /** Server reply stream */
+    struct imap_reply_stream *s_stream;
+
+    /**
+     * Client response request of the LOGIN command being handled,
+     * NULL if there is none. No further commands are read until it
+     * completes.
+     */
+    struct token_request *login;
+    /** Tag of the LOGIN command */
+    char *tag;
+    /** Username of the LOGIN command */
+    char *user;
+};
+
+/**
+ * Begin the initial IMAP authentication step, after the connection
+ * to the server has been established.
  *
- * Waits for the client to send an authentication command and
- * substitutes it with XOAUTH2. After the authentication commands are
- * sent to the server, this function returns.
+ * Client commands are parsed and an authentication command is
+ * substituted with XOAUTH2. After the authentication commands are
+ * sent to the server, the session switches to forwarding data.
  *
- * @param c_fd  Client socket file descriptor
- * @param s_bio Server OpenSSL BIO object
- * @param s_fd  Server file descriptor
+ * @param relay Relay session
  *
- * @return True if all data was sent successfully that is the proxy
- *   should continue running, this does not mean authentication was
- *   successful.
+ * @return True if successful.
  */
-static bool imap_authenticate(int c_fd, BIO * s_bio, int s_fd);
+static bool imap_authenticate(struct relay *relay);
 
 /**
- * Forward the remaining data in the client command stream's buffer to
- * the server.
- *
- * @param stream Client command stream
- * @param s_bio Server BIO object
+ * Switch the session to forwarding data between client and server,
+ * after the authentication commands have been sent.
  *
- * @return True if all the data in the stream was forwarded
- *   successfully.
+ * @param relay Relay session
  */
-static bool send_client_buf_data(struct imap_cmd_stream *stream, BIO *s_bio);
+static void imap_begin_relay(struct relay *relay);
 
 /**
- * Forward the remaining data in the server reply stream's buffer to
- * the client.
+ * Free the IMAP protocol state of a session.
  *
- * @param stream Server reply stream
- * @param c_fd   Client socket file descriptor
- *
- * @return True if all the data in the stream was forwarded
- *   successfully.
+ * @param data IMAP session
  */
-static bool send_server_buf_data(struct imap_reply_stream *stream, int c_fd);
+static void imap_session_free(void *data);
 
 /**
- * Handle a command from the client.
+ * Handle the commands received from the client.
  *
- * @param stream IMAP command stream
- * @param s_bio  Server OpenSSL BIO object
+ * @param relay    Relay session
+ * @param progress Set to true if any data was received
  *
- * @return 1 - if the client has been authenticated, 0 - otherwise, -1
- *   if there was an error sending or receiving data.
+ * @return False if there was an error handling a command.
  */
-static int handle_client_command(struct imap_cmd_stream *stream, BIO *s_bio);
+static bool handle_client_command(struct relay *relay, bool *progress);
 
 /**
- * Handle an IMAP LOGIN command, by sending XOAUTH2 authentication
- * command to server.
+ * Handle an IMAP LOGIN command, by requesting the XOAUTH2 client
+ * response of the user. The authentication command is sent to the
+ * server once the request completes.
  *
- * @param c_fd Client socket file descriptor
- * @param s_bio Server OpenSSL BIO object
- * @param cmd  IMAP login command structure
+ * @param relay   Relay session
+ * @param cmd     IMAP login command structure
  *
- * @return 1 - if the XOAUTH2 authentication command was sent
- *   successfully to the server, 0 - if an invalid user was entered or
- *   there was an error generating the token, -1 if there was an error
- *   sending or receiving data.
+ * @return True if the response was requested or the syntax error
+ *   reported, false if there was an error sending the error response.
+ */
+static bool imap_login(struct relay *relay, const struct imap_cmd *cmd);
+
+/**
+ * Send the XOAUTH2 authentication command to the server, once the
+ * client response of a LOGIN command has been obtained, and switch
+ * the session to forwarding data. Reports the error to the client if
+ * the response could not be obtained.
+ *
+ * @param resp Client response, NULL on error
+ * @param gerr GOA account error, if @a resp is NULL
+ * @param data Relay session
  */
-static int imap_login(int c_fd, BIO * s_bio, const struct imap_cmd *cmd);
+static void imap_login_ready(const char *resp, goa_error gerr, void *data);
 
 
 /* Error Reporting */
@@ -107,62 +126,60 @@ static int imap_login(int c_fd, BIO * s_bio, const struct imap_cmd *cmd);
  * Report authentication error (username not found in gnome online
  * accounts) to client.
  *
- * @param fd  Client socket file descriptor
- * @param tag IMAP command tag
+ * @param relay   Relay session
+ * @param tag     IMAP command tag
  *
  * @return True if the error response was sent successfully to the
  * client.
  */
-static bool imap_invalid_user(int fd, const char *tag);
+static bool imap_invalid_user(struct relay *relay, const char *tag);
 
 /**
  * Report gnome online account error to IMAP client.
  *
- * @param fd   Client socket file descriptor
- * @param gerr GOA account error
- * @param tag  IMAP command tag
+ * @param relay   Relay session
+ * @param gerr    GOA account error
+ * @param tag     IMAP command tag
  *
  * @return True if the error response was sent successfully to the
  *   client.
  */
-static bool imap_auth_error(int fd, goa_error gerr, const char *tag);
+static bool imap_auth_error(struct relay *relay, goa_error gerr, const char *tag);
 
 /**
  * Report a syntax error in LOGIN command to IMAP client.
  *
- * @param fd  Client socket descriptor
- * @param tag IMAP command tag
+ * @param relay   Relay session
+ * @param tag     IMAP command tag
+ * @param msg     Error message
  *
  * @return True if the error response was sent successfully.
  */
-static bool imap_login_syntax_error(int fd, const char *tag);
+static bool imap_login_syntax_error(struct relay *relay, const char *tag, const char *msg);
 
 
 /* Handling Server Replies */
 
 /**
- * Handle a reply from the server.
+ * Handle the replies received from the server.
  *
- * @param stream IMAP reply stream
- * @param c_fd   Client socket descriptor
+ * @param relay    Relay session
+ * @param progress Set to true if any data was received
  *
- * @return True if the reply was handled successfully, false if there
- *   was an error sending/receiving data.
+ * @return Always true, an error reading a reply ends the server's
+ *   stream.
  */
-static bool handle_server_reply(struct imap_reply_stream *stream, int c_fd);
+static bool handle_server_reply(struct relay *relay, bool *progress);
 
 /**
  * Process a CAPABILITY response from the server. All AUTH= methods
  * are removed as well as the LOGINDISABLED response before forwarding
  * the response to the client.
  *
- * @param c_fd Client socket file descriptor
- * @param reply IMAP reply
- *
- * @return True if the reply was handled successfully, false if there
- *   was an error sending/receiving data.
+ * @param relay   Relay session
+ * @param reply   IMAP reply
  */
-static bool send_capabilites(int c_fd, const struct imap_reply *reply);
+static void send_capabilites(struct relay *relay, const struct imap_reply *reply);
 
 /**
  * Filter a portion of a CAPABILITY response.
@@ -198,323 +215,235 @@ static const char * filter_capability(const char *data, size_t *n, char *out, si
  */
 static const char *skip_to_space(const char *data, size_t *n);
 
-/* Sending Data */
 
-/**
- * Send data to the server.
- *
- * @param bio Server BIO object
- * @param data Block of data to send
- * @param n Size of data in bytes
- *
- * @return True if the data was sent successfully, false otherwise.
- */
-static bool imap_server_send(BIO *bio, const char *data, size_t n);
+/* Implementation */
 
 /**
- * Send data to the client.
- *
- * @param fd Client socket file descriptor
- * @param data block of data to send
- * @param n Size of data in bytes
- *
- * @return True if the data was sent successfully, false otherwise.
+ * IMAP protocol filter
  */
-static bool imap_client_send(int fd, const char *data, size_t n);
-
-
-/* Implementation */
+static const struct relay_filter imap_filter = {
+    .name = "IMAP",
+    .start = imap_authenticate,
+    .client_data = handle_client_command,
+    .server_data = handle_server_reply,
+    .free = imap_session_free
+};
 
 void imap_handle_client(int c_fd, const char *host) {
-    BIO *bio = server_connect(host);
-    if (!bio) {
-        goto close_client;
-    }
+    struct upstream *upstream = upstream_create(host);
 
-    int s_fd = BIO_get_fd(bio, NULL);
-    int maxfd = c_fd < s_fd ? s_fd : c_fd;
-
-    if (!imap_authenticate(c_fd, bio, s_fd)) {
-        goto close_server;
+    if (!upstream) {
+        close(c_fd);
+        return;
     }
 
-    while (1) {
-        fd_set rfds;
-
-        FD_ZERO(&rfds);
-        FD_SET(c_fd, &rfds);
-        FD_SET(s_fd, &rfds);
-
-        int retval = select(maxfd+1, &rfds, NULL, NULL, NULL);
-
-        if (retval < 0) {
-            syslog(LOG_ERR, "IMAP: select() error: %m");
-            break;
-        }
-
-        if (FD_ISSET(s_fd, &rfds)) {
-            char s_data[RECV_BUF_SIZE];
-            size_t s_n = BIO_read(bio, s_data, sizeof(s_data));
-
-            if (s_n < 0) {
-                ssl_log_error("IMAP: Error reading data from server");
-                break;
-            }
-            else if (s_n == 0) {
-                syslog(LOG_NOTICE, "IMAP: Server closed connection");
-                break;
-            }
-
-            if (!imap_client_send(c_fd, s_data, s_n)) {
-                break;
-            }
-        }
-
-        if (FD_ISSET(c_fd, &rfds)) {
-            char c_data[RECV_BUF_SIZE];
-            size_t c_n = recv(c_fd, c_data, sizeof(c_data), 0);
+    struct event_loop *loop = event_loop_create();
 
-            if (c_n < 0) {
-                syslog(LOG_ERR, "IMAP: Error sending data to client: %m");
-                break;
-            }
-            else if (c_n == 0) {
-                syslog(LOG_NOTICE, "IMAP: Client closed connection");
-                break;
-            }
+    if (!loop) {
+        close(c_fd);
+        goto unref_upstream;
+    }
 
-            if (!imap_server_send(bio, c_data, c_n)) {
-                break;
-            }
-        }
+    if (imap_start_client(loop, c_fd, upstream, NULL)) {
+        event_loop_run(loop, true);
     }
 
-close_server:
-    BIO_free_all(bio);
+    event_loop_free(loop);
 
-close_client:
-    close(c_fd);
+unref_upstream:
+    upstream_unref(upstream);
 }
 
-bool imap_authenticate(int c_fd, BIO * s_bio, int s_fd) {
-    bool succ = true;
+bool imap_start_client(struct event_loop *loop, int c_fd, struct upstream *upstream, BIO *bio) {
+    struct imap_session *session = xmalloc(sizeof(struct imap_session));
 
-    struct imap_cmd_stream *c_stream = imap_cmd_stream_create(c_fd, false);
-    if (!c_stream) {
-        return false;
-    }
-
-    struct imap_reply_stream *s_stream = imap_reply_stream_create(s_bio);
-    if (!s_stream) {
-        succ = false;
-        goto close_cmd_stream;
-    }
+    session->c_stream = NULL;
+    session->s_stream = NULL;
 
-    int maxfd = c_fd < s_fd ? s_fd : c_fd;
+    session->login = NULL;
+    session->tag = NULL;
+    session->user = NULL;
 
-    while (1) {
-        fd_set rfds;
-
-        FD_ZERO(&rfds);
-        FD_SET(c_fd, &rfds);
-        FD_SET(s_fd, &rfds);
+    return relay_start(loop, c_fd, upstream, bio, &imap_filter, session);
+}
 
-        int retval = select(maxfd+1, &rfds, NULL, NULL, NULL);
+void imap_session_free(void *data) {
+    struct imap_session *session = data;
 
-        if (retval < 0) {
-            syslog(LOG_ERR, "IMAP: select() error: %m");
-            succ = false;
-            goto close;
-        }
+    if (session->c_stream) imap_cmd_stream_free(session->c_stream);
+    if (session->s_stream) imap_reply_stream_free(session->s_stream);
 
-        if (FD_ISSET(s_fd, &rfds)) {
-            if (!handle_server_reply(s_stream, c_fd)) {
-                succ = false;
-                goto close;
-            }
-        }
+    if (session->login) token_request_cancel(session->login);
 
-        if (FD_ISSET(c_fd, &rfds)) {
-            int ret = handle_client_command(c_stream, s_bio);
+    free(session->tag);
+    free(session->user);
+    free(session);
+}
 
-            if (ret == 1) {
-                goto finish;
-            }
-            else if (ret == -1) {
-                goto close;
-            }
-        }
-    }
+bool imap_authenticate(struct relay *relay) {
+    struct imap_session *session = relay->data;
 
-finish:
-    // Send remaining client data in buffer to server
-    if (!send_client_buf_data(c_stream, s_bio)) {
-        succ = false;
-        goto close;
+    session->c_stream = imap_cmd_stream_create(relay->c_fd, false);
+    if (!session->c_stream) {
+        return false;
     }
 
-    // Send remaining server relies in buffer to client
-    succ = send_server_buf_data(s_stream, c_fd);
-
-close:
-    imap_reply_stream_free(s_stream);
-
-close_cmd_stream:
-    imap_cmd_stream_free(c_stream);
-    return succ;
+    session->s_stream = imap_reply_stream_create(relay->s_bio);
+    return true;
 }
 
-bool send_client_buf_data(struct imap_cmd_stream *stream, BIO *s_bio) {
-    char buf[1024];
+void imap_begin_relay(struct relay *relay) {
+    struct imap_session *session = relay->data;
 
-    ssize_t n;
+    // The data remaining in the streams' buffers is forwarded by
+    // moving the buffers' memory to the send buffers, which are
+    // usually empty at this point, rather than copying it.
+    imap_cmd_buffer(session->c_stream, &relay->s_out);
+    imap_reply_buffer(session->s_stream, &relay->c_out);
 
-    while ((n = imap_cmd_buffer(stream, buf, sizeof(buf)))) {
-        if (n < 0)
-            return false;
+    imap_reply_stream_free(session->s_stream);
+    imap_cmd_stream_free(session->c_stream);
 
-        if (!imap_server_send(s_bio, buf, n))
-            return false;
-    }
+    session->s_stream = NULL;
+    session->c_stream = NULL;
 
-    return true;
+    relay_passthrough(relay);
 }
 
-bool send_server_buf_data(struct imap_reply_stream *stream, int c_fd) {
-    char buf[1024];
-
-    ssize_t n;
 
-    while ((n = imap_reply_buffer(stream, buf, sizeof(buf)))) {
-        if (n < 0)
-            return false;
+bool handle_client_command(struct relay *relay, bool *progress) {
+    struct imap_session *session = relay->data;
+    struct imap_cmd cmd;
 
-        if (!imap_client_send(c_fd, buf, n))
-            return false;
-    }
+    while (relay->filtering && !session->login &&
+           buffer_len(&relay->s_out) < RELAY_BUF_MAX) {
 
-    return true;
-}
+        ssize_t c_n = imap_cmd_next(session->c_stream, &cmd);
 
+        if (c_n < 0) {
+            if (errno == EAGAIN) {
+                relay->c_readable = false;
+                return true;
+            }
 
-int handle_client_command(struct imap_cmd_stream *stream, BIO *s_bio) {
-    struct imap_cmd cmd;
-    bool wait = true;
+            syslog(LOG_ERR, "IMAP: Error reading data from client: %m");
+            relay->c_eof = true;
+            return true;
+        }
 
-    while (1) {
-        ssize_t c_n = imap_cmd_next(stream, &cmd, wait);
+        *progress = true;
 
-        if (c_n < 0)
-            return false;
-        else if (c_n == 0)
-            return !wait ? 0 : -1;
+        if (c_n == 0) {
+            syslog(LOG_NOTICE, "IMAP: Client closed connection");
+            relay->c_eof = true;
+            return true;
+        }
 
         switch (cmd.command) {
-        case IMAP_CMD_LOGIN: {
-            int ret = imap_login(imap_cmd_stream_fd(stream), s_bio, &cmd);
-
-            if (ret) return ret;
-        } break;
+        case IMAP_CMD_LOGIN:
+            if (!imap_login(relay, &cmd))
+                return false;
+            break;
 
         default:
-            if (!imap_server_send(s_bio, cmd.line, cmd.total_len)) {
-                return -1;
-            }
+            relay_server_send(relay, cmd.line, cmd.total_len);
             break;
         }
-
-        wait = false;
     }
+
+    return true;
 }
 
-int imap_login(int c_fd, BIO * s_bio, const struct imap_cmd *cmd) {
-    int ret = 1;
+bool imap_login(struct relay *relay, const struct imap_cmd *cmd) {
+    struct imap_session *session = relay->data;
 
     char *tag = xmalloc(cmd->tag_len + 1);
     memcpy(tag, cmd->tag, cmd->tag_len);
     tag[cmd->tag_len] = 0;
 
+    // The literals are discarded by the command stream, since the
+    // command is not forwarded to the server.
+    if (cmd->literal) {
+        imap_cmd_literal_reject(session->c_stream, cmd->tag, cmd->tag_len);
+
+        bool ok = imap_login_syntax_error(relay, tag, "Literals not supported in LOGIN");
+
+        free(tag);
+        return ok;
+    }
+
     char *user = imap_parse_string(cmd->param, cmd->param_len);
 
     if (!user) {
-        ret = imap_login_syntax_error(c_fd, tag) ? 0 : -1;
-        goto free_tag;
+        bool ok = imap_login_syntax_error(relay, tag, "Syntax error in username");
+
+        free(tag);
+        return ok;
     }
 
-    GList *accounts = goa_client_get_accounts(get_goaclient(NULL));
-    GList *account = find_goaccount(accounts, user);
+    session->tag = tag;
+    session->user = user;
 
-    if (!account) {
-        syslog(LOG_WARNING, "IMAP: Could not find GNOME Online Account for username %s", user);
+    session->login = token_request(relay->loop, user, imap_login_ready, relay);
+    return true;
+}
 
-        ret = imap_invalid_user(c_fd, tag) ? 0 : -1;
-        goto free_user;
-    }
+void imap_login_ready(const char *resp, goa_error gerr, void *data) {
+    struct relay *relay = data;
+    struct imap_session *session = relay->data;
 
-    goa_error gerr;
-    gchar *token = get_access_token(account, &gerr);
+    bool ok = true;
 
-    if (!token) {
-        ret = imap_auth_error(c_fd, gerr, tag) ? 0 : -1;
-        goto free_accounts;
-    }
+    session->login = NULL;
 
-    char *resp = xoauth2_make_client_response(user, token);
     if (!resp) {
-        syslog(LOG_ERR, "IMAP: Error formatting SASL client response mechanism: %m");
-        ret = -1;
+        if (gerr == ACCOUNT_ERROR_USER)
+            syslog(LOG_WARNING, "IMAP: Could not find GNOME Online Account for username %s", session->user);
 
-        goto free_token;
+        ok = imap_auth_error(relay, gerr, session->tag);
+        goto free_login;
     }
 
     char *auth_cmd;
-    if (asprintf(&auth_cmd, "%s AUTHENTICATE XOAUTH2 %s\r\n", tag, resp) == -1) {
+    if (asprintf(&auth_cmd, "%s AUTHENTICATE XOAUTH2 %s\r\n", session->tag, resp) == -1) {
         syslog(LOG_ERR, "IMAP: asprintf error (formatting AUTHENTICATE command): %m");
-        ret = -1;
-        goto free_resp;
+        ok = false;
+        goto free_login;
     }
 
     // Send AUTHENTICATE command to server
-    if (!imap_server_send(s_bio, auth_cmd, strlen(auth_cmd))) {
-        ret = -1;
-    }
+    relay_server_send(relay, auth_cmd, strlen(auth_cmd));
 
     free(auth_cmd);
 
-free_resp:
-    free(resp);
+    imap_begin_relay(relay);
 
-free_token:
-    g_free(token);
+free_login:
+    free(session->tag);
+    free(session->user);
 
-free_accounts:
-    g_list_free_full(accounts, (GDestroyNotify)g_object_unref);
+    session->tag = NULL;
+    session->user = NULL;
 
-free_user:
-    free(user);
-
-free_tag:
-    free(tag);
-
-    return ret;
+    relay_resume(relay, ok);
 }
 
 
 /* Error Reporting */
 
-bool imap_invalid_user(int fd, const char *tag) {
+bool imap_invalid_user(struct relay *relay, const char *tag) {
     char *err;
     if (asprintf(&err, "%s NO Invalid username\r\n", tag) == -1) {
         syslog(LOG_ERR, "IMAP: asprintf (format LOGIN response): %m");
         return false;
     }
 
-    bool ret = imap_client_send(fd, err, strlen(err));
+    relay_client_send(relay, err, strlen(err));
     free(err);
-    return ret;
+    return true;
 }
 
-bool imap_auth_error(int fd, goa_error gerr, const char *tag) {
+bool imap_auth_error(struct relay *relay, goa_error gerr, const char *tag) {
     switch (gerr) {
     case ACCOUNT_ERROR_CRED: {
         char *err;
@@ -523,9 +452,9 @@ bool imap_auth_error(int fd, goa_error gerr, const char *tag) {
             return false;
         }
 
-        bool ret = imap_client_send(fd, err, strlen(err));
+        relay_client_send(relay, err, strlen(err));
         free(err);
-        return ret;
+        return true;
     } break;
 
     case ACCOUNT_ERROR_TOKEN: {
@@ -535,62 +464,85 @@ bool imap_auth_error(int fd, goa_error gerr, const char *tag) {
             return false;
         }
 
-        bool ret = imap_client_send(fd, err, strlen(err));
+        relay_client_send(relay, err, strlen(err));
         free(err);
-        return ret;
+        return true;
     } break;
+
+    case ACCOUNT_ERROR_USER:
+        return imap_invalid_user(relay, tag);
     }
 
     assert(false);
     return true;
 }
 
-bool imap_login_syntax_error(int fd, const char *tag) {
+bool imap_login_syntax_error(struct relay *relay, const char *tag, const char *msg) {
     char *err;
-    if (asprintf(&err, "%s BAD Syntax error in username\r\n", tag) == -1) {
+    if (asprintf(&err, "%s BAD %s\r\n", tag, msg) == -1) {
         syslog(LOG_ERR, "IMAP: asprintf (format LOGIN response): %m");
         return false;
     }
 
-    bool ret = imap_client_send(fd, err, strlen(err));
+    relay_client_send(relay, err, strlen(err));
     free(err);
-    return ret;
+    return true;
 }
 
 
 /* Handling Server Reply */
 
-bool handle_server_reply(struct imap_reply_stream *stream, int c_fd) {
+bool handle_server_reply(struct relay *relay, bool *progress) {
+    struct imap_session *session = relay->data;
     struct imap_reply reply;
-    bool wait = true;
 
-    while (1) {
-        ssize_t s_n = imap_reply_next(stream, &reply, wait);
+    while (relay->filtering &&
+           relay_client_pending(relay) < RELAY_BUF_MAX) {
 
-        if (s_n < 0)
-            return false;
-        else if (s_n == 0)
-            return !wait;
+        ssize_t s_n = imap_reply_next(session->s_stream, &reply);
+
+        if (s_n < 0) {
+            if (errno == EAGAIN) {
+                relay->s_readable = false;
+                return true;
+            }
+
+            ssl_log_error("IMAP: Error reading data from server");
+            relay->s_eof = true;
+            return true;
+        }
+
+        *progress = true;
+
+        if (s_n == 0) {
+            syslog(LOG_NOTICE, "IMAP: Server closed connection");
+            relay->s_eof = true;
+            return true;
+        }
+
+        // The client sends the data of a synchronizing literal once
+        // the server requests it. A tagged reply to the command ends
+        // it without it.
+        if (reply.type == IMAP_REPLY_CONT)
+            imap_cmd_literal_accept(session->c_stream);
+        else if (reply.type == IMAP_REPLY_TAGGED)
+            imap_cmd_literal_reject(session->c_stream, reply.line, reply.tag_len);
 
         switch (reply.code) {
         case IMAP_REPLY_CAP:
-            if (!send_capabilites(c_fd, &reply))
-                return false;
-
+            send_capabilites(relay, &reply);
             break;
 
         default:
-            if (!imap_client_send(c_fd, reply.line, reply.total_len))
-                return false;
-
+            relay_client_send(relay, reply.line, reply.total_len);
             break;
         }
-
-        wait = false;
     }
+
+    return true;
 }
 
-bool send_capabilites(int c_fd, const struct imap_reply *reply) {
+void send_capabilites(struct relay *relay, const struct imap_reply *reply) {
     const char *data = reply->data;
     size_t n = reply->data_len;
 
@@ -606,10 +558,8 @@ bool send_capabilites(int c_fd, const struct imap_reply *reply) {
     new_cap[pos++] = '\r';
     new_cap[pos++] = '\n';
 
-    bool ret = imap_client_send(c_fd, new_cap, pos);
+    relay_client_send(relay, new_cap, pos);
     free(new_cap);
-
-    return ret;
 }
 
 static const char * filter_capability(const char *data, size_t *n, char *out, size_t *pos) {
@@ -658,38 +608,3 @@ const char *skip_to_space(const char *data, size_t *n) {
     *n = sz;
     return data;
 }
-
-
-/* Sending Data */
-
-bool imap_server_send(BIO *bio, const char *data, size_t n) {
-    while (n) {
-        ssize_t s_n = BIO_write(bio, data, n);
-
-        if (s_n < 0) {
-            ssl_log_error("IMAP: Error sending data to server");
-            return false;
-        }
-
-        n -= s_n;
-        data += s_n;
-    }
-
-    return true;
-}
-
-bool imap_client_send(int fd, const char *data, size_t n) {
-    while (n) {
-        ssize_t c_n = send(fd, data, n, 0) ;
-
-        if (c_n < 0) {
-            syslog(LOG_ERR, "IMAP: Error sending data to client: %m");
-            return false;
-        }
-
-        n -= c_n;
-        data += c_n;
-    };
-
-    return true;
-}
@@ -1,9 +1,35 @@
 #ifndef OAPROXY_IMAP_H
 #define OAPROXY_IMAP_H
 
+#include <stdbool.h>
+
+#include "event.h"
+#include "upstream.h"
+
+/**
+ * Start proxying an IMAP client connection on an event loop.
+ *
+ * If @a bio is NULL, a connection to the server is initiated. The
+ * session is driven by events on @a loop. The client socket is
+ * closed when the session ends or if the session could not be
+ * started.
+ *
+ * @param loop Event loop
+ * @param fd   Client socket descriptor
+ * @param upstream IMAP server. A reference is held for the duration
+ *   of the session.
+ * @param bio  Established server connection, taken from a connection
+ *   pool, or NULL. Freed by the session.
+ *
+ * @return True if the session was started.
+ */
+bool imap_start_client(struct event_loop *loop, int fd, struct upstream *upstream, BIO *bio);
+
 /**
  * Handle IMAP client connection.
  *
+ * Runs a private event loop until the session ends.
+ *
  * @param fd        Client socket descriptor
  * @param host IMAP server host
  */
@@ -11,8 +11,8 @@
 #include <openssl/bio.h>
 
 #include "xmalloc.h"
-
-#define OAP_CMD_BUF_SIZE 1024
+#include "linebuf.h"
+#include "imap_literal.h"
 
 #define CMD_LOGIN "LOGIN"
 #define CMD_LOGIN_LEN strlen(CMD_LOGIN)
@@ -21,13 +21,65 @@ struct imap_cmd_stream {
     /** Client BIO stream */
     BIO *bio;
 
-    /** Size of last IMAP command line */
-    size_t size;
-
-    /** Buffer into which IMAP command is read */
-    char data[OAP_CMD_BUF_SIZE + 1];
+    /** Buffer into which IMAP commands are read */
+    struct linebuf buf;
+
+    /** Number of bytes of the current literal not read yet */
+    size_t literal;
+
+    /**
+     * True if the last command line announced a synchronizing
+     * literal, of which the data is expected once a continuation
+     * reply is sent to the client.
+     */
+    bool sync_pending;
+    /** Number of bytes of the synchronizing literal */
+    size_t sync_literal;
+
+    /**
+     * Tag of the command which announced the current literal. The
+     * tagged reply to this command ends the command.
+     */
+    char *tag;
+    /** Length of the tag */
+    size_t tag_len;
+
+    /**
+     * True if the next line continues the current command, after the
+     * data of a literal.
+     */
+    bool continuation;
+    /**
+     * True if the literals, and continuation lines, of the current
+     * command are discarded.
+     */
+    bool discard;
 };
 
+/**
+ * Read the next command line, or the line continuing the current
+ * command.
+ *
+ * @param stream IMAP command stream.
+ * @param cmd    Pointer to imap_cmd struct, filled on output.
+ *
+ * @return Number of bytes read, 0 if the client closed the
+ *   connection, -1 if an error occurred or no complete line is
+ *   available.
+ */
+static ssize_t next_line(struct imap_cmd_stream *stream, struct imap_cmd *cmd);
+
+/**
+ * Read the next part of the data of the current literal.
+ *
+ * @param stream IMAP command stream.
+ * @param cmd    Pointer to imap_cmd struct, filled on output.
+ *
+ * @return Number of bytes read, 0 if the client closed the
+ *   connection, -1 if an error occurred or no data is available.
+ */
+static ssize_t next_literal(struct imap_cmd_stream *stream, struct imap_cmd *cmd);
+
 /**
  * Parse an IMAP command.
  *
@@ -75,36 +127,34 @@ struct imap_cmd_stream * imap_cmd_stream_create(int fd, bool close) {
     BIO *sbio = BIO_new_socket(fd, close);
     if (!sbio) return NULL;
 
-    // Create Buffered BIO
-    BIO *bbio = BIO_new(BIO_f_buffer());
-    if (!bbio) goto free_sbio;
-
-    // Chain BIOs
-    BIO *chain = BIO_push(bbio, sbio);
-    if (!chain) goto free_bbio;
-
     // Create stream struct
 
     struct imap_cmd_stream *stream = xmalloc(sizeof(struct imap_cmd_stream));
 
-    stream->bio = chain;
-    stream->size = 0;
+    stream->bio = sbio;
+    linebuf_init(&stream->buf);
 
-    return stream;
+    stream->literal = 0;
 
-free_bbio:
-    BIO_free_all(bbio);
+    stream->sync_pending = false;
+    stream->sync_literal = 0;
 
-free_sbio:
-    BIO_free_all(sbio);
+    stream->tag = NULL;
+    stream->tag_len = 0;
 
-    return NULL;
+    stream->continuation = false;
+    stream->discard = false;
+
+    return stream;
 }
 
 void imap_cmd_stream_free(struct imap_cmd_stream *stream) {
     assert(stream != NULL);
 
+    linebuf_free(&stream->buf);
+
     BIO_free_all(stream->bio);
+    free(stream->tag);
     free(stream);
 }
 
@@ -112,24 +162,125 @@ int imap_cmd_stream_fd(struct imap_cmd_stream *stream) {
     return BIO_get_fd(stream->bio, NULL);
 }
 
-ssize_t imap_cmd_next(struct imap_cmd_stream *stream, struct imap_cmd *cmd, const bool wait) {
-    if (!wait && !BIO_ctrl_pending(stream->bio))
-        return 0;
+ssize_t imap_cmd_next(struct imap_cmd_stream *stream, struct imap_cmd *cmd) {
+    while (true) {
+        bool discard = stream->discard;
+
+        ssize_t n = stream->literal ?
+            next_literal(stream, cmd) : next_line(stream, cmd);
+
+        if (n <= 0 || !discard)
+            return n;
+    }
+}
+
+ssize_t next_line(struct imap_cmd_stream *stream, struct imap_cmd *cmd) {
+    const char *line;
+    size_t n;
+
+    while (!(n = linebuf_next(&stream->buf, &line))) {
+        if (stream->buf.eof)
+            return 0;
+
+        if (linebuf_fill(&stream->buf, stream->bio) < 0)
+            return -1;
+    }
+
+    cmd->line = line;
+    cmd->total_len = n;
+
+    if (stream->continuation) {
+        cmd->command = IMAP_CMD_CONTINUATION;
+
+        cmd->tag = NULL;
+        cmd->tag_len = 0;
+        cmd->param = NULL;
+        cmd->param_len = 0;
+    }
+    else {
+        parse_cmd(cmd);
+    }
+
+    bool sync;
+    size_t literal;
+
+    cmd->literal = imap_parse_literal(line, n, &literal, &sync);
+
+    // Continuation lines belong to the command which announced the
+    // first literal
+    if (cmd->literal && cmd->command != IMAP_CMD_CONTINUATION) {
+        stream->tag = xrealloc(stream->tag, cmd->tag_len);
+        stream->tag_len = cmd->tag_len;
+
+        memcpy(stream->tag, cmd->tag, cmd->tag_len);
+    }
+
+    stream->literal = sync ? 0 : literal;
+
+    stream->sync_pending = cmd->literal && sync;
+    stream->sync_literal = sync ? literal : 0;
+
+    // The data of a non-synchronizing literal follows immediately
+    stream->continuation = cmd->literal && !sync;
+
+    if (cmd->command == IMAP_CMD_LOGIN)
+        stream->discard = cmd->literal;
+    else if (!cmd->literal)
+        stream->discard = false;
+
+    return n;
+}
+
+ssize_t next_literal(struct imap_cmd_stream *stream, struct imap_cmd *cmd) {
+    const char *data;
+    size_t n;
 
-    ssize_t n = BIO_gets(stream->bio, stream->data, OAP_CMD_BUF_SIZE);
-    if (n <= 0) {
-        return n;
+    while (!(n = linebuf_next_data(&stream->buf, stream->literal, &data))) {
+        if (stream->buf.eof)
+            return 0;
+
+        if (linebuf_fill(&stream->buf, stream->bio) < 0)
+            return -1;
     }
 
-    stream->size = n;
+    stream->literal -= n;
 
-    cmd->line = stream->data;
+    cmd->command = IMAP_CMD_LITERAL;
+    cmd->line = data;
     cmd->total_len = n;
 
-    parse_cmd(cmd);
+    cmd->tag = NULL;
+    cmd->tag_len = 0;
+    cmd->param = NULL;
+    cmd->param_len = 0;
+
+    cmd->literal = false;
+
     return n;
 }
 
+void imap_cmd_literal_accept(struct imap_cmd_stream *stream) {
+    if (stream->sync_pending) {
+        stream->literal = stream->sync_literal;
+        stream->continuation = true;
+
+        stream->sync_pending = false;
+        stream->sync_literal = 0;
+    }
+}
+
+void imap_cmd_literal_reject(struct imap_cmd_stream *stream, const char *tag, size_t tag_len) {
+    // The client abandons the command without sending the literal
+    if (stream->sync_pending &&
+        tag_len == stream->tag_len &&
+        !memcmp(tag, stream->tag, tag_len)) {
+        stream->discard = false;
+
+        stream->sync_pending = false;
+        stream->sync_literal = 0;
+    }
+}
+
 bool parse_cmd(struct imap_cmd *cmd) {
     cmd->command = IMAP_CMD;
 
@@ -158,7 +309,7 @@ bool parse_tag(struct imap_cmd *cmd) {
         cmd->tag_len++;
     }
 
-    return true;
+    return cmd->tag_len > 0;
 }
 
 bool parse_cmd_name(struct imap_cmd *cmd) {
@@ -184,31 +335,8 @@ bool parse_cmd_name(struct imap_cmd *cmd) {
     return true;
 }
 
-ssize_t imap_cmd_buffer(struct imap_cmd_stream *stream, char *buf, size_t size) {
-    size_t pending = BIO_ctrl_pending(stream->bio);
-
-    if (pending < size) {
-        size = pending;
-    }
-
-    size_t total = 0;
-
-    while (size) {
-        ssize_t n = BIO_read(stream->bio, buf, size);
-
-        if (n < 0) {
-            return n;
-        }
-        else if (n == 0) {
-            break;
-        }
-
-        size -= n;
-        total += n;
-        buf += n;
-    }
-
-    return total;
+void imap_cmd_buffer(struct imap_cmd_stream *stream, struct buffer *out) {
+    linebuf_move(&stream->buf, out);
 }
 
 /* Parsing Strings */
@@ -250,6 +378,12 @@ char * imap_parse_string(const char *data, size_t n) {
         n--;
     }
 
+    // An atom is not empty, e.g. when the string is a literal
+    if (!index) {
+        free(str_buf);
+        return NULL;
+    }
+
     str_buf = xrealloc(str_buf, index + 1);
     str_buf[index] = 0;
 
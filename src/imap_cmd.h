@@ -6,6 +6,8 @@
 
 #include <unistd.h>
 
+#include "buffer.h"
+
 /**
  * Stream of IMAP client commands
  */
@@ -19,6 +21,10 @@ typedef enum imap_cmd_type {
     IMAP_CMD = 0,
     /* LOGIN command */
     IMAP_CMD_LOGIN = 1,
+    /* Data of a literal, which is part of the preceding command */
+    IMAP_CMD_LITERAL = 2,
+    /* Line following a literal, which continues the preceding command */
+    IMAP_CMD_CONTINUATION = 3,
 } imap_cmd_type;
 
 /**
@@ -42,6 +48,9 @@ struct imap_cmd {
     const char *param;
     /** Length of command parameters */
     size_t param_len;
+
+    /** True if the line ends in a literal announcement */
+    bool literal;
 };
 
 /**
@@ -66,19 +75,51 @@ void imap_cmd_stream_free(struct imap_cmd_stream *stream);
 /**
  * Read and parse the next command from the command stream.
  *
+ * The data of a literal, announced at the end of a command line, is
+ * returned, as soon as it is received, as IMAP_CMD_LITERAL commands,
+ * without searching it for line boundaries. The data of a
+ * synchronizing literal is only expected once
+ * imap_cmd_literal_accept() is called. The line following the data is
+ * returned, without being parsed, as an IMAP_CMD_CONTINUATION command.
+ *
+ * The literals of a LOGIN command, and the lines continuing it, are
+ * discarded since the command is not forwarded to the server.
+ *
+ * If the socket is non-blocking and a complete command has not been
+ * received yet, returns immediately with errno set to EAGAIN.
+ *
  * @param stream IMAP command stream.
  *
  * @param cmd Pointer to imap_cmd struct, filled on output.
  *
- * @param wait If true, will block until new data is received,
- *   otherwise will return immediately.
- *
  * @return Number of bytes read, 0 if no bytes are read (client closed
- *   connection), -1 if an error occurred. If wait is false, a return
- *   value of 0 indicates that there isn't a complete command left in
- *   the buffer.
+ *   connection), -1 if an error occurred or no complete command is
+ *   available on a non-blocking socket.
+ */
+ssize_t imap_cmd_next(struct imap_cmd_stream *stream, struct imap_cmd *cmd);
+
+/**
+ * Notify the stream that a continuation reply has been sent to the
+ * client, after which the client sends the data of the synchronizing
+ * literal, if any, announced by the last command line.
+ *
+ * @param stream IMAP command stream.
  */
-ssize_t imap_cmd_next(struct imap_cmd_stream *stream, struct imap_cmd *cmd, const bool wait);
+void imap_cmd_literal_accept(struct imap_cmd_stream *stream);
+
+/**
+ * Notify the stream that a tagged reply has been sent to the client.
+ *
+ * If the reply is to the command which announced a synchronizing
+ * literal which has not been accepted, the client no longer sends
+ * the data of the literal. Replies to other commands, such as
+ * pipelined commands sent before it, are ignored.
+ *
+ * @param stream  IMAP command stream.
+ * @param tag     Tag of the reply.
+ * @param tag_len Length of the tag.
+ */
+void imap_cmd_literal_reject(struct imap_cmd_stream *stream, const char *tag, size_t tag_len);
 
 /**
  * Return the client socket file descriptor.
@@ -90,16 +131,15 @@ ssize_t imap_cmd_next(struct imap_cmd_stream *stream, struct imap_cmd *cmd, cons
 int imap_cmd_stream_fd(struct imap_cmd_stream *stream);
 
 /**
- * Read the remaining data in the buffer.
+ * Move the remaining data in the stream's buffer to the end of a send
+ * buffer, without copying it if @a out is empty.
  *
- * @param stream IMAP command stream
- * @param buf    Buffer into which to read data
- * @param size   Size of buffer
+ * No further commands can be read from the stream afterwards.
  *
- * @return Number of bytes written to @a buf if successful. -1
- *   Otherwise.
+ * @param stream IMAP command stream
+ * @param out    Send buffer
  */
-ssize_t imap_cmd_buffer(struct imap_cmd_stream *stream, char *buf, size_t size);
+void imap_cmd_buffer(struct imap_cmd_stream *stream, struct buffer *out);
 
 /**
  * Parse a string from an IMAP command parameter.
@@ -0,0 +1,47 @@
+#include "imap_literal.h"
+
+#include <ctype.h>
+#include <stdint.h>
+
+bool imap_parse_literal(const char *line, size_t n, size_t *len, bool *sync) {
+    const char *end = line + n;
+
+    *len = 0;
+    *sync = false;
+
+    // Skip line terminator
+    if (end == line || end[-1] != '\n')
+        return false;
+
+    end--;
+    if (end > line && end[-1] == '\r')
+        end--;
+
+    if (end == line || end[-1] != '}')
+        return false;
+
+    end--;
+
+    bool plus = end > line && end[-1] == '+';
+    if (plus) end--;
+
+    const char *digits = end;
+    while (digits > line && isdigit((unsigned char)digits[-1]))
+        digits--;
+
+    if (digits == end || digits == line || digits[-1] != '{')
+        return false;
+
+    size_t size = 0;
+
+    for (; digits < end; digits++) {
+        if (size > (SIZE_MAX - 9) / 10)
+            return false;
+
+        size = size * 10 + (*digits - '0');
+    }
+
+    *len = size;
+    *sync = !plus;
+    return true;
+}
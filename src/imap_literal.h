@@ -0,0 +1,25 @@
+#ifndef OAPROXY_IMAP_LITERAL_H
+#define OAPROXY_IMAP_LITERAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Parse the literal announced at the end of an IMAP line, of the form
+ * {n} or {n+}. The n bytes of the literal's data follow the line, and
+ * are not split into lines. The line following the data continues the
+ * same command or reply.
+ *
+ * @param line Line, including the terminating CRLF.
+ * @param n    Length of the line.
+ * @param len  Receives the number of bytes of data of the literal, 0
+ *   if the line does not end in a literal.
+ * @param sync Set to true if the literal is synchronizing ({n}), in
+ *   which case the client only sends its data after receiving a
+ *   continuation reply.
+ *
+ * @return True if the line ends in a literal, which may be empty.
+ */
+bool imap_parse_literal(const char *line, size_t n, size_t *len, bool *sync);
+
+#endif /* OAPROXY_IMAP_LITERAL_H */
@@ -6,8 +6,8 @@
 #include <assert.h>
 
 #include "xmalloc.h"
-
-#define OAP_REPLY_BUF_SIZE 1024
+#include "linebuf.h"
+#include "imap_literal.h"
 
 #define REPLY_CAP "CAPABILITY "
 #define REPLY_CAP_LEN 11
@@ -16,13 +16,30 @@ struct imap_reply_stream {
     /** Server BIO object */
     BIO *bio;
 
-    /** Size of data in buffer */
-    size_t size;
+    /** Buffer into which IMAP replies are read */
+    struct linebuf buf;
+
+    /** Number of bytes of the current literal not read yet */
+    size_t literal;
 
-    /** Data Buffer */
-    char data[OAP_REPLY_BUF_SIZE];
+    /**
+     * True if the next line continues the current reply, after the
+     * data of a literal.
+     */
+    bool continuation;
 };
 
+/**
+ * Read the next part of the data of the current literal.
+ *
+ * @param stream IMAP reply stream.
+ * @param reply  Pointer to imap_reply struct, filled on output.
+ *
+ * @return Number of bytes read, 0 if the server closed the
+ *   connection, -1 if an error occurred or no data is available.
+ */
+static ssize_t next_literal(struct imap_reply_stream *stream, struct imap_reply *reply);
+
 /**
  * Parse an IMAP reply.
  *
@@ -66,21 +83,13 @@ static bool parse_reply_code(struct imap_reply *reply);
 /* Implementation */
 
 struct imap_reply_stream * imap_reply_stream_create(BIO *bio) {
-    // Create Buffered BIO
-    BIO *bbio = BIO_new(BIO_f_buffer());
-    if (!bbio) return NULL;
-
-    // Chain BIOs
-    BIO *chain = BIO_push(bbio, bio);
-    if (!chain) {
-        BIO_free_all(bbio);
-        return NULL;
-    }
-
     struct imap_reply_stream *stream = xmalloc(sizeof(struct imap_reply_stream));
 
-    stream->bio = chain;
-    stream->size = 0;
+    stream->bio = bio;
+    linebuf_init(&stream->buf);
+
+    stream->literal = 0;
+    stream->continuation = false;
 
     return stream;
 }
@@ -88,25 +97,72 @@ struct imap_reply_stream * imap_reply_stream_create(BIO *bio) {
 void imap_reply_stream_free(struct imap_reply_stream *stream) {
     assert(stream != NULL);
 
-    BIO_free(stream->bio);
+    linebuf_free(&stream->buf);
     free(stream);
 }
 
-ssize_t imap_reply_next(struct imap_reply_stream *stream, struct imap_reply *reply, const bool wait) {
-    if (!wait && !BIO_ctrl_pending(stream->bio))
-        return 0;
+ssize_t imap_reply_next(struct imap_reply_stream *stream, struct imap_reply *reply) {
+    if (stream->literal)
+        return next_literal(stream, reply);
+
+    const char *line;
+    size_t n;
+
+    while (!(n = linebuf_next(&stream->buf, &line))) {
+        if (stream->buf.eof)
+            return 0;
+
+        if (linebuf_fill(&stream->buf, stream->bio) < 0)
+            return -1;
+    }
+
+    reply->line = line;
+    reply->total_len = n;
+
+    if (stream->continuation) {
+        reply->code = IMAP_REPLY;
+        reply->type = IMAP_REPLY_CONTINUATION;
+        reply->tag_len = 0;
+
+        reply->data = NULL;
+        reply->data_len = 0;
+    }
+    else {
+        parse_reply(reply);
+    }
+
+    // The server does not wait for a continuation reply before
+    // sending the data of a literal.
+    bool sync;
+    stream->continuation = imap_parse_literal(line, n, &stream->literal, &sync);
+
+    return n;
+}
+
+ssize_t next_literal(struct imap_reply_stream *stream, struct imap_reply *reply) {
+    const char *data;
+    size_t n;
 
-    ssize_t n = BIO_gets(stream->bio, stream->data, OAP_REPLY_BUF_SIZE);
-    if (n <= 0) {
-        return n;
+    while (!(n = linebuf_next_data(&stream->buf, stream->literal, &data))) {
+        if (stream->buf.eof)
+            return 0;
+
+        if (linebuf_fill(&stream->buf, stream->bio) < 0)
+            return -1;
     }
 
-    stream->size = n;
+    stream->literal -= n;
+
+    reply->code = IMAP_REPLY;
+    reply->type = IMAP_REPLY_LITERAL;
 
-    reply->line = stream->data;
+    reply->line = data;
     reply->total_len = n;
+    reply->tag_len = 0;
+
+    reply->data = NULL;
+    reply->data_len = 0;
 
-    parse_reply(reply);
     return n;
 }
 
@@ -191,29 +247,6 @@ bool parse_reply_code(struct imap_reply *reply) {
 
 /* Accessors */
 
-ssize_t imap_reply_buffer(struct imap_reply_stream *stream, char *buf, size_t size) {
-    size_t pending = BIO_ctrl_pending(stream->bio);
-
-    if (pending < size) {
-        size = pending;
-    }
-
-    size_t total = 0;
-
-    while (size) {
-        ssize_t n = BIO_read(stream->bio, buf, size);
-
-        if (n < 0) {
-            return n;
-        }
-        else if (n == 0) {
-            break;
-        }
-
-        size -= n;
-        total += n;
-        buf += n;
-    }
-
-    return total;
+void imap_reply_buffer(struct imap_reply_stream *stream, struct buffer *out) {
+    linebuf_move(&stream->buf, out);
 }
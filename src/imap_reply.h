@@ -6,6 +6,8 @@
 
 #include <openssl/bio.h>
 
+#include "buffer.h"
+
 /**
  * Stream of IMAP server replies.
  */
@@ -36,7 +38,15 @@ typedef enum imap_reply_type {
     /**
      * Continuation (request for client data) response.
      */
-    IMAP_REPLY_CONT
+    IMAP_REPLY_CONT,
+    /**
+     * Data of a literal, which is part of the preceding reply.
+     */
+    IMAP_REPLY_LITERAL,
+    /**
+     * Line following a literal, which continues the preceding reply.
+     */
+    IMAP_REPLY_CONTINUATION
 } imap_reply_type;
 
 /**
@@ -67,7 +77,8 @@ struct imap_reply {
 /**
  * Create an IMAP reply strean
  *
- * @param bio IMAP server OpenSSL BIO object
+ * @param bio IMAP server OpenSSL BIO object. The BIO is not freed
+ *   when the stream is freed.
  *
  * @return Pointer to imap_reply_stream struct
  */
@@ -83,30 +94,34 @@ void imap_reply_stream_free(struct imap_reply_stream *stream);
 /**
  * Read and parse the next reply from the reply stream.
  *
+ * The data of a literal, announced at the end of a reply line, is
+ * returned, as soon as it is received, as IMAP_REPLY_LITERAL replies,
+ * without searching it for line boundaries. The line following the
+ * data is returned, without being parsed, as an
+ * IMAP_REPLY_CONTINUATION reply.
+ *
+ * If the BIO is non-blocking and a complete reply has not been
+ * received yet, returns immediately with errno set to EAGAIN.
+ *
  * @param stream IMAP reply stream.
  *
  * @param reply Pointer to imap_reply struct, filled on output.
  *
- * @param wait If true, will block until new data is received,
- *   otherwise will return immediately.
- *
- * @return Number of bytes read, 0 if no bytes are read (client closed
- *   connection), -1 if an error occurred. If wait is false, a return
- *   value of 0 indicates that there isn't a complete command left in
- *   the buffer.
+ * @return Number of bytes read, 0 if no bytes are read (server closed
+ *   connection), -1 if an error occurred or no complete reply is
+ *   available on a non-blocking BIO.
  */
-ssize_t imap_reply_next(struct imap_reply_stream *stream, struct imap_reply *reply, const bool wait);
+ssize_t imap_reply_next(struct imap_reply_stream *stream, struct imap_reply *reply);
 
 /**
- * Return the remaining data in the stream's buffer.
+ * Move the remaining data in the stream's buffer to the end of a send
+ * buffer, without copying it if @a out is empty.
  *
- * @param stream IMAP reply stream
- * @param buf    Buffer into which to read data
- * @param size   Size of buffer
+ * No further replies can be read from the stream afterwards.
  *
- * @return Number of bytes written to @a bug if successful. -1
- *   otheriwse.
+ * @param stream IMAP reply stream
+ * @param out    Send buffer
  */
-ssize_t imap_reply_buffer(struct imap_reply_stream *stream, char *buf, size_t size);
+void imap_reply_buffer(struct imap_reply_stream *stream, struct buffer *out);
 
 #endif /* OAPROXY_IMAP_REPLY_H */
@@ -0,0 +1,167 @@
+#include "linebuf.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "xmalloc.h"
+
+/**
+ * Consume the last line returned by linebuf_next().
+ *
+ * @param buf Line buffer.
+ */
+static void consume_line(struct linebuf *buf);
+
+
+/* Implementation */
+
+void linebuf_init(struct linebuf *buf) {
+    buf->data = xmalloc(LINEBUF_SIZE + 1);
+    buf->size = LINEBUF_SIZE;
+
+    buf->start = buf->end = 0;
+    buf->scan = 0;
+    buf->line = 0;
+    buf->saved = 0;
+    buf->eof = false;
+}
+
+void linebuf_free(struct linebuf *buf) {
+    free(buf->data);
+    buf->data = NULL;
+}
+
+ssize_t linebuf_fill(struct linebuf *buf, BIO *bio) {
+    consume_line(buf);
+
+    // Move unconsumed data to the front of the buffer
+    if (buf->start) {
+        memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+
+        buf->end -= buf->start;
+        buf->scan = buf->scan > buf->start ? buf->scan - buf->start : 0;
+        buf->start = 0;
+    }
+
+    // Grow the buffer to hold a line longer than its size
+    if (buf->end == buf->size) {
+        if (buf->size == LINEBUF_MAX)
+            return 0;
+
+        size_t size = buf->size * 2;
+        if (size > LINEBUF_MAX) size = LINEBUF_MAX;
+
+        buf->data = xrealloc(buf->data, size + 1);
+        buf->size = size;
+    }
+
+    int n = BIO_read(bio, buf->data + buf->end, buf->size - buf->end);
+
+    if (n > 0) {
+        buf->end += n;
+        return n;
+    }
+
+    if (BIO_should_retry(bio)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (n == 0) {
+        buf->eof = true;
+        return 0;
+    }
+
+    // Ensure the error is not mistaken for a retry
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+        errno = EIO;
+
+    return -1;
+}
+
+size_t linebuf_next(struct linebuf *buf, const char **line) {
+    consume_line(buf);
+
+    size_t avail = buf->end - buf->start;
+    if (!avail) return 0;
+
+    if (buf->scan < buf->start)
+        buf->scan = buf->start;
+
+    const char *start = buf->data + buf->start;
+    const char *lf = memchr(buf->data + buf->scan, '\n', buf->end - buf->scan);
+
+    size_t n;
+
+    if (lf) {
+        n = (lf - start) + 1;
+    }
+    else if (avail == LINEBUF_MAX || buf->eof) {
+        n = avail;
+    }
+    else {
+        buf->scan = buf->end;
+        return 0;
+    }
+
+    buf->line = n;
+    buf->saved = buf->data[buf->start + n];
+    buf->data[buf->start + n] = 0;
+
+    *line = start;
+    return n;
+}
+
+size_t linebuf_next_data(struct linebuf *buf, size_t max, const char **data) {
+    consume_line(buf);
+
+    size_t n = buf->end - buf->start;
+    if (n > max) n = max;
+
+    if (!n) return 0;
+
+    buf->line = n;
+    buf->saved = buf->data[buf->start + n];
+    buf->data[buf->start + n] = 0;
+
+    *data = buf->data + buf->start;
+    return n;
+}
+
+size_t linebuf_pending(const struct linebuf *buf) {
+    return buf->end - buf->start - buf->line;
+}
+
+void linebuf_move(struct linebuf *buf, struct buffer *out) {
+    consume_line(buf);
+
+    if (buf->start == buf->end)
+        return;
+
+    if (buffer_len(out)) {
+        buffer_append(out, buf->data + buf->start, buf->end - buf->start);
+    }
+    else {
+        buffer_free(out);
+
+        out->data = buf->data;
+        out->size = buf->size;
+        out->start = buf->start;
+        out->end = buf->end;
+
+        buf->data = NULL;
+        buf->size = 0;
+    }
+
+    buf->start = buf->end = buf->scan = 0;
+}
+
+void consume_line(struct linebuf *buf) {
+    if (buf->line) {
+        buf->data[buf->start + buf->line] = buf->saved;
+
+        buf->start += buf->line;
+        buf->line = 0;
+    }
+}
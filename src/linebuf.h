@@ -0,0 +1,138 @@
+#ifndef OAPROXY_LINEBUF_H
+#define OAPROXY_LINEBUF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <unistd.h>
+
+#include <openssl/bio.h>
+
+#include "buffer.h"
+
+/**
+ * Initial size of the buffer, which is also the maximum number of
+ * bytes read at once until the buffer grows.
+ */
+#define LINEBUF_SIZE (16 * 1024)
+
+/**
+ * Maximum line length. The buffer grows to hold lines longer than
+ * its current size, up to this length. Longer lines are returned in
+ * pieces of this size.
+ */
+#define LINEBUF_MAX (1024 * 1024)
+
+/**
+ * Buffer of data received from a BIO, from which complete lines are
+ * extracted.
+ *
+ * Lines are returned in place and are NUL terminated. A line remains
+ * valid until the next call to linebuf_next(), linebuf_next_data(),
+ * linebuf_fill() or linebuf_move().
+ */
+struct linebuf {
+    /** Data buffer, with room for a NUL terminator past its size */
+    char *data;
+    /** Size of the data buffer */
+    size_t size;
+
+    /** Offset of first unconsumed byte */
+    size_t start;
+    /** Offset one past the last received byte */
+    size_t end;
+    /**
+     * Offset up to which the data has been searched for a line feed,
+     * so that the data of a partially received line is only searched
+     * once.
+     */
+    size_t scan;
+
+    /** Length of the last line returned, consumed on next call */
+    size_t line;
+    /** Byte replaced by the NUL terminator of the last line */
+    char saved;
+
+    /** True if the end of the stream has been reached */
+    bool eof;
+};
+
+/**
+ * Initialize an empty line buffer.
+ *
+ * @param buf Line buffer.
+ */
+void linebuf_init(struct linebuf *buf);
+
+/**
+ * Free the memory held by a line buffer.
+ *
+ * @param buf Line buffer.
+ */
+void linebuf_free(struct linebuf *buf);
+
+/**
+ * Read data from a BIO into the buffer.
+ *
+ * @param buf Line buffer.
+ * @param bio BIO to read from.
+ *
+ * @return Number of bytes read, 0 if the end of the stream was
+ *   reached or the buffer is full, -1 on error. If the BIO is non-blocking and no data is
+ *   available, -1 is returned with errno set to EAGAIN.
+ */
+ssize_t linebuf_fill(struct linebuf *buf, BIO *bio);
+
+/**
+ * Extract the next complete line from the buffer.
+ *
+ * If the end of the stream has been reached, the remaining data is
+ * returned as the last line even if it is not terminated by a line
+ * feed.
+ *
+ * @param buf  Line buffer.
+ * @param line Pointer to variable receiving pointer to the line.
+ *
+ * @return Length of the line including the terminating CRLF, 0 if
+ *   there is no complete line in the buffer.
+ */
+size_t linebuf_next(struct linebuf *buf, const char **line);
+
+/**
+ * Extract the next bytes from the buffer, regardless of line
+ * boundaries. The data is not searched for a line feed.
+ *
+ * The data is returned in the same way as a line.
+ *
+ * @param buf  Line buffer.
+ * @param max  Maximum number of bytes to extract.
+ * @param data Pointer to variable receiving pointer to the data.
+ *
+ * @return Number of bytes extracted, 0 if the buffer is empty.
+ */
+size_t linebuf_next_data(struct linebuf *buf, size_t max, const char **data);
+
+/**
+ * Return the number of bytes in the buffer which have not been
+ * returned as part of a line.
+ *
+ * @param buf Line buffer.
+ *
+ * @return Number of bytes.
+ */
+size_t linebuf_pending(const struct linebuf *buf);
+
+/**
+ * Move the data, which has not been returned as part of a line, to
+ * the end of a send buffer.
+ *
+ * If @a out is empty, the line buffer's memory is handed over to it
+ * rather than copying the data. The line buffer is then left empty,
+ * and must not be used except to be freed.
+ *
+ * @param buf Line buffer.
+ * @param out Send buffer.
+ */
+void linebuf_move(struct linebuf *buf, struct buffer *out);
+
+#endif /* OAPROXY_LINEBUF_H */
@@ -6,6 +6,7 @@
 #include <stdbool.h>
 #include <syslog.h>
 #include <assert.h>
+#include <signal.h>
 
 #include "ssl.h"
 #include "server.h"
@@ -18,6 +19,9 @@ int main(int argc, char *argv[])
 
     openlog(NULL, LOG_PID | LOG_PERROR, LOG_USER);
 
+    // Write errors on closed connections are handled where they occur
+    signal(SIGPIPE, SIG_IGN);
+
     initialize_ssl();
 
     size_t n_servers;
@@ -0,0 +1,418 @@
+#include "pool.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <syslog.h>
+#include <time.h>
+
+#include <openssl/ssl.h>
+
+#include "xmalloc.h"
+#include "ssl.h"
+#include "handshake.h"
+
+/**
+ * Interval, in milliseconds, at which the pool size is adjusted.
+ */
+#define POOL_TICK_INTERVAL 1000
+
+/**
+ * Time, in seconds, after which an unused connection is closed.
+ * Servers close connections on which no login happens quickly.
+ */
+#define POOL_IDLE_TIMEOUT 30
+
+/**
+ * Weight of the latest interval in the average rate at which
+ * connections are taken.
+ */
+#define POOL_RATE_WEIGHT 0.3
+
+/**
+ * Epoll events watched on pooled connections
+ */
+#define POOL_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+/**
+ * Connection in a pool
+ */
+struct pool_conn {
+    /** Pool to which the connection belongs */
+    struct upstream_pool *pool;
+
+    /** Server connection */
+    BIO *bio;
+    /** Server socket event loop watch */
+    struct event_watch watch;
+
+    /** True while the handshake is performed by a handshake thread */
+    bool offloaded;
+    /** True once the handshake is complete and the greeting received */
+    bool ready;
+    /** Time at which the connection was made */
+    time_t created;
+
+    /** Next connection in pool */
+    struct pool_conn *next;
+};
+
+struct upstream_pool {
+    /** Event loop */
+    struct event_loop *loop;
+    /** Server */
+    struct upstream *upstream;
+
+    /** Maximum number of connections */
+    size_t max;
+
+    /** Connections, both ready and connecting */
+    struct pool_conn *conns;
+    /** Number of connections */
+    size_t n_conns;
+
+    /** Number of connections requested in the current interval */
+    size_t takes;
+    /** Average number of connections requested per interval */
+    double rate;
+
+    /** Timer adjusting the pool size */
+    struct event_timer timer;
+};
+
+/**
+ * Return the current time from a monotonic clock, in seconds.
+ */
+static time_t now(void);
+
+/**
+ * Timer callback. Updates the request rate, closes idle connections
+ * and opens new connections up to the target size.
+ *
+ * @param loop Event loop.
+ * @param data The pool.
+ */
+static void pool_tick(struct event_loop *loop, void *data);
+
+/**
+ * Open new connections until the pool reaches its target size.
+ *
+ * @param pool The pool.
+ */
+static void pool_fill(struct upstream_pool *pool);
+
+/**
+ * Open a new connection and add it to the pool.
+ *
+ * @param pool The pool.
+ *
+ * @return True if the connection was initiated.
+ */
+static bool pool_connect(struct upstream_pool *pool);
+
+/**
+ * Event callback for a pooled connection. Completes the handshake
+ * and waits for the greeting, or detects that a ready connection has
+ * been closed by the server.
+ *
+ * @param loop   Event loop.
+ * @param events Epoll events.
+ * @param data   The pool_conn.
+ */
+static void conn_event(struct event_loop *loop, uint32_t events, void *data);
+
+/**
+ * Callback invoked when the handshake of a connection, performed by
+ * a handshake thread, completes. Starts watching the connection.
+ *
+ * @param loop   Event loop.
+ * @param result Result of the handshake.
+ * @param data   The pool_conn.
+ */
+static void conn_connected(struct event_loop *loop, int result, void *data);
+
+/**
+ * Remove a connection from the pool, without closing it.
+ *
+ * The pool_conn struct is freed once the events of the current loop
+ * iteration have been handled.
+ *
+ * @param pool The pool.
+ * @param conn The connection.
+ */
+static void conn_remove(struct upstream_pool *pool, struct pool_conn *conn);
+
+/**
+ * Remove a connection from the pool and close it.
+ *
+ * @param pool The pool.
+ * @param conn The connection.
+ */
+static void conn_close(struct upstream_pool *pool, struct pool_conn *conn);
+
+/**
+ * Free a pool_conn struct. Run as an event loop task.
+ *
+ * @param loop Event loop.
+ * @param conn The pool_conn.
+ */
+static void conn_free(struct event_loop *loop, void *conn);
+
+
+/* Implementation */
+
+struct upstream_pool *upstream_pool_create(struct event_loop *loop, struct upstream *upstream, size_t max) {
+    struct upstream_pool *pool = xmalloc(sizeof(struct upstream_pool));
+
+    pool->loop = loop;
+    pool->upstream = upstream_ref(upstream);
+    pool->max = max;
+
+    pool->conns = NULL;
+    pool->n_conns = 0;
+
+    pool->takes = 0;
+    pool->rate = 0;
+
+    if (!event_timer_start(loop, &pool->timer, POOL_TICK_INTERVAL, pool_tick, pool)) {
+        upstream_unref(upstream);
+        free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+void upstream_pool_free(struct upstream_pool *pool) {
+    event_timer_stop(pool->loop, &pool->timer);
+
+    struct pool_conn *conn = pool->conns;
+
+    while (conn) {
+        struct pool_conn *next = conn->next;
+
+        // An offloaded connection is owned by the handshake thread,
+        // which has been stopped.
+        if (!conn->offloaded) {
+            event_loop_remove(pool->loop, &conn->watch);
+            BIO_free_all(conn->bio);
+        }
+
+        free(conn);
+
+        conn = next;
+    }
+
+    upstream_unref(pool->upstream);
+    free(pool);
+}
+
+BIO *upstream_pool_take(struct upstream_pool *pool) {
+    pool->takes++;
+
+    // Take the oldest ready connection, which is nearest to expiry
+
+    struct pool_conn *ready = NULL;
+
+    for (struct pool_conn *conn = pool->conns; conn; conn = conn->next) {
+        if (conn->ready && (!ready || conn->created <= ready->created))
+            ready = conn;
+    }
+
+    if (!ready)
+        return NULL;
+
+    BIO *bio = ready->bio;
+    conn_remove(pool, ready);
+
+    pool_fill(pool);
+
+    return bio;
+}
+
+
+/* Sizing */
+
+void pool_tick(struct event_loop *loop, void *data) {
+    struct upstream_pool *pool = data;
+
+    pool->rate = POOL_RATE_WEIGHT * pool->takes + (1 - POOL_RATE_WEIGHT) * pool->rate;
+    pool->takes = 0;
+
+    // Close idle connections
+
+    time_t expiry = now() - POOL_IDLE_TIMEOUT;
+    struct pool_conn *conn = pool->conns;
+
+    while (conn) {
+        struct pool_conn *next = conn->next;
+
+        if (conn->created < expiry && !conn->offloaded)
+            conn_close(pool, conn);
+
+        conn = next;
+    }
+
+    pool_fill(pool);
+}
+
+void pool_fill(struct upstream_pool *pool) {
+    // Keep enough connections for the connections requested in one
+    // interval, at the average rate
+    size_t target = pool->rate;
+
+    if (target < pool->rate)
+        target++;
+
+    if (target > pool->max)
+        target = pool->max;
+
+    while (pool->n_conns < target) {
+        if (!pool_connect(pool))
+            break;
+    }
+}
+
+time_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec;
+}
+
+
+/* Connections */
+
+bool pool_connect(struct upstream_pool *pool) {
+    BIO *bio = server_connect(pool->upstream);
+    if (!bio) return false;
+
+    int fd = BIO_get_fd(bio, NULL);
+
+    if (!event_set_nonblocking(fd))
+        goto free_bio;
+
+    struct pool_conn *conn = xmalloc(sizeof(struct pool_conn));
+
+    conn->pool = pool;
+    conn->bio = bio;
+    conn->ready = false;
+    conn->created = now();
+
+    conn->watch.fd = -1;
+    conn->offloaded = handshake_offload(pool->loop, bio, pool->upstream->host, conn_connected, conn);
+
+    if (!conn->offloaded &&
+        !event_loop_add(pool->loop, &conn->watch, fd, POOL_EVENTS, conn_event, conn)) {
+        free(conn);
+        goto free_bio;
+    }
+
+    conn->next = pool->conns;
+    pool->conns = conn;
+    pool->n_conns++;
+
+    return true;
+
+free_bio:
+    BIO_free_all(bio);
+    return false;
+}
+
+void conn_event(struct event_loop *loop, uint32_t events, void *data) {
+    struct pool_conn *conn = data;
+
+    // Removed from the pool in the current iteration
+    if (!conn->bio)
+        return;
+
+    // The greeting of a ready connection is already buffered by
+    // OpenSSL, thus reading does not detect that the server closed
+    // the connection.
+    if (conn->ready) {
+        if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            conn_close(conn->pool, conn);
+
+        return;
+    }
+
+    int ret = server_handshake(conn->bio, conn->pool->upstream->host);
+
+    // The descriptor changes once the connection is established
+    int fd = BIO_get_fd(conn->bio, NULL);
+
+    if (ret < 0 ||
+        (fd != conn->watch.fd && !event_loop_move(loop, &conn->watch, fd, POOL_EVENTS))) {
+        conn_close(conn->pool, conn);
+        return;
+    }
+    else if (ret == 0) {
+        return;
+    }
+
+    // Wait for the greeting, which is kept buffered by OpenSSL
+
+    SSL *ssl;
+    char c;
+
+    BIO_get_ssl(conn->bio, &ssl);
+
+    if (ssl && SSL_peek(ssl, &c, 1) <= 0) {
+        int err = SSL_get_error(ssl, 0);
+
+        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+            conn_close(conn->pool, conn);
+            return;
+        }
+
+        return;
+    }
+
+    // Closed by the server after sending the greeting
+    if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        conn_close(conn->pool, conn);
+        return;
+    }
+
+    conn->ready = true;
+}
+
+void conn_connected(struct event_loop *loop, int result, void *data) {
+    struct pool_conn *conn = data;
+
+    conn->offloaded = false;
+
+    // The initial event on the socket waits for the greeting
+    if (result < 0 ||
+        !event_loop_add(loop, &conn->watch, BIO_get_fd(conn->bio, NULL), POOL_EVENTS, conn_event, conn)) {
+        conn->watch.fd = -1;
+        conn_close(conn->pool, conn);
+    }
+}
+
+void conn_remove(struct upstream_pool *pool, struct pool_conn *conn) {
+    struct pool_conn **prev = &pool->conns;
+
+    while (*prev != conn) {
+        prev = &(*prev)->next;
+    }
+
+    *prev = conn->next;
+    pool->n_conns--;
+
+    if (conn->watch.fd >= 0)
+        event_loop_remove(pool->loop, &conn->watch);
+
+    conn->bio = NULL;
+    event_loop_post(pool->loop, conn_free, conn);
+}
+
+void conn_close(struct upstream_pool *pool, struct pool_conn *conn) {
+    BIO *bio = conn->bio;
+
+    conn_remove(pool, conn);
+    BIO_free_all(bio);
+}
+
+void conn_free(struct event_loop *loop, void *conn) {
+    free(conn);
+}
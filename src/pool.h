@@ -0,0 +1,59 @@
+#ifndef OAPROXY_POOL_H
+#define OAPROXY_POOL_H
+
+#include <stddef.h>
+
+#include <openssl/bio.h>
+
+#include "event.h"
+#include "upstream.h"
+
+/**
+ * Pool of connections to an upstream server, on which the TLS
+ * handshake has completed and the server's greeting has been
+ * received, ready to be paired with a new client.
+ *
+ * The number of connections kept in the pool follows the rate at
+ * which connections are taken from it, up to a maximum. Connections
+ * which remain unused for too long are closed.
+ *
+ * A pool belongs to a single event loop and must only be used from
+ * the loop's thread.
+ */
+struct upstream_pool;
+
+/**
+ * Create a connection pool.
+ *
+ * @param loop     Event loop driving the pooled connections.
+ * @param upstream Server to connect to. A reference is held by the
+ *   pool.
+ * @param max      Maximum number of connections in the pool.
+ *
+ * @return The pool, NULL if it could not be created.
+ */
+struct upstream_pool *upstream_pool_create(struct event_loop *loop, struct upstream *upstream, size_t max);
+
+/**
+ * Free a connection pool and close its connections.
+ *
+ * Must be called after the pool's event loop has stopped running.
+ *
+ * @param pool The pool.
+ */
+void upstream_pool_free(struct upstream_pool *pool);
+
+/**
+ * Take a ready connection from the pool.
+ *
+ * The server's greeting is buffered in the returned BIO and is
+ * returned by the first read.
+ *
+ * @param pool The pool.
+ *
+ * @return The connection, NULL if there is no ready connection in
+ *   the pool.
+ */
+BIO *upstream_pool_take(struct upstream_pool *pool);
+
+#endif /* OAPROXY_POOL_H */
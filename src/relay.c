@@ -0,0 +1,735 @@
+#include "relay.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "xmalloc.h"
+#include "handshake.h"
+
+/**
+ * Number of bytes read at once when forwarding data, directly into
+ * the buffer of the other side. Matches the maximum size of a TLS
+ * record, so that a whole record is received with a single read.
+ */
+#define RELAY_READ_SIZE (16 * 1024)
+
+/**
+ * Epoll events watched on the client and server sockets
+ */
+#define RELAY_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+/**
+ * Event loop callback for the client socket.
+ *
+ * @param loop   Event loop
+ * @param events Epoll events
+ * @param data   Relay session
+ */
+static void relay_client_event(struct event_loop *loop, uint32_t events, void *data);
+
+/**
+ * Event loop callback for the server socket.
+ *
+ * @param loop   Event loop
+ * @param events Epoll events
+ * @param data   Relay session
+ */
+static void relay_server_event(struct event_loop *loop, uint32_t events, void *data);
+
+/**
+ * Process a session after an event on one of its sockets.
+ *
+ * @param loop  Event loop
+ * @param relay Relay session
+ */
+static void relay_event(struct event_loop *loop, struct relay *relay);
+
+/**
+ * Watch the server connection's current descriptor, which changes
+ * once the connection to the server is established.
+ *
+ * @param loop  Event loop
+ * @param relay Relay session
+ *
+ * @return True if successful.
+ */
+static bool relay_watch_server(struct event_loop *loop, struct relay *relay);
+
+/**
+ * Callback invoked when the TLS handshake with the server, performed
+ * by a handshake thread, completes. Starts watching the server
+ * socket.
+ *
+ * @param loop   Event loop
+ * @param result Result of the handshake
+ * @param data   Relay session
+ */
+static void relay_server_connected(struct event_loop *loop, int result, void *data);
+
+/**
+ * Forward as much data as possible between the client and server,
+ * without blocking.
+ *
+ * @param relay Relay session
+ *
+ * @return True if the session should continue, false if it should be
+ *   closed.
+ */
+static bool relay_process(struct relay *relay);
+
+/**
+ * Close a session.
+ *
+ * The session is removed from the event loop and freed once the
+ * events received in the current iteration have been handled.
+ *
+ * @param loop  Event loop
+ * @param relay Relay session
+ */
+static void relay_close(struct event_loop *loop, struct relay *relay);
+
+/**
+ * Free a session and close its connections. Run as an event loop
+ * task.
+ *
+ * @param loop Event loop
+ * @param data Relay session
+ */
+static void relay_free(struct event_loop *loop, void *data);
+
+
+/* Forwarding Data */
+
+/**
+ * Forward data received from the server to the client.
+ *
+ * @param relay    Relay session
+ * @param progress Set to true if any data was received
+ */
+static void relay_server_data(struct relay *relay, bool *progress);
+
+/**
+ * Forward data received from the client to the server.
+ *
+ * @param relay    Relay session
+ * @param progress Set to true if any data was received
+ */
+static void relay_client_data(struct relay *relay, bool *progress);
+
+/**
+ * Splice data received from the server into the pipe to the client.
+ *
+ * Data already read by OpenSSL and TLS records other than application
+ * data are forwarded with relay_server_data(), once the pipe is
+ * empty.
+ *
+ * @param relay    Relay session
+ * @param progress Set to true if any data was received
+ */
+static void relay_server_splice(struct relay *relay, bool *progress);
+
+/**
+ * Splice data received from the client into the pipe to the server.
+ *
+ * @param relay    Relay session
+ * @param progress Set to true if any data was received
+ */
+static void relay_client_splice(struct relay *relay, bool *progress);
+
+
+/* Sending Data */
+
+/**
+ * Check whether more data from the server will be forwarded to the
+ * client right after the data queued for it has been sent. This is
+ * the case when reading from the server was stopped only because the
+ * client's buffer is full.
+ *
+ * @param relay Relay session
+ *
+ * @return True if more data will be forwarded.
+ */
+static bool server_data_follows(const struct relay *relay);
+
+/**
+ * Send the data queued for the server, followed by the data in the
+ * pipe to the server, until all data is sent or the server socket
+ * would block.
+ *
+ * @param relay    Relay session
+ * @param progress Set to true if any data was sent
+ *
+ * @return False if there was an error sending data.
+ */
+static bool relay_server_flush(struct relay *relay, bool *progress);
+
+/**
+ * Send the data queued for the client, followed by the data in the
+ * pipe to the client, until all data is sent or the client socket
+ * would block.
+ *
+ * @param relay    Relay session
+ * @param progress Set to true if any data was sent
+ *
+ * @return False if there was an error sending data.
+ */
+static bool relay_client_flush(struct relay *relay, bool *progress);
+
+
+/* Implementation */
+
+bool relay_start(struct event_loop *loop, int c_fd, struct upstream *upstream, BIO *bio,
+                 const struct relay_filter *filter, void *data) {
+    // Only the handshake of a new connection is offloaded
+    bool offload = !bio;
+
+    if (!bio)
+        bio = server_connect(upstream);
+
+    if (!bio) {
+        filter->free(data);
+        close(c_fd);
+        return false;
+    }
+
+    struct relay *relay = xmalloc(sizeof(struct relay));
+
+    relay->loop = loop;
+
+    relay->filter = filter;
+    relay->data = data;
+    relay->filtering = true;
+
+    relay->upstream = upstream_ref(upstream);
+    relay->connected = false;
+
+    relay->c_fd = c_fd;
+    relay->s_bio = bio;
+    relay->s_fd = BIO_get_fd(bio, NULL);
+
+    buffer_init(&relay->c_out);
+    buffer_init(&relay->s_out);
+    record_sizing_init(&relay->s_records);
+
+    zerocopy_init(&relay->c_zc, c_fd);
+
+    relay->splice = false;
+    relay->s_record = false;
+
+    splice_pipe_init(&relay->c_pipe);
+    splice_pipe_init(&relay->s_pipe);
+
+    relay->c_eof = relay->s_eof = false;
+    relay->closed = false;
+
+    relay->c_readable = relay->c_writable = true;
+    relay->s_readable = relay->s_writable = true;
+    relay->c_hup = false;
+
+    relay->offloaded = false;
+    relay->s_watch.fd = -1;
+
+    if (!event_set_nonblocking(c_fd) || !event_set_nonblocking(relay->s_fd)) {
+        goto free_relay;
+    }
+
+    if (!event_loop_add(loop, &relay->c_watch, c_fd, RELAY_EVENTS, relay_client_event, relay)) {
+        goto free_relay;
+    }
+
+    if (offload)
+        relay->offloaded = handshake_offload(loop, bio, upstream->host, relay_server_connected, relay);
+
+    if (!relay->offloaded &&
+        !event_loop_add(loop, &relay->s_watch, relay->s_fd, RELAY_EVENTS, relay_server_event, relay)) {
+        event_loop_remove(loop, &relay->c_watch);
+        goto free_relay;
+    }
+
+    return true;
+
+free_relay:
+    relay_free(loop, relay);
+    return false;
+}
+
+void relay_client_event(struct event_loop *loop, uint32_t events, void *data) {
+    struct relay *relay = data;
+
+    // Completions of zero-copy sends are reported as socket errors
+    if ((events & EPOLLERR) && zerocopy_busy(&relay->c_zc) &&
+        zerocopy_complete(&relay->c_zc)) {
+        events &= ~EPOLLERR;
+    }
+
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        relay->c_readable = true;
+
+    if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+        relay->c_writable = true;
+
+    if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        relay->c_hup = true;
+
+    relay_event(loop, relay);
+}
+
+void relay_server_event(struct event_loop *loop, uint32_t events, void *data) {
+    struct relay *relay = data;
+
+    // TLS may need to read in order to write and vice versa, thus
+    // any event makes both directions worth retrying.
+    relay->s_readable = relay->s_writable = true;
+
+    relay_event(loop, relay);
+}
+
+void relay_event(struct event_loop *loop, struct relay *relay) {
+    // The server connection is owned by the handshake thread while
+    // offloaded, client data is only processed after the handshake.
+    if (relay->closed || relay->offloaded)
+        return;
+
+    bool connecting = !relay->connected;
+
+    if (!relay_process(relay) ||
+        (connecting && !relay_watch_server(loop, relay))) {
+        relay_close(loop, relay);
+    }
+}
+
+bool relay_watch_server(struct event_loop *loop, struct relay *relay) {
+    int fd = BIO_get_fd(relay->s_bio, NULL);
+
+    if (fd == relay->s_watch.fd)
+        return true;
+
+    if (!event_loop_move(loop, &relay->s_watch, fd, RELAY_EVENTS))
+        return false;
+
+    relay->s_fd = fd;
+    return true;
+}
+
+void relay_server_connected(struct event_loop *loop, int result, void *data) {
+    struct relay *relay = data;
+
+    relay->offloaded = false;
+    relay->s_fd = BIO_get_fd(relay->s_bio, NULL);
+
+    // The handshake is complete, the initial event on the socket
+    // continues the session.
+    if (result < 0 ||
+        !event_loop_add(loop, &relay->s_watch, relay->s_fd, RELAY_EVENTS, relay_server_event, relay)) {
+        relay->s_watch.fd = -1;
+        relay_close(loop, relay);
+    }
+}
+
+bool relay_process(struct relay *relay) {
+    if (!relay->connected) {
+        int ret = server_handshake(relay->s_bio, relay->upstream->host);
+
+        if (ret <= 0)
+            return ret == 0;
+
+        relay->connected = true;
+
+        if (!relay->filter->start(relay))
+            return false;
+    }
+
+    bool progress;
+
+    do {
+        progress = false;
+
+        if (relay->s_readable && !relay->s_eof &&
+            relay_client_pending(relay) < RELAY_BUF_MAX) {
+
+            if (relay->filtering) {
+                if (!relay->filter->server_data(relay, &progress))
+                    return false;
+            }
+            else if (relay->splice) {
+                relay_server_splice(relay, &progress);
+            }
+            else {
+                relay_server_data(relay, &progress);
+            }
+        }
+
+        if (relay->c_readable && !relay->c_eof &&
+            buffer_len(&relay->s_out) < RELAY_BUF_MAX) {
+
+            if (relay->filtering) {
+                if (!relay->filter->client_data(relay, &progress))
+                    return false;
+            }
+            else if (relay->splice) {
+                relay_client_splice(relay, &progress);
+            }
+            else {
+                relay_client_data(relay, &progress);
+            }
+        }
+
+        if (!relay_client_flush(relay, &progress) ||
+            !relay_server_flush(relay, &progress))
+            return false;
+
+    } while (progress);
+
+    // Close the session once either side has closed the connection
+    // and the data received from it has been forwarded. The memory
+    // of zero-copy sends to the client must be kept until they
+    // complete.
+
+    if (zerocopy_busy(&relay->c_zc))
+        return true;
+
+    if (relay->s_eof && !buffer_len(&relay->c_out) && !relay->c_pipe.len)
+        return false;
+
+    if (relay->c_eof && !buffer_len(&relay->s_out) && !relay->s_pipe.len)
+        return false;
+
+    return true;
+}
+
+void relay_close(struct event_loop *loop, struct relay *relay) {
+    relay->closed = true;
+
+    event_loop_remove(loop, &relay->c_watch);
+
+    if (relay->s_watch.fd >= 0)
+        event_loop_remove(loop, &relay->s_watch);
+
+    event_loop_post(loop, relay_free, relay);
+}
+
+void relay_free(struct event_loop *loop, void *data) {
+    struct relay *relay = data;
+
+    relay->filter->free(relay->data);
+
+    BIO_free_all(relay->s_bio);
+
+    zerocopy_free(&relay->c_zc);
+    close(relay->c_fd);
+
+    buffer_free(&relay->c_out);
+    buffer_free(&relay->s_out);
+
+    splice_pipe_close(&relay->c_pipe);
+    splice_pipe_close(&relay->s_pipe);
+
+    upstream_unref(relay->upstream);
+    free(relay);
+}
+
+void relay_passthrough(struct relay *relay) {
+    relay->filtering = false;
+
+    // The data no longer has to be parsed, thus it is moved between
+    // the sockets without copying it to user space, when the server
+    // connection's records are encrypted by the kernel.
+    relay->splice = server_ktls(relay->s_bio) &&
+        splice_pipe_open(&relay->c_pipe) &&
+        splice_pipe_open(&relay->s_pipe);
+
+    // Otherwise large responses are sent to the client without
+    // copying them.
+    if (!relay->splice)
+        zerocopy_enable(&relay->c_zc);
+}
+
+
+/* Forwarding Data */
+
+void relay_resume(struct relay *relay, bool ok) {
+    // Closed while the request was pending, the session is freed by
+    // a task which has already been posted
+    if (relay->closed)
+        return;
+
+    if (!ok) {
+        relay_close(relay->loop, relay);
+        return;
+    }
+
+    relay_event(relay->loop, relay);
+}
+
+void relay_server_data(struct relay *relay, bool *progress) {
+    while (relay_client_pending(relay) < RELAY_BUF_MAX) {
+        char *s_data = buffer_reserve(&relay->c_out, RELAY_READ_SIZE);
+        int s_n = BIO_read(relay->s_bio, s_data, RELAY_READ_SIZE);
+
+        if (s_n <= 0) {
+            if (BIO_should_retry(relay->s_bio)) {
+                relay->s_readable = false;
+                return;
+            }
+
+            if (s_n < 0) {
+                syslog(LOG_ERR, "%s: Error reading data from server", relay->filter->name);
+                ssl_log_error(NULL);
+            }
+            else {
+                syslog(LOG_NOTICE, "%s: Server closed connection", relay->filter->name);
+            }
+
+            relay->s_eof = true;
+            *progress = true;
+            return;
+        }
+
+        *progress = true;
+        buffer_commit(&relay->c_out, s_n);
+    }
+}
+
+void relay_client_data(struct relay *relay, bool *progress) {
+    while (buffer_len(&relay->s_out) < RELAY_BUF_MAX) {
+        char *c_data = buffer_reserve(&relay->s_out, RELAY_READ_SIZE);
+        ssize_t c_n = recv(relay->c_fd, c_data, RELAY_READ_SIZE, 0);
+
+        if (c_n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                relay->c_readable = false;
+                return;
+            }
+
+            if (errno == EINTR)
+                continue;
+
+            syslog(LOG_ERR, "%s: Error reading data from client: %m", relay->filter->name);
+        }
+        else if (c_n == 0) {
+            syslog(LOG_NOTICE, "%s: Client closed connection", relay->filter->name);
+        }
+
+        *progress = true;
+
+        if (c_n <= 0) {
+            relay->c_eof = true;
+            return;
+        }
+
+        buffer_commit(&relay->s_out, c_n);
+
+        // A short read means the socket buffer has been drained. Any
+        // data arriving later triggers a new event, unless the client
+        // has shut down the connection, in which case read until EOF.
+        if (c_n < RELAY_READ_SIZE && !relay->c_hup) {
+            relay->c_readable = false;
+            return;
+        }
+    }
+}
+
+void relay_server_splice(struct relay *relay, bool *progress) {
+    struct splice_pipe *pipe = &relay->c_pipe;
+
+    if (relay->s_record || server_pending(relay->s_bio)) {
+        // Preserve the order of the data sent to the client
+        if (pipe->len) return;
+
+        relay->s_record = false;
+        relay_server_data(relay, progress);
+        return;
+    }
+
+    while (pipe->len < pipe->size) {
+        ssize_t s_n = splice_pipe_fill(pipe, relay->s_fd);
+
+        if (s_n < 0) {
+            // The pipe may be full before its capacity is reached,
+            // thus the socket is only known to be drained if the pipe
+            // is empty.
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!pipe->len) relay->s_readable = false;
+                return;
+            }
+
+            if (errno == EINTR)
+                continue;
+
+            // Records other than application data cannot be spliced
+            if (errno == EINVAL) {
+                relay->s_record = true;
+                *progress = true;
+                return;
+            }
+
+            syslog(LOG_ERR, "%s: Error reading data from server: %m", relay->filter->name);
+        }
+        else if (s_n == 0) {
+            syslog(LOG_NOTICE, "%s: Server closed connection", relay->filter->name);
+        }
+
+        *progress = true;
+
+        if (s_n <= 0) {
+            relay->s_eof = true;
+            return;
+        }
+    }
+}
+
+void relay_client_splice(struct relay *relay, bool *progress) {
+    struct splice_pipe *pipe = &relay->s_pipe;
+
+    while (pipe->len < pipe->size) {
+        ssize_t c_n = splice_pipe_fill(pipe, relay->c_fd);
+
+        if (c_n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!pipe->len) relay->c_readable = false;
+                return;
+            }
+
+            if (errno == EINTR)
+                continue;
+
+            syslog(LOG_ERR, "%s: Error reading data from client: %m", relay->filter->name);
+        }
+        else if (c_n == 0) {
+            syslog(LOG_NOTICE, "%s: Client closed connection", relay->filter->name);
+        }
+
+        *progress = true;
+
+        if (c_n <= 0) {
+            relay->c_eof = true;
+            return;
+        }
+    }
+}
+
+
+/* Sending Data */
+
+size_t relay_client_pending(const struct relay *relay) {
+    return buffer_len(&relay->c_out) + zerocopy_pending(&relay->c_zc);
+}
+
+bool server_data_follows(const struct relay *relay) {
+    return relay->s_readable && !relay->s_eof && !relay->splice &&
+        relay_client_pending(relay) >= RELAY_BUF_MAX;
+}
+
+void relay_server_send(struct relay *relay, const char *data, size_t n) {
+    buffer_append(&relay->s_out, data, n);
+}
+
+void relay_client_send(struct relay *relay, const char *data, size_t n) {
+    buffer_append(&relay->c_out, data, n);
+}
+
+bool relay_server_flush(struct relay *relay, bool *progress) {
+    struct buffer *buf = &relay->s_out;
+
+    while (relay->s_writable && buffer_len(buf)) {
+        int s_n = server_write(relay->s_bio, &relay->s_records, buffer_data(buf), buffer_len(buf));
+
+        if (s_n <= 0) {
+            if (BIO_should_retry(relay->s_bio)) {
+                relay->s_writable = false;
+                return true;
+            }
+
+            syslog(LOG_ERR, "%s: Error sending data to server", relay->filter->name);
+            ssl_log_error(NULL);
+            return false;
+        }
+
+        buffer_consume(buf, s_n);
+        *progress = true;
+    }
+
+    while (relay->s_writable && !buffer_len(buf) && relay->s_pipe.len) {
+        ssize_t s_n = splice_pipe_drain(&relay->s_pipe, relay->s_fd);
+
+        if (s_n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                relay->s_writable = false;
+                return true;
+            }
+
+            if (errno == EINTR)
+                continue;
+
+            syslog(LOG_ERR, "%s: Error sending data to server: %m", relay->filter->name);
+            return false;
+        }
+
+        *progress = true;
+    }
+
+    return true;
+}
+
+bool relay_client_flush(struct relay *relay, bool *progress) {
+    struct buffer *buf = &relay->c_out;
+
+    // Hold back a partial segment while more data is about to be
+    // queued, so that bulk data is sent in full segments
+    int flags = server_data_follows(relay) ? MSG_MORE : 0;
+
+    while (relay->c_writable && relay_client_pending(relay)) {
+        // The remaining data of a zero-copy send is sent first
+        size_t n = zerocopy_pending(&relay->c_zc);
+        if (!n) n = buffer_len(buf);
+
+        ssize_t c_n = zerocopy_send(&relay->c_zc, buf, flags);
+
+        if (c_n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                relay->c_writable = false;
+                return true;
+            }
+
+            if (errno == EINTR)
+                continue;
+
+            syslog(LOG_ERR, "%s: Error sending data to client: %m", relay->filter->name);
+            return false;
+        }
+
+        *progress = true;
+
+        // A short write means the socket buffer is full
+        if (c_n < n) {
+            relay->c_writable = false;
+        }
+    }
+
+    while (relay->c_writable && !relay_client_pending(relay) && relay->c_pipe.len) {
+        ssize_t c_n = splice_pipe_drain(&relay->c_pipe, relay->c_fd);
+
+        if (c_n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                relay->c_writable = false;
+                return true;
+            }
+
+            if (errno == EINTR)
+                continue;
+
+            syslog(LOG_ERR, "%s: Error sending data to client: %m", relay->filter->name);
+            return false;
+        }
+
+        *progress = true;
+    }
+
+    return true;
+}
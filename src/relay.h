@@ -0,0 +1,267 @@
+#ifndef OAPROXY_RELAY_H
+#define OAPROXY_RELAY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <openssl/bio.h>
+
+#include "event.h"
+#include "upstream.h"
+#include "buffer.h"
+#include "splice.h"
+#include "zerocopy.h"
+#include "ssl.h"
+
+/**
+ * Maximum number of bytes pending to be sent to one side of the
+ * connection. No more data is read from the other side until the
+ * pending data drops below this limit.
+ */
+#define RELAY_BUF_MAX (64 * 1024)
+
+struct relay;
+
+/**
+ * Protocol specific handling of the data exchanged while the client
+ * authenticates.
+ *
+ * Until relay_passthrough() is called, the data received on either
+ * side is read by the filter, which queues the data to forward, after
+ * rewriting it, with relay_client_send() and relay_server_send().
+ *
+ * The read functions are only called while the side is readable, has
+ * not reached the end of its stream and the other side's send buffer
+ * is below RELAY_BUF_MAX. They should read until this is no longer
+ * the case, setting the readable flag to false if no more data is
+ * available, or the eof flag if the stream has ended. A filter may
+ * also stop reading while it waits for a request to complete, after
+ * which it calls relay_resume().
+ */
+struct relay_filter {
+    /** Protocol name, used in log messages */
+    const char *name;
+
+    /**
+     * Called once the connection to the server has been
+     * established, before any data is read.
+     *
+     * @param relay Relay session.
+     *
+     * @return True if successful, false if the session should be
+     *   closed.
+     */
+    bool (*start)(struct relay *relay);
+
+    /**
+     * Read and handle the data received from the client.
+     *
+     * @param relay    Relay session.
+     * @param progress Set to true if any data was received.
+     *
+     * @return False if the session should be closed.
+     */
+    bool (*client_data)(struct relay *relay, bool *progress);
+
+    /**
+     * Read and handle the data received from the server.
+     *
+     * @param relay    Relay session.
+     * @param progress Set to true if any data was received.
+     *
+     * @return False if the session should be closed.
+     */
+    bool (*server_data)(struct relay *relay, bool *progress);
+
+    /**
+     * Free the protocol state of the session.
+     *
+     * @param data Protocol state.
+     */
+    void (*free)(void *data);
+};
+
+/**
+ * Session forwarding data between a client and a server.
+ *
+ * The session is driven by events on both sockets. Data is read only
+ * while a socket is known to be readable and the buffer of the other
+ * side has room, and written only while a socket is known to be
+ * writable.
+ */
+struct relay {
+    /** Event loop driving the session */
+    struct event_loop *loop;
+
+    /** Protocol filter */
+    const struct relay_filter *filter;
+    /** Protocol state, freed by the filter's free function */
+    void *data;
+
+    /**
+     * True while the data is handled by the filter, false once it is
+     * forwarded as is.
+     */
+    bool filtering;
+
+    /** Server */
+    struct upstream *upstream;
+
+    /** True once the TLS handshake with the server has completed */
+    bool connected;
+
+    /** Client socket file descriptor */
+    int c_fd;
+    /** Client socket event loop watch */
+    struct event_watch c_watch;
+
+    /** Server OpenSSL BIO object */
+    BIO *s_bio;
+    /** Server socket file descriptor */
+    int s_fd;
+    /** Server socket event loop watch */
+    struct event_watch s_watch;
+
+    /** Data pending to be sent to the client */
+    struct buffer c_out;
+    /** Data pending to be sent to the server */
+    struct buffer s_out;
+    /** Sizing of the TLS records sent to the server */
+    struct record_sizing s_records;
+
+    /**
+     * Zero-copy sends to the client. Once passing data through,
+     * large amounts of data pending to be sent to the client are
+     * moved out of c_out and sent without copying them to the socket
+     * buffer.
+     */
+    struct zerocopy c_zc;
+
+    /**
+     * True if data is relayed by splicing it between the sockets,
+     * which is possible when the server connection uses kernel TLS.
+     * Data in the pipes is sent after the data in the corresponding
+     * buffer.
+     */
+    bool splice;
+
+    /** Spliced data pending to be sent to the client */
+    struct splice_pipe c_pipe;
+    /** Spliced data pending to be sent to the server */
+    struct splice_pipe s_pipe;
+
+    /**
+     * True if a TLS record other than application data was received
+     * from the server, which has to be read through OpenSSL.
+     */
+    bool s_record;
+
+    /** True if no more data will be received from the client */
+    bool c_eof;
+    /** True if no more data will be received from the server */
+    bool s_eof;
+
+    /**
+     * Socket readiness, as reported by the event loop. A socket is
+     * only read/written while it is known to be ready, which saves a
+     * system call returning EAGAIN every time data is forwarded.
+     */
+
+    /** True if the client socket may have data to read */
+    bool c_readable;
+    /** True if the client socket may accept more data */
+    bool c_writable;
+    /** True if the client has shut down its end of the connection */
+    bool c_hup;
+
+    /** True if the server connection may have data to read */
+    bool s_readable;
+    /** True if the server connection may accept more data */
+    bool s_writable;
+
+    /**
+     * True while the TLS handshake with the server is performed by a
+     * handshake thread. The server socket is not watched until the
+     * handshake completes.
+     */
+    bool offloaded;
+
+    /** True if the session has been closed */
+    bool closed;
+};
+
+/**
+ * Start a relay session on an event loop.
+ *
+ * If @a bio is NULL, a connection to the server is initiated. The
+ * client socket is closed, and the protocol state freed, when the
+ * session ends or if the session could not be started.
+ *
+ * @param loop     Event loop
+ * @param c_fd     Client socket descriptor
+ * @param upstream Server. A reference is held for the duration of
+ *   the session.
+ * @param bio      Established server connection, taken from a
+ *   connection pool, or NULL. Freed by the session.
+ * @param filter   Protocol filter
+ * @param data     Protocol state
+ *
+ * @return True if the session was started.
+ */
+bool relay_start(struct event_loop *loop, int c_fd, struct upstream *upstream, BIO *bio,
+                 const struct relay_filter *filter, void *data);
+
+/**
+ * Stop filtering and forward the data between the client and server
+ * as is.
+ *
+ * The filter should move any data it has buffered to the send
+ * buffers before calling this function.
+ *
+ * @param relay Relay session
+ */
+void relay_passthrough(struct relay *relay);
+
+/**
+ * Continue a session after the filter has stopped reading data while
+ * waiting for an event other than socket readiness, such as the
+ * completion of a request.
+ *
+ * Processes the data received, and queued to be sent, since. Must be
+ * called on the session's event loop. Does nothing if the session
+ * was closed in the meantime.
+ *
+ * @param relay Relay session
+ * @param ok    If false the session is closed.
+ */
+void relay_resume(struct relay *relay, bool ok);
+
+/**
+ * Queue data to be sent to the client.
+ *
+ * @param relay Relay session
+ * @param data  Block of data to send
+ * @param n     Size of data in bytes
+ */
+void relay_client_send(struct relay *relay, const char *data, size_t n);
+
+/**
+ * Queue data to be sent to the server.
+ *
+ * @param relay Relay session
+ * @param data  Block of data to send
+ * @param n     Size of data in bytes
+ */
+void relay_server_send(struct relay *relay, const char *data, size_t n);
+
+/**
+ * Return the number of bytes pending to be sent to the client,
+ * including the data of a zero-copy send which has not been sent.
+ *
+ * @param relay Relay session
+ *
+ * @return Number of bytes.
+ */
+size_t relay_client_pending(const struct relay *relay);
+
+#endif /* OAPROXY_RELAY_H */
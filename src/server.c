@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include "server.h"
 
 #include <stdlib.h>
@@ -6,6 +8,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <assert.h>
 
 #include <sys/types.h>
@@ -13,10 +16,17 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #include "gaccounts.h"
+#include "tokens.h"
+#include "event.h"
 
 #include "ssl.h"
+#include "upstream.h"
+#include "pool.h"
+#include "handshake.h"
 #include "smtp.h"
 #include "imap.h"
 
@@ -30,6 +40,39 @@
 #define STR_SMTP "SMTP "
 #define STR_SMTP_LEN strlen(STR_SMTP)
 
+#define STR_WORKERS "WORKERS "
+#define STR_WORKERS_LEN strlen(STR_WORKERS)
+
+#define STR_QUEUE_LIMIT "QUEUE_LIMIT "
+#define STR_QUEUE_LIMIT_LEN strlen(STR_QUEUE_LIMIT)
+
+#define STR_REUSEPORT "REUSEPORT "
+#define STR_REUSEPORT_LEN strlen(STR_REUSEPORT)
+
+#define STR_SESSION_DIR "TLS_SESSION_DIR "
+#define STR_SESSION_DIR_LEN strlen(STR_SESSION_DIR)
+
+#define STR_POOL_SIZE "POOL_SIZE "
+#define STR_POOL_SIZE_LEN strlen(STR_POOL_SIZE)
+
+#define STR_HANDSHAKE_THREADS "HANDSHAKE_THREADS "
+#define STR_HANDSHAKE_THREADS_LEN strlen(STR_HANDSHAKE_THREADS)
+
+#define STR_TOKEN_REFRESH "TOKEN_REFRESH "
+#define STR_TOKEN_REFRESH_LEN strlen(STR_TOKEN_REFRESH)
+
+/**
+ * Default maximum number of connections waiting to be started by a
+ * worker.
+ */
+#define DEFAULT_QUEUE_LIMIT 1024
+
+/**
+ * Stack size of worker threads. Sessions keep their state on the heap
+ * so the default stack size, typically 8 MB, is not necessary.
+ */
+#define WORKER_STACK_SIZE (256 * 1024)
+
 /**
  * Represents a connection to a proxy server
  */
@@ -38,8 +81,88 @@ struct proxy_client {
     int fd;
     /** Remote server details */
     const struct proxy_server *server;
+    /** Worker to which the connection is assigned */
+    struct worker *worker;
+};
+
+struct proxy_options proxy_options = {
+    .workers = 0,
+    .queue_limit = DEFAULT_QUEUE_LIMIT,
+    .reuseport = false,
+    .session_dir = NULL,
+    .pool_size = 0,
+    .handshake_threads = 0,
+    .token_refresh = TOKEN_REFRESH_MARGIN
 };
 
+/**
+ * Listening socket watched by an event loop
+ */
+struct listener {
+    /** Socket file descriptor */
+    int fd;
+    /** Event loop watch */
+    struct event_watch watch;
+
+    /** Proxy server for which connections are accepted */
+    const struct proxy_server *server;
+
+    /**
+     * Worker owning the socket, NULL if connections are handed to the
+     * workers.
+     */
+    struct worker *worker;
+};
+
+/**
+ * Worker thread running an event loop, on which proxy sessions are
+ * run.
+ */
+struct worker {
+    /** Worker event loop */
+    struct event_loop *loop;
+    /** Worker thread */
+    pthread_t thread;
+
+    /**
+     * Number of connections handed off to the worker which it has not
+     * started yet.
+     */
+    atomic_size_t handoffs;
+
+    /**
+     * Listening sockets owned by this worker, one per proxy server.
+     * Only used when accepting connections with SO_REUSEPORT.
+     */
+    struct listener *listeners;
+    /** Number of listening sockets */
+    size_t n_listeners;
+
+    /**
+     * Pools of connections to the remote servers, indexed by proxy
+     * server. NULL if connection pooling is disabled.
+     */
+    struct upstream_pool **pools;
+};
+
+/**
+ * Worker threads
+ */
+static struct {
+    /** Array of workers */
+    struct worker *workers;
+
+    /** Array of proxy servers, used to index the worker pools */
+    const struct proxy_server *servers;
+    /** Number of proxy servers */
+    size_t n_servers;
+
+    /** Number of workers */
+    size_t n;
+    /** Index of the worker to assign the next connection to */
+    size_t next;
+} workers;
+
 /**
  * Parse a line from the server configuration file.
  *
@@ -53,6 +176,31 @@ struct proxy_client {
  */
 static bool parse_line(struct proxy_server *server, const char *line);
 
+/**
+ * Parse a global option line from the configuration file.
+ *
+ * @param line Line to parse.
+ *
+ * @param error Pointer to variable which is set to true if the line
+ *   sets an option but its value could not be parsed.
+ *
+ * @return True if the line sets a global option, false if it is not
+ *   an option line.
+ */
+static bool parse_option(const char *line, bool *error);
+
+/**
+ * Parse a non-negative integer option value.
+ *
+ * @param line String to parse.
+ * @param value Pointer to variable which is set to the parsed value.
+ * @param zero True if 0 is a valid value, false if the value must be
+ *   positive.
+ *
+ * @return True if the value was parsed successfully.
+ */
+static bool parse_option_value(const char *line, size_t *value, bool zero);
+
 /**
  * Parse server type - IMAP or SMTP.
  *
@@ -97,23 +245,138 @@ static char * parse_host(const char *line);
 static const char *skip_ws(const char *line);
 
 /**
- * Handle incoming connections to the server sockets.
+ * Parse a boolean option value, `yes` or `no`.
  *
- * @param set FD set of sockets which have an incoming connection.
+ * @param line String to parse.
+ * @param value Pointer to variable which is set to the parsed value.
  *
- * @param servers Array of proxy servers.
+ * @return True if the value was parsed successfully.
+ */
+static bool parse_option_bool(const char *line, bool *value);
+
+/**
+ * Create a socket listening on a given port.
+ *
+ * @param port Local port.
+ *
+ * @return The socket file descriptor, -1 on error.
+ */
+static int open_listen_sock(int port);
+
+/**
+ * Event loop callback for a listening socket. Accepts all pending
+ * connections.
+ *
+ * If the listening socket is owned by a worker, the connections are
+ * run on the worker's own event loop. Otherwise each connection is
+ * handed to a worker event loop.
  *
- * @param n Number of proxy servers.
+ * @param loop   Event loop of the listening socket.
+ * @param events Epoll events.
+ * @param data   Pointer to the listener struct.
  */
-static void handle_accept(const fd_set *set, struct proxy_server *servers, size_t n);
+static void handle_accept(struct event_loop *loop, uint32_t events, void *data);
 
 /**
- * Thread start routine for handling a client connection.
+ * Choose the worker to which to assign the next client connection.
+ *
+ * Workers are chosen round-robin, skipping workers which have
+ * reached the queue limit.
  *
+ * @return The worker, NULL if all workers have reached the queue
+ *   limit.
+ */
+static struct worker *next_worker(void);
+
+/**
+ * Event loop task which starts proxying a client connection, run by
+ * the worker event loop to which the client was assigned.
+ *
+ * @param loop   Worker event loop.
  * @param client Pointer to a proxy_client struct.
+ */
+static void handle_client(struct event_loop *loop, void *client);
+
+/**
+ * Start proxying a client connection on a worker's event loop.
+ *
+ * If the worker has a ready connection to the remote server in its
+ * pool, it is used for the session.
+ *
+ * @param worker Worker.
+ * @param fd     Client socket file descriptor.
+ * @param server Proxy server which accepted the connection.
+ */
+static void start_client(struct worker *worker, int fd, const struct proxy_server *server);
+
+/**
+ * Thread start routine of a worker thread, which runs a worker event
+ * loop.
+ *
+ * @param worker Pointer to the worker struct.
  * @return NULL
  */
-static void * handle_client(void *client);
+static void * run_worker(void *worker);
+
+/**
+ * Create the worker event loops and start their threads.
+ *
+ * When SO_REUSEPORT is enabled, each worker is given its own
+ * listening socket for every proxy server, and is pinned to a CPU.
+ *
+ * @param servers Array of proxy servers.
+ * @param n       Number of proxy servers.
+ *
+ * @return True if at least one worker was started.
+ */
+static bool start_workers(struct proxy_server *servers, size_t n);
+
+/**
+ * Open a worker's listening sockets and add them to its event loop.
+ *
+ * The first worker reuses the sockets opened by parse_servers(),
+ * the remaining workers open new sockets bound to the same ports.
+ *
+ * @param worker  Worker.
+ * @param index   Index of the worker.
+ * @param servers Array of proxy servers.
+ * @param n       Number of proxy servers.
+ */
+static void add_worker_listeners(struct worker *worker, size_t index, struct proxy_server *servers, size_t n);
+
+/**
+ * Pin the calling thread to a CPU.
+ *
+ * @param index Index of the CPU within the set of CPUs on which the
+ *   process is allowed to run. Wraps around if larger than the
+ *   number of CPUs.
+ */
+static void pin_thread(size_t index);
+
+/**
+ * Create a worker's connection pools, one per proxy server.
+ *
+ * @param worker  Worker.
+ * @param servers Array of proxy servers.
+ * @param n       Number of proxy servers.
+ */
+static void create_worker_pools(struct worker *worker, struct proxy_server *servers, size_t n);
+
+/**
+ * Free a worker's connection pools.
+ *
+ * @param worker Worker.
+ */
+static void free_worker_pools(struct worker *worker);
+
+/**
+ * Stop the worker threads and free their event loops.
+ *
+ * The handshake threads are stopped once the workers have stopped,
+ * before freeing the connection pools, since they may be performing
+ * the handshakes of pooled connections.
+ */
+static void stop_workers(void);
 
 
 /* Parsing Configuration Files */
@@ -135,6 +398,15 @@ struct proxy_server *parse_servers(const char *path, size_t *n) {
     while (fgets(line, sizeof(line), f)) {
         line_i++;
 
+        bool error = false;
+
+        if (parse_option(line, &error)) {
+            if (error)
+                syslog(LOG_ERR, "Error parsing line %lu of configuration file '%s'", line_i, path);
+
+            continue;
+        }
+
         if (num >= size) {
             size *= 2;
             servers = xrealloc(servers, size * sizeof(struct proxy_server));
@@ -145,13 +417,50 @@ struct proxy_server *parse_servers(const char *path, size_t *n) {
             continue;
         }
 
-        if (open_server_sock(servers + num, servers[num].port)) {
-            num++;
-        }
+        num++;
     }
 
     fclose(f);
 
+    // The sockets are only opened once all options have been parsed,
+    // since they depend on the REUSEPORT option.
+
+    size_t parsed = num;
+    num = 0;
+
+    for (size_t i = 0; i < parsed; ++i) {
+        struct proxy_server *server = servers + num;
+
+        if (i != num)
+            *server = servers[i];
+
+        if (!open_server_sock(server, server->port)) {
+            free(server->host);
+            continue;
+        }
+
+        server->upstream = upstream_create(server->host);
+
+        if (!server->upstream) {
+            syslog(LOG_ERR, "Error creating TLS context for server %s", server->host);
+
+            close(server->sock_fd);
+            free(server->host);
+            continue;
+        }
+
+        // Resolve the host before the first client connects
+        upstream_resolve(server->upstream);
+
+        num++;
+    }
+
+    if (proxy_options.session_dir) {
+        for (size_t i = 0; i < num; ++i) {
+            upstream_set_session_dir(servers[i].upstream, proxy_options.session_dir);
+        }
+    }
+
     if (num) {
         servers = xrealloc(servers, num * sizeof(struct proxy_server));
     }
@@ -177,6 +486,85 @@ bool parse_line(struct proxy_server *server, const char *line) {
     return server->host != NULL;
 }
 
+bool parse_option(const char *line, bool *error) {
+    size_t *value;
+
+    // 0 selects the default, or disables the option, except for
+    // these options
+    bool zero = true;
+
+    if (strncasecmp(line, STR_WORKERS, STR_WORKERS_LEN) == 0) {
+        line += STR_WORKERS_LEN;
+        value = &proxy_options.workers;
+    }
+    else if (strncasecmp(line, STR_QUEUE_LIMIT, STR_QUEUE_LIMIT_LEN) == 0) {
+        line += STR_QUEUE_LIMIT_LEN;
+        value = &proxy_options.queue_limit;
+        zero = false;
+    }
+    else if (strncasecmp(line, STR_REUSEPORT, STR_REUSEPORT_LEN) == 0) {
+        *error = !parse_option_bool(line + STR_REUSEPORT_LEN, &proxy_options.reuseport);
+        return true;
+    }
+    else if (strncasecmp(line, STR_SESSION_DIR, STR_SESSION_DIR_LEN) == 0) {
+        free(proxy_options.session_dir);
+        proxy_options.session_dir = parse_host(line + STR_SESSION_DIR_LEN);
+
+        *error = proxy_options.session_dir == NULL;
+        return true;
+    }
+    else if (strncasecmp(line, STR_POOL_SIZE, STR_POOL_SIZE_LEN) == 0) {
+        line += STR_POOL_SIZE_LEN;
+        value = &proxy_options.pool_size;
+    }
+    else if (strncasecmp(line, STR_HANDSHAKE_THREADS, STR_HANDSHAKE_THREADS_LEN) == 0) {
+        line += STR_HANDSHAKE_THREADS_LEN;
+        value = &proxy_options.handshake_threads;
+    }
+    else if (strncasecmp(line, STR_TOKEN_REFRESH, STR_TOKEN_REFRESH_LEN) == 0) {
+        line += STR_TOKEN_REFRESH_LEN;
+        value = &proxy_options.token_refresh;
+        zero = false;
+    }
+    else {
+        return false;
+    }
+
+    *error = !parse_option_value(line, value, zero);
+    return true;
+}
+
+bool parse_option_value(const char *line, size_t *value, bool zero) {
+    char *end;
+
+    line = skip_ws(line);
+    unsigned long n = strtoul(line, &end, 10);
+
+    if (end == line || *skip_ws(end) || (!n && !zero)) {
+        syslog(LOG_ERR, "Error parsing option value at: %s", line);
+        return false;
+    }
+
+    *value = n;
+    return true;
+}
+
+bool parse_option_bool(const char *line, bool *value) {
+    line = skip_ws(line);
+
+    if (strncasecmp(line, "yes", 3) == 0 && !*skip_ws(line + 3)) {
+        *value = true;
+        return true;
+    }
+    else if (strncasecmp(line, "no", 2) == 0 && !*skip_ws(line + 2)) {
+        *value = false;
+        return true;
+    }
+
+    syslog(LOG_ERR, "Error parsing option value at: %s", line);
+    return false;
+}
+
 const char * parse_type(const char *line, server_type *type) {
     if (strncasecmp(line, STR_IMAP, STR_IMAP_LEN) == 0) {
         *type = TYPE_IMAP;
@@ -241,120 +629,382 @@ const char *skip_ws(const char *line) {
 /* Running Servers */
 
 bool open_server_sock(struct proxy_server *server, int port) {
+    server->sock_fd = open_listen_sock(port);
+    return server->sock_fd >= 0;
+}
+
+int open_listen_sock(int port) {
     struct sockaddr_in s_addr;
-    server->sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
-    if (server->sock_fd < 0) {
+    if (fd < 0) {
         syslog(LOG_ERR, "Error opening socket: %m");
         goto error;
     }
 
+    // Allow each worker to bind its own socket to the port. Not fatal
+    // since a single socket can still be shared by all workers. Only
+    // set when enabled, since any process of the same user could
+    // otherwise bind the port and take a share of the connections.
+    int on = 1;
+    if (proxy_options.reuseport &&
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+        syslog(LOG_WARNING, "Could not set SO_REUSEPORT on socket for port %d: %m", port);
+    }
+
     s_addr.sin_family = AF_INET;
     s_addr.sin_addr.s_addr = INADDR_ANY;
     s_addr.sin_port = htons(port);
 
-    if (bind(server->sock_fd, (struct sockaddr *)&s_addr, sizeof(s_addr))) {
+    if (bind(fd, (struct sockaddr *)&s_addr, sizeof(s_addr))) {
         syslog(LOG_ERR, "Error binding to port %d: %m", port);
         goto error;
     }
 
-    if (listen(server->sock_fd, SOMAXCONN)) {
+    if (listen(fd, SOMAXCONN)) {
         syslog(LOG_ERR, "Error listening for incoming connections on port %d: %m", port);
         goto error;
     }
 
-    return true;
+    return fd;
 
 error:
-    close(server->sock_fd);
-    return false;
+    close(fd);
+    return -1;
 }
 
 void run_servers(struct proxy_server *servers, size_t n) {
-    int maxfd = -1;
+    struct event_loop *loop = event_loop_create();
+    if (!loop) return;
+
+    // Handshakes are performed by the workers if the threads could
+    // not be started
+    if (proxy_options.handshake_threads &&
+        !handshake_threads_start(proxy_options.handshake_threads)) {
+        syslog(LOG_WARNING, "Could not start handshake threads");
+    }
+
+    // The GOA client is created before accepting connections, rather
+    // than by the first login
+    GError *error = NULL;
 
-    // Determine largest numbered file server socket file descriptor
-    for (int i = 0; i < n; ++i) {
-        if (servers[i].sock_fd > maxfd)
-            maxfd = servers[i].sock_fd;
+    if (!gaccounts_start(&error)) {
+        syslog(LOG_CRIT, "Could not create GoaClient: %s", error ? error->message : "GOA thread not running");
+        g_clear_error(&error);
+    }
+    else if (!tokens_start(proxy_options.token_refresh)) {
+        syslog(LOG_WARNING, "Could not start refreshing access tokens");
     }
 
-    maxfd += 1;
+    if (!start_workers(servers, n))
+        goto stop_handshakes;
 
-    while (1) {
-        fd_set rfds;
+    if (proxy_options.reuseport) {
+        // Connections are accepted by the workers, wait until stopped
+        event_loop_run(loop, false);
+    }
+    else {
+        struct listener *listeners = xmalloc(n * sizeof(struct listener));
+        size_t n_watched = 0;
 
-        FD_ZERO(&rfds);
+        for (size_t i = 0; i < n; ++i) {
+            listeners[i].fd = servers[i].sock_fd;
+            listeners[i].server = &servers[i];
+            listeners[i].worker = NULL;
 
-        for (int i = 0; i < n; ++i) {
-            FD_SET(servers[i].sock_fd, &rfds);
+            if (event_loop_add(loop, &listeners[i].watch, listeners[i].fd, EPOLLIN | EPOLLET, handle_accept, &listeners[i]))
+                n_watched++;
         }
 
-        int retval = select(maxfd+1, &rfds, NULL, NULL, NULL);
-
-        if (retval < 0) {
-            syslog(LOG_ERR, "Server socket select() error: %m");
-            break;
+        if (n_watched) {
+            event_loop_run(loop, false);
         }
 
-        handle_accept(&rfds, servers, n);
+        free(listeners);
     }
+
+    stop_workers();
+
+stop_handshakes:
+    handshake_threads_stop();
+    event_loop_free(loop);
 }
 
-void handle_accept(const fd_set *rfds, struct proxy_server *servers, size_t n) {
-    for (int i = 0; i < n; ++i) {
-        if (FD_ISSET(servers[i].sock_fd, rfds)) {
-            int clientfd = accept(servers[i].sock_fd, NULL, NULL);
+void handle_accept(struct event_loop *loop, uint32_t events, void *data) {
+    struct listener *listener = data;
 
-            if (clientfd < 0) {
-                syslog(LOG_ERR, "Error accepting client connection: %m");
-                continue;
-            }
+    // Edge-triggered: accept until no connections remain
+    while (1) {
+        int clientfd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
 
-            struct proxy_client *client = malloc(sizeof(struct proxy_client));
-            if (!client) {
-                syslog(LOG_CRIT, "Memory allocation failed");
-                close(clientfd);
+        if (clientfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
                 continue;
-            }
 
-            client->fd = clientfd;
-            client->server = &servers[i];
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                syslog(LOG_ERR, "Error accepting client connection: %m");
 
-            pthread_t thread;
+            break;
+        }
 
-            if (pthread_create(&thread, NULL, handle_client, client)) {
-                syslog(LOG_ERR, "Error creating new client thread: %m");
+        if (listener->worker) {
+            start_client(listener->worker, clientfd, listener->server);
+            continue;
+        }
 
-                close(clientfd);
-                free(client);
-            }
+        struct proxy_client *client = malloc(sizeof(struct proxy_client));
+        if (!client) {
+            syslog(LOG_CRIT, "Memory allocation failed");
+            close(clientfd);
+            continue;
+        }
+
+        client->fd = clientfd;
+        client->server = listener->server;
+        client->worker = next_worker();
+
+        if (!client->worker) {
+            syslog(LOG_WARNING, "All workers busy, refusing client connection");
+
+            close(clientfd);
+            free(client);
+            continue;
+        }
+
+        atomic_fetch_add(&client->worker->handoffs, 1);
+
+        if (!event_loop_post(client->worker->loop, handle_client, client)) {
+            atomic_fetch_sub(&client->worker->handoffs, 1);
+
+            close(clientfd);
+            free(client);
         }
     }
 }
 
-void * handle_client(void *obj) {
+struct worker *next_worker(void) {
+    for (size_t i = 0; i < workers.n; ++i) {
+        struct worker *worker = &workers.workers[workers.next];
+        workers.next = (workers.next + 1) % workers.n;
+
+        if (atomic_load(&worker->handoffs) < proxy_options.queue_limit)
+            return worker;
+    }
+
+    return NULL;
+}
+
+void handle_client(struct event_loop *loop, void *obj) {
     struct proxy_client *client = obj;
-    GError *error = NULL;
 
-    if (!get_goaclient(&error)) {
-        syslog(LOG_CRIT, "Could not create GoaClient: %s", error->message);
+    atomic_fetch_sub(&client->worker->handoffs, 1);
 
-        close(client->fd);
-        goto end;
+    start_client(client->worker, client->fd, client->server);
+    free(client);
+}
+
+void start_client(struct worker *worker, int fd, const struct proxy_server *server) {
+    BIO *bio = NULL;
+
+    if (worker->pools) {
+        struct upstream_pool *pool = worker->pools[server - workers.servers];
+
+        if (pool)
+            bio = upstream_pool_take(pool);
     }
 
-    switch (client->server->type) {
+    switch (server->type) {
     case TYPE_SMTP:
-        smtp_handle_client(client->fd, client->server->host);
+        smtp_start_client(worker->loop, fd, server->upstream, bio);
         break;
 
     case TYPE_IMAP:
-        imap_handle_client(client->fd, client->server->host);
+        imap_start_client(worker->loop, fd, server->upstream, bio);
         break;
     }
+}
+
+
+/* Worker Threads */
+
+bool start_workers(struct proxy_server *servers, size_t n) {
+    long n_workers = proxy_options.workers;
+
+    if (!n_workers) {
+        n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (n_workers < 1) n_workers = 1;
+    }
 
-end:
-    free(client);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+
+    if (pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE)) {
+        syslog(LOG_WARNING, "Could not set worker thread stack size");
+    }
+
+    workers.workers = xmalloc(n_workers * sizeof(struct worker));
+    workers.servers = servers;
+    workers.n_servers = n;
+    workers.n = 0;
+    workers.next = 0;
+
+    for (long i = 0; i < n_workers; ++i) {
+        struct worker *worker = &workers.workers[workers.n];
+
+        worker->loop = event_loop_create();
+        if (!worker->loop) break;
+
+        atomic_init(&worker->handoffs, 0);
+
+        worker->listeners = NULL;
+        worker->n_listeners = 0;
+        worker->pools = NULL;
+
+        if (proxy_options.reuseport) {
+            add_worker_listeners(worker, workers.n, servers, n);
+        }
+
+        if (proxy_options.pool_size) {
+            create_worker_pools(worker, servers, n);
+        }
+
+        if (pthread_create(&worker->thread, &attr, run_worker, worker)) {
+            syslog(LOG_ERR, "Error creating worker thread: %m");
+
+            for (size_t j = 0; workers.n && j < worker->n_listeners; ++j) {
+                close(worker->listeners[j].fd);
+            }
+
+            free_worker_pools(worker);
+            event_loop_free(worker->loop);
+            free(worker->listeners);
+            break;
+        }
+
+        workers.n++;
+    }
+
+    pthread_attr_destroy(&attr);
+
+    if (!workers.n) {
+        stop_workers();
+        return false;
+    }
+
+    return true;
+}
+
+void add_worker_listeners(struct worker *worker, size_t index, struct proxy_server *servers, size_t n) {
+    worker->listeners = xmalloc(n * sizeof(struct listener));
+
+    for (size_t i = 0; i < n; ++i) {
+        struct listener *listener = &worker->listeners[worker->n_listeners];
+
+        listener->fd = index ? open_listen_sock(servers[i].port) : servers[i].sock_fd;
+        listener->server = &servers[i];
+        listener->worker = worker;
+
+        if (listener->fd < 0)
+            continue;
+
+        if (!event_loop_add(worker->loop, &listener->watch, listener->fd, EPOLLIN | EPOLLET, handle_accept, listener)) {
+            if (index) close(listener->fd);
+            continue;
+        }
+
+        worker->n_listeners++;
+    }
+}
+
+void create_worker_pools(struct worker *worker, struct proxy_server *servers, size_t n) {
+    worker->pools = xmalloc(n * sizeof(struct upstream_pool *));
+
+    for (size_t i = 0; i < n; ++i) {
+        worker->pools[i] = upstream_pool_create(worker->loop, servers[i].upstream, proxy_options.pool_size);
+
+        if (!worker->pools[i]) {
+            syslog(LOG_WARNING, "Could not create connection pool for server %s", servers[i].host);
+        }
+    }
+}
+
+void free_worker_pools(struct worker *worker) {
+    if (!worker->pools) return;
+
+    for (size_t i = 0; i < workers.n_servers; ++i) {
+        if (worker->pools[i])
+            upstream_pool_free(worker->pools[i]);
+    }
+
+    free(worker->pools);
+    worker->pools = NULL;
+}
+
+void pin_thread(size_t index) {
+    cpu_set_t allowed;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        syslog(LOG_WARNING, "Could not get CPU affinity: %m");
+        return;
+    }
+
+    size_t n_cpus = CPU_COUNT(&allowed);
+    if (!n_cpus) return;
+
+    index %= n_cpus;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed) && !index--) {
+            cpu_set_t set;
+
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+
+            int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            if (err) {
+                syslog(LOG_WARNING, "Could not pin worker thread to CPU %d: %s", cpu, strerror(err));
+            }
+
+            return;
+        }
+    }
+}
+
+void stop_workers(void) {
+    for (size_t i = 0; i < workers.n; ++i) {
+        event_loop_stop(workers.workers[i].loop);
+        pthread_join(workers.workers[i].thread, NULL);
+    }
+
+    handshake_threads_stop();
+
+    for (size_t i = 0; i < workers.n; ++i) {
+        struct worker *worker = &workers.workers[i];
+
+        // Close the sockets opened for this worker, the first
+        // worker's sockets are owned by the proxy_server structs.
+        for (size_t j = 0; i && j < worker->n_listeners; ++j) {
+            close(worker->listeners[j].fd);
+        }
+
+        free(worker->listeners);
+        free_worker_pools(worker);
+        event_loop_free(worker->loop);
+    }
+
+    free(workers.workers);
+
+    workers.workers = NULL;
+    workers.n = 0;
+}
+
+void * run_worker(void *obj) {
+    struct worker *worker = obj;
+
+    if (proxy_options.reuseport) {
+        pin_thread(worker - workers.workers);
+    }
+
+    event_loop_run(worker->loop, false);
     return NULL;
 }
@@ -5,6 +5,8 @@
 
 #include <stdbool.h>
 
+#include "upstream.h"
+
 /**
  * Type of proxy server IMAP or SMTP.
  */
@@ -28,11 +30,76 @@ struct proxy_server {
 
     /** Remote server host */
     char *host;
+
+    /** Remote server, shared by all sessions to the server */
+    struct upstream *upstream;
 };
 
+/**
+ * Global proxy settings
+ */
+struct proxy_options {
+    /**
+     * Number of worker threads handling client connections. If 0, one
+     * worker is started per online CPU.
+     */
+    size_t workers;
+
+    /**
+     * Maximum number of accepted connections waiting to be started by
+     * a worker. Further connections are refused until the worker
+     * catches up.
+     */
+    size_t queue_limit;
+
+    /**
+     * If true, each worker accepts connections on its own listening
+     * socket, bound with SO_REUSEPORT, and is pinned to a CPU.
+     */
+    bool reuseport;
+
+    /**
+     * Directory in which resumable TLS sessions are persisted across
+     * restarts. NULL if sessions are only cached in memory.
+     */
+    char *session_dir;
+
+    /**
+     * Maximum number of established connections to each remote
+     * server kept ready by each worker, for new clients. The number
+     * kept follows the rate at which clients connect. If 0,
+     * connections are only made when a client connects.
+     */
+    size_t pool_size;
+
+    /**
+     * Number of threads on which TLS handshakes with the remote
+     * servers are performed. If 0, handshakes are performed by the
+     * workers, alongside the sessions.
+     */
+    size_t handshake_threads;
+
+    /**
+     * Number of seconds before an OAuth2 access token expires at
+     * which a new token is requested in the background.
+     */
+    size_t token_refresh;
+};
+
+/**
+ * Proxy settings, parsed from the configuration file by
+ * parse_servers().
+ */
+extern struct proxy_options proxy_options;
+
 /**
  * Parse the server configurations from a text file.
  *
+ * Lines setting a global option, such as `WORKERS 4`, are stored in
+ * proxy_options. The listening sockets of the servers are opened once
+ * the entire file has been parsed, using the options set anywhere in
+ * the file.
+ *
  * @param path Path to text file
  *
  * @param n Pointer to variable which is set to the number of servers
@@ -57,6 +124,11 @@ bool open_server_sock(struct proxy_server *server, int port);
 /**
  * Run the proxy server loop.
  *
+ * Accepted connections are handled by a fixed set of worker threads,
+ * each running its own event loop. Unless proxy_options.reuseport is
+ * set, the server sockets are watched by an event loop on the calling
+ * thread, which hands accepted connections to the workers.
+ *
  * @param servers Array of servers to run
  * @param n       Number of servers
  */
@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <syslog.h>
+#include <errno.h>
 #include <assert.h>
 
 #include <sys/types.h>
@@ -17,28 +18,72 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+#include "xmalloc.h"
 #include "gaccounts.h"
 #include "ssl.h"
+#include "relay.h"
 #include "b64.h"
-#include "xoauth2.h"
+#include "tokens.h"
 
 #include "smtp_reply.h"
 #include "smtp_cmd.h"
 
-#define RECV_BUF_SIZE 512 * 4
+/**
+ * SMTP protocol state of a session, only used until the client has
+ * authenticated.
+ */
+struct smtp_session {
+    /**
+     * True if the credentials for an AUTH PLAIN command have been
+     * requested from the client.
+     */
+    bool auth_pending;
+
+    /** Client command stream */
+    struct smtp_cmd_stream *c_stream;
+    /** Server reply stream */
+    struct smtp_reply_stream *s_stream;
+
+    /**
+     * Client response request of the AUTH command being handled, NULL
+     * if there is none. No further commands are read until it
+     * completes.
+     */
+    struct token_request *auth;
+    /** Username of the AUTH command */
+    char *user;
+};
+
+/**
+ * Create the SMTP command and reply streams, after the connection to
+ * the server has been established.
+ *
+ * @param relay Relay session
+ *
+ * @return True if successful.
+ */
+static bool smtp_start(struct relay *relay);
+
+/**
+ * Free the SMTP protocol state of a session.
+ *
+ * @param data SMTP session
+ */
+static void smtp_session_free(void *data);
+
 
 /* Handling SMTP Client Command */
 
 /**
- * Read and handle/forward an SMTP command from the client.
+ * Read and handle/forward the SMTP commands received from the client.
  *
- * @param stream SMTP command stream
- * @param s_bio Server BIO object
+ * @param relay    Relay session
+ * @param progress Set to true if any data was received
  *
- * @return true if the command was handled successfully, false
+ * @return true if the commands were handled successfully, false
  *   otherwsie.
  */
-static bool smtp_client_handle_cmd(struct smtp_cmd_stream *stream, BIO *s_bio);
+static bool smtp_client_handle_cmd(struct relay *relay, bool *progress);
 
 
 /* Authentication */
@@ -49,28 +94,24 @@ static bool smtp_client_handle_cmd(struct smtp_cmd_stream *stream, BIO *s_bio);
  * Authenticate the user, corresponding to a GOA account, using
  * XOAuth2.
  *
- * @param stream Client command stream
- * @param s_bio  Server OpenSSL Bio Object
- * @param cmd    SMTP command
+ * @param relay   Relay session
+ * @param cmd     SMTP command
  *
  * @return Returns true if the command was processed
  *   successfully. This does not mean the user was authenticated, only
- *   that all read/write commands succeeded and that the proxy loop
- *   should continue.
+ *   that the session should continue.
  */
-static bool smtp_handle_auth(struct smtp_cmd_stream *stream, BIO *s_bio, const struct smtp_cmd *cmd);
+static bool smtp_handle_auth(struct relay *relay, const struct smtp_cmd *cmd);
 
 /**
  * Request credentials for AUTH PLAIN from client.
  *
- * @param stream SMTP command stream.
- * @param cmd SMTP command.
+ * The next line received from the client is handled as the
+ * credentials.
  *
- * @return True if the credentials were received successfully. False
- *   if there was an error sending the request for credentials or
- *   receiving the reply.
+ * @param relay   Relay session
  */
-static bool smtp_get_credentials(struct smtp_cmd_stream *stream, struct smtp_cmd *cmd);
+static void smtp_get_credentials(struct relay *relay);
 
 /**
  * Parse the username from an SMTP plain auth command.
@@ -83,210 +124,219 @@ static bool smtp_get_credentials(struct smtp_cmd_stream *stream, struct smtp_cmd
 static char * smtp_parse_auth_user(const char *data, size_t n);
 
 /**
- * Authenticate the client by sending the AUTH (using XOAUTH2) command
- * to the server.
+ * Authenticate the client by requesting the XOAUTH2 client response
+ * of the user. The AUTH (using XOAUTH2) command is sent to the server
+ * once the request completes.
  *
- * @param c_fd Client socket file descriptor
- * @param s_bio Server BIO object
- * @param account Gnome online account
- * @param user Username
+ * @param relay Relay session
+ * @param user  Username, owned by the session until the request
+ *   completes.
+ */
+static void smtp_auth_client(struct relay *relay, char *user);
+
+/**
+ * Send the AUTH (using XOAUTH2) command to the server, once the
+ * client response has been obtained. Reports the error to the client
+ * if the response could not be obtained.
  *
- * @return True if the authentication commands were sent successfully,
- *   false otherwise.
+ * @param resp Client response, NULL on error
+ * @param gerr GOA account error, if @a resp is NULL
+ * @param data Relay session
  */
-static bool smtp_auth_client(int fd, BIO *bio, GList *account, const char *user);
+static void smtp_auth_ready(const char *resp, goa_error gerr, void *data);
 
 /**
  * Report gnome online account error to SMTP client.
  *
- * @param fd client socket descriptor
+ * @param relay   Relay session
  * @param gerr GOA account error
- *
- * @return True if the error was reported successfully, false
- *   otherwise.
  */
-static bool smtp_auth_error(int fd, goa_error gerr);
+static void smtp_auth_error(struct relay *relay, goa_error gerr);
 
 
-/* Sending Data */
+/* Handling SMTP Server Response */
 
 /**
- * Send data to the server.
+ * Read and handle the SMTP responses received from the server.
  *
- * @param bio Server BIO object
- * @param data Block of data to send
- * @param n Size of data in bytes
+ * @param relay    Relay session
+ * @param progress Set to true if any data was received
  *
- * @return True if the data was sent successfully, false otherwise.
+ * @return Always true, an error reading a reply ends the server's
+ *   stream.
  */
-static bool smtp_server_send(BIO *bio, const char *data, size_t n);
+static bool smtp_server_handle_reply(struct relay *relay, bool *progress);
 
 /**
- * Send data to the client.
+ * Switch the session to forwarding data without parsing it, after
+ * the server has accepted the authentication.
  *
- * @param fd Client socket file descriptor
- * @param data block of data to send
- * @param n Size of data in bytes
+ * No further AUTH commands are accepted once authenticated, and the
+ * data of the DATA command is forwarded as is, thus neither side has
+ * to be parsed anymore.
  *
- * @return True if the data was sent successfully, false otherwise.
+ * @param relay Relay session
  */
-static bool smtp_client_send(int fd, const char *data, size_t n);
+static void smtp_begin_relay(struct relay *relay);
 
 
-/* Handling SMTP Server Response */
+/* Implementation */
 
 /**
- * Read and handle the SMTP response from the server.
- *
- * @param c_fd Client socket file descriptor
- * @param stream SMTP reply stream
- *
- * @return True if successful, False otherwise.
+ * SMTP protocol filter
  */
-static bool smtp_server_handle_reply(int c_fd, struct smtp_reply_stream *s_stream, struct smtp_cmd_stream *c_stream);
-
-
-/* Implementation */
+static const struct relay_filter smtp_filter = {
+    .name = "SMTP",
+    .start = smtp_start,
+    .client_data = smtp_client_handle_cmd,
+    .server_data = smtp_server_handle_reply,
+    .free = smtp_session_free
+};
 
 void smtp_handle_client(int c_fd, const char *host) {
-    BIO *bio = server_connect(host);
+    struct upstream *upstream = upstream_create(host);
 
-    if (!bio) {
+    if (!upstream) {
         close(c_fd);
         return;
     }
 
-    int s_fd = BIO_get_fd(bio, NULL);
-    int maxfd = c_fd < s_fd ? s_fd : c_fd;
+    struct event_loop *loop = event_loop_create();
 
-    struct smtp_cmd_stream * c_stream = smtp_cmd_stream_create(c_fd);
-
-    if (!c_stream) {
-        BIO_free_all(bio);
+    if (!loop) {
         close(c_fd);
-        return;
+        goto unref_upstream;
     }
 
-    struct smtp_reply_stream * s_stream = smtp_reply_stream_create(bio);
-
-    if (!s_stream) {
-        BIO_free_all(bio);
-        goto close_cmd_stream;
+    if (smtp_start_client(loop, c_fd, upstream, NULL)) {
+        event_loop_run(loop, true);
     }
 
-    while (1) {
-        fd_set rfds;
+    event_loop_free(loop);
 
-        FD_ZERO(&rfds);
-        FD_SET(c_fd, &rfds);
-        FD_SET(s_fd, &rfds);
+unref_upstream:
+    upstream_unref(upstream);
+}
 
-        int retval = select(maxfd+1, &rfds, NULL, NULL, NULL);
+bool smtp_start_client(struct event_loop *loop, int c_fd, struct upstream *upstream, BIO *bio) {
+    struct smtp_session *session = xmalloc(sizeof(struct smtp_session));
 
-        if (retval < 0) {
-            syslog(LOG_ERR, "SMTP: select() error: %m");
-            break;
-        }
+    session->auth_pending = false;
+    session->c_stream = NULL;
+    session->s_stream = NULL;
 
-        if (FD_ISSET(s_fd, &rfds)) {
-            if (!smtp_server_handle_reply(c_fd, s_stream, c_stream))
-                break;
-        }
-        if (FD_ISSET(c_fd, &rfds)) {
-            if (!smtp_client_handle_cmd(c_stream, bio))
-                break;
-        }
-    }
+    session->auth = NULL;
+    session->user = NULL;
+
+    return relay_start(loop, c_fd, upstream, bio, &smtp_filter, session);
+}
+
+bool smtp_start(struct relay *relay) {
+    struct smtp_session *session = relay->data;
 
-    smtp_reply_stream_free(s_stream);
+    session->c_stream = smtp_cmd_stream_create(relay->c_fd, false);
+    if (!session->c_stream)
+        return false;
 
-close_cmd_stream:
-    smtp_cmd_stream_free(c_stream);
+    session->s_stream = smtp_reply_stream_create(relay->s_bio);
+    return true;
+}
+
+void smtp_session_free(void *data) {
+    struct smtp_session *session = data;
+
+    if (session->c_stream) smtp_cmd_stream_free(session->c_stream);
+    if (session->s_stream) smtp_reply_stream_free(session->s_stream);
+
+    if (session->auth) token_request_cancel(session->auth);
+
+    free(session->user);
+    free(session);
 }
 
 
 /* Handling SMTP Client Commands */
 
-bool smtp_client_handle_cmd(struct smtp_cmd_stream *stream, BIO *s_bio) {
+bool smtp_client_handle_cmd(struct relay *relay, bool *progress) {
+    struct smtp_session *session = relay->data;
     struct smtp_cmd cmd;
 
-    do {
-        ssize_t c_n = smtp_cmd_next(stream, &cmd);
+    while (relay->filtering && !session->auth &&
+           buffer_len(&relay->s_out) < RELAY_BUF_MAX) {
+
+        ssize_t c_n = smtp_cmd_next(session->c_stream, &cmd);
 
         if (c_n < 0) {
+            if (errno == EAGAIN) {
+                relay->c_readable = false;
+                return true;
+            }
+
             syslog(LOG_ERR, "SMTP: Error reading data from client: %m");
-            return false;
+            relay->c_eof = true;
+            return true;
         }
-        else if (c_n == 0) {
+
+        *progress = true;
+
+        if (c_n == 0) {
             syslog(LOG_NOTICE, "SMTP: Client closed connection");
-            return false;
+            relay->c_eof = true;
+            return true;
+        }
+
+        if (session->auth_pending) {
+            session->auth_pending = false;
+
+            if (!smtp_handle_auth(relay, &cmd))
+                return false;
+
+            continue;
         }
 
         switch (cmd.command) {
         case SMTP_CMD_AUTH:
-            if (cmd.data_len == 0 && !smtp_get_credentials(stream, &cmd)) {
-                return false;
+            if (cmd.data_len == 0) {
+                smtp_get_credentials(relay);
             }
-
-            if (!smtp_handle_auth(stream, s_bio, &cmd))
+            else if (!smtp_handle_auth(relay, &cmd)) {
                 return false;
+            }
 
             break;
 
         default:
-            if (!smtp_server_send(s_bio, cmd.line, cmd.total_len))
-                return false;
+            relay_server_send(relay, cmd.line, cmd.total_len);
             break;
         }
-    } while (smtp_cmd_stream_pending(stream));
+    }
 
     return true;
 }
 
-
-
 /* Authentication */
 
-static bool smtp_get_credentials(struct smtp_cmd_stream *stream, struct smtp_cmd *cmd) {
+void smtp_get_credentials(struct relay *relay) {
     char resp[] = "334\r\n";
 
-    if (!smtp_client_send(smtp_cmd_stream_fd(stream), resp, strlen(resp))) {
-        return false;
-    }
+    struct smtp_session *session = relay->data;
 
-    ssize_t n = smtp_cmd_next(stream, cmd);
-    return n > 0;
+    relay_client_send(relay, resp, strlen(resp));
+    session->auth_pending = true;
 }
 
-bool smtp_handle_auth(struct smtp_cmd_stream *stream, BIO *s_bio, const struct smtp_cmd *cmd) {
-    bool succ = true;
+bool smtp_handle_auth(struct relay *relay, const struct smtp_cmd *cmd) {
     char *user = smtp_parse_auth_user(cmd->data, cmd->data_len);
 
     if (!user) {
         char err[] = "501 Syntax error in credentials\r\n";
-        succ = smtp_client_send(smtp_cmd_stream_fd(stream), err, strlen(err));
-
-        goto end;
-    }
-
-    GList *accounts = goa_client_get_accounts(get_goaclient(NULL));
-    GList *account = find_goaccount(accounts, user);
+        relay_client_send(relay, err, strlen(err));
 
-    if (account) {
-        succ = smtp_auth_client(smtp_cmd_stream_fd(stream), s_bio, account, user);
+        return true;
     }
-    else {
-        syslog(LOG_WARNING, "SMTP: Could not find GNOME Online Account for username %s", user);
-
-        char err[] = "535 Invalid username or password\r\n";
-        succ = smtp_client_send(smtp_cmd_stream_fd(stream), err, strlen(err));
-    }
-
-    g_list_free_full(accounts, (GDestroyNotify)g_object_unref);
 
-end:
-    free(user);
-    return succ;
+    smtp_auth_client(relay, user);
+    return true;
 }
 
 char * smtp_parse_auth_user(const char *data, size_t n) {
@@ -315,110 +365,102 @@ error:
     return NULL;
 }
 
-bool smtp_auth_client(int fd, BIO *bio, GList *account, const char *user) {
-    bool succ = true;
+void smtp_auth_client(struct relay *relay, char *user) {
+    struct smtp_session *session = relay->data;
 
-    // Get Access Token
+    session->user = user;
+    session->auth = token_request(relay->loop, user, smtp_auth_ready, relay);
+}
 
-    goa_error gerr;
-    gchar *token = get_access_token(account, &gerr);
+void smtp_auth_ready(const char *resp, goa_error gerr, void *data) {
+    struct relay *relay = data;
+    struct smtp_session *session = relay->data;
 
-    if (!token) {
-        return smtp_auth_error(fd, gerr);
-    }
+    bool ok = true;
 
-    char *resp = xoauth2_make_client_response(user, token);
+    session->auth = NULL;
 
     if (!resp) {
-        syslog(LOG_ERR, "SMTP: Error formatting SASL client response mechanism: %m");
-        succ = false;
+        if (gerr == ACCOUNT_ERROR_USER)
+            syslog(LOG_WARNING, "SMTP: Could not find GNOME Online Account for username %s", session->user);
 
-        goto free_token;
+        smtp_auth_error(relay, gerr);
+        goto free_user;
     }
 
     char *auth_cmd;
     if (asprintf(&auth_cmd, "AUTH XOAUTH2 %s\r\n", resp) == -1) {
         syslog(LOG_ERR, "SMTP: asprintf error (formatting AUTH command): %m");
-        succ = false;
-        goto free_resp;
+        ok = false;
+        goto free_user;
     }
 
     // Send Authentication Command to server
 
-    if (!smtp_server_send(bio, auth_cmd, strlen(auth_cmd))) {
-        succ = false;
-    }
-
+    relay_server_send(relay, auth_cmd, strlen(auth_cmd));
     free(auth_cmd);
 
-free_resp:
-    free(resp);
-
-free_token:
-    g_free(token);
+free_user:
+    free(session->user);
+    session->user = NULL;
 
-    return succ;
+    relay_resume(relay, ok);
 }
 
-bool smtp_auth_error(int fd, goa_error gerr) {
+void smtp_auth_error(struct relay *relay, goa_error gerr) {
     switch (gerr) {
     case ACCOUNT_ERROR_CRED: {
         const char *err = "535 Account not authorized for SMTP\r\n";
-        return smtp_client_send(fd, err, strlen(err));
+        relay_client_send(relay, err, strlen(err));
+        return;
     } break;
 
     case ACCOUNT_ERROR_TOKEN: {
         const char *err = "451 Error obtaining access token\r\n";
-        return smtp_client_send(fd, err, strlen(err));
+        relay_client_send(relay, err, strlen(err));
+        return;
+    } break;
+
+    case ACCOUNT_ERROR_USER: {
+        const char *err = "535 Invalid username or password\r\n";
+        relay_client_send(relay, err, strlen(err));
+        return;
     } break;
     }
 
     assert(false);
-    return true;
 }
 
-bool smtp_server_send(BIO *bio, const char *data, size_t n) {
-    while (n) {
-        ssize_t s_n = BIO_write(bio, data, n);
-
-        if (s_n < 0) {
-            ssl_log_error("Error sending data to SMTP server");
-            return false;
-        }
-
-        n -= s_n;
-        data += s_n;
-    }
-
-    return true;
-}
 
-bool smtp_client_send(int fd, const char *data, size_t n) {
-    while (n) {
-        ssize_t c_n = send(fd, data, n, 0) ;
+/* Handle SMTP server response */
 
-        if (c_n < 0) {
-            syslog(LOG_ERR, "SMTP: Error sending data to client: %m");
-            return false;
-        }
+bool smtp_server_handle_reply(struct relay *relay, bool *progress) {
+    struct smtp_session *session = relay->data;
+    struct smtp_reply reply;
 
-        n -= c_n;
-        data += c_n;
-    };
+    while (relay->filtering &&
+           relay_client_pending(relay) < RELAY_BUF_MAX) {
 
-    return true;
-}
+        ssize_t s_n = smtp_reply_next(session->s_stream, &reply);
 
+        if (s_n < 0) {
+            if (errno == EAGAIN) {
+                relay->s_readable = false;
+                return true;
+            }
 
-/* Handle SMTP server response */
+            ssl_log_error("SMTP: Error reading data from server");
+            relay->s_eof = true;
+            return true;
+        }
 
-bool smtp_server_handle_reply(int c_fd, struct smtp_reply_stream *s_stream, struct smtp_cmd_stream *c_stream) {
-    struct smtp_reply reply;
-    reply.last = false;
+        *progress = true;
 
-    while (!reply.last) {
-        if (smtp_reply_next(s_stream, &reply) <= 0)
-            return false;
+        if (s_n == 0) {
+            syslog(LOG_NOTICE, "SMTP: Server closed connection");
+            relay->s_eof = true;
+            return true;
+        }
 
         smtp_reply_parse(&reply);
 
@@ -429,15 +471,17 @@ bool smtp_server_handle_reply(int c_fd, struct smtp_reply_stream *s_stream, stru
             int sz = snprintf(data, sizeof(data), "%d%cAUTH PLAIN\r\n", reply.code, reply.last ? ' ' : '-');
             assert(sz > 0 && sz < sizeof(data));
 
-            if (!smtp_client_send(c_fd, data, sz))
-                return false;
+            relay_client_send(relay, data, sz);
         } break;
 
         default:
-            smtp_cmd_stream_data_mode(c_stream, reply.code == 354);
+            smtp_cmd_stream_data_mode(session->c_stream, reply.code == 354);
+            relay_client_send(relay, reply.data, reply.total_len);
 
-            if (!smtp_client_send(c_fd, reply.data, reply.total_len))
-                return false;
+            // Only the AUTH command sent by the proxy reaches the
+            // server, thus this reply accepts its authentication.
+            if (reply.code == 235 && reply.last)
+                smtp_begin_relay(relay);
 
             break;
         }
@@ -445,3 +489,21 @@ bool smtp_server_handle_reply(int c_fd, struct smtp_reply_stream *s_stream, stru
 
     return true;
 }
+
+void smtp_begin_relay(struct relay *relay) {
+    struct smtp_session *session = relay->data;
+
+    // The data remaining in the streams' buffers is forwarded by
+    // moving the buffers' memory to the send buffers, rather than
+    // copying it.
+    smtp_cmd_buffer(session->c_stream, &relay->s_out);
+    smtp_reply_buffer(session->s_stream, &relay->c_out);
+
+    smtp_reply_stream_free(session->s_stream);
+    smtp_cmd_stream_free(session->c_stream);
+
+    session->s_stream = NULL;
+    session->c_stream = NULL;
+
+    relay_passthrough(relay);
+}
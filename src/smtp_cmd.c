@@ -13,8 +13,7 @@
 #include <openssl/bio.h>
 
 #include "xmalloc.h"
-
-#define OAP_CMD_BUF_SIZE 1024
+#include "linebuf.h"
 
 #define CMD_AUTH_PLAIN "AUTH PLAIN"
 #define CMD_AUTH_PLAIN_LEN strlen(CMD_AUTH_PLAIN)
@@ -32,28 +31,21 @@ struct smtp_cmd_stream {
     bool in_data;
 
     /**
-     * Size of SMTP command.
+     * Buffer into which SMTP commands are read.
      */
-    size_t size;
-
-    /**
-     * Buffer into which SMTP command is read.
-     */
-    char data[OAP_CMD_BUF_SIZE + 1];
+    struct linebuf buf;
 };
 
 /**
  * Parse an SMTP command from the client response.
  *
- * @param stream SMTP command stream
- *
- * @param command Pointer to smtp_command struct. On input the pointer
- *   to the start of the command data should be filled. On output, it
- *   is filled with parsed command data.
+ * @param command Pointer to smtp_command struct. On input the line
+ *   and total_len fields should be filled. On output, it is filled
+ *   with parsed command data.
  *
  * @return True if command was parsed successfully.
  */
-static bool parse_cmd(struct smtp_cmd_stream *stream, struct smtp_cmd *command);
+static bool parse_cmd(struct smtp_cmd *command);
 
 /**
  * Find the start of the command data.
@@ -76,43 +68,28 @@ static size_t cmd_data_len(const char *data, size_t size);
 
 /* Implementations */
 
-struct smtp_cmd_stream * smtp_cmd_stream_create(int fd) {
+struct smtp_cmd_stream * smtp_cmd_stream_create(int fd, bool close) {
     // Create socket BIO
-    BIO *sbio = BIO_new_socket(fd, true);
+    BIO *sbio = BIO_new_socket(fd, close);
     if (!sbio) return NULL;
 
-    // Create Buffered BIO
-    BIO *bbio = BIO_new(BIO_f_buffer());
-    if (!bbio) goto free_sbio;
-
-    // Chain BIOs
-    BIO *chain = BIO_push(bbio, sbio);
-    if (!chain) goto free_bbio;
-
-
     // Create stream struct
 
     struct smtp_cmd_stream *stream = xmalloc(sizeof(struct smtp_cmd_stream));
 
-    stream->bio = chain;
-    stream->size = 0;
+    stream->bio = sbio;
+    linebuf_init(&stream->buf);
 
     stream->in_data = false;
 
     return stream;
-
-free_bbio:
-    BIO_free_all(bbio);
-
-free_sbio:
-    BIO_free_all(sbio);
-
-    return NULL;
 }
 
 void smtp_cmd_stream_free(struct smtp_cmd_stream *stream) {
     assert(stream != NULL);
 
+    linebuf_free(&stream->buf);
+
     BIO_free_all(stream->bio);
     free(stream);
 }
@@ -121,30 +98,31 @@ int smtp_cmd_stream_fd(struct smtp_cmd_stream *stream) {
     return BIO_get_fd(stream->bio, NULL);
 }
 
-bool smtp_cmd_stream_pending(struct smtp_cmd_stream *stream) {
-    return BIO_ctrl_pending(stream->bio) != 0;
-}
-
 void smtp_cmd_stream_data_mode(struct smtp_cmd_stream *stream, bool in_data) {
     stream->in_data = in_data;
 }
 
+void smtp_cmd_buffer(struct smtp_cmd_stream *stream, struct buffer *out) {
+    linebuf_move(&stream->buf, out);
+}
+
 ssize_t smtp_cmd_next(struct smtp_cmd_stream *stream, struct smtp_cmd *cmd) {
-    ssize_t n = BIO_gets(stream->bio, stream->data, OAP_CMD_BUF_SIZE);
+    const char *line;
+    size_t n;
 
-    if (n <= 0) {
-        return n;
-    }
+    while (!(n = linebuf_next(&stream->buf, &line))) {
+        if (stream->buf.eof)
+            return 0;
 
-    // Add terminating NUL character in case reading data rather than
-    // line
-    stream->size = n;
+        if (linebuf_fill(&stream->buf, stream->bio) < 0)
+            return -1;
+    }
 
-    cmd->line = stream->data;
+    cmd->line = line;
     cmd->total_len = n;
 
     if (!stream->in_data) {
-        parse_cmd(stream, cmd);
+        parse_cmd(cmd);
     }
     else {
         cmd->command = SMTP_CMD;
@@ -155,19 +133,22 @@ ssize_t smtp_cmd_next(struct smtp_cmd_stream *stream, struct smtp_cmd *cmd) {
     return n;
 }
 
-bool parse_cmd(struct smtp_cmd_stream *stream, struct smtp_cmd *command) {
-    if (strncasecmp(CMD_AUTH_PLAIN, stream->data, CMD_AUTH_PLAIN_LEN) == 0 &&
-        isspace(stream->data[CMD_AUTH_PLAIN_LEN])) {
+bool parse_cmd(struct smtp_cmd *command) {
+    const char *line = command->line;
+    size_t size = command->total_len;
+
+    if (strncasecmp(CMD_AUTH_PLAIN, line, CMD_AUTH_PLAIN_LEN) == 0 &&
+        isspace(line[CMD_AUTH_PLAIN_LEN])) {
 
         command->command = SMTP_CMD_AUTH;
-        command->data = cmd_data_start(stream->data + CMD_AUTH_PLAIN_LEN);
-        command->data_len = cmd_data_len(command->data, stream->size - (command->data - stream->data));
+        command->data = cmd_data_start(line + CMD_AUTH_PLAIN_LEN);
+        command->data_len = cmd_data_len(command->data, size - (command->data - line));
 
         return true;
     }
 
-    if (strncasecmp(CMD_DATA, stream->data, CMD_DATA_LEN) == 0 &&
-        isspace(stream->data[CMD_DATA_LEN])) {
+    if (strncasecmp(CMD_DATA, line, CMD_DATA_LEN) == 0 &&
+        isspace(line[CMD_DATA_LEN])) {
 
         command->command = SMTP_CMD_DATA;
         command->data = NULL;
@@ -176,8 +157,8 @@ bool parse_cmd(struct smtp_cmd_stream *stream, struct smtp_cmd *command) {
     }
 
     command->command = SMTP_CMD;
-    command->data = stream->data;
-    command->data_len = cmd_data_len(command->data, stream->size);
+    command->data = line;
+    command->data_len = cmd_data_len(command->data, size);
 
     return true;
 }
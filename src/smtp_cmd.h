@@ -6,6 +6,8 @@
 
 #include <unistd.h>
 
+#include "buffer.h"
+
 /**
  * Stream of SMTP client commands
  */
@@ -44,16 +46,17 @@ struct smtp_cmd {
 /**
  * Create an SMTP command stream.
  *
- * @param fd SMTP client socket file descriptor. The stream takes
- *   responsibility of closing the file.
+ * @param fd SMTP client socket file descriptor.
+ *
+ * @param close True if the socket file descriptor should be closed
+ *   when the stream is freed.
  *
  * @return Pointer to the smtp_cmd_stream struct
  */
-struct smtp_cmd_stream * smtp_cmd_stream_create(int fd);
+struct smtp_cmd_stream * smtp_cmd_stream_create(int fd, bool close);
 
 /**
- * Free the memory held by an SMTP command stream, and close the
- * underlying socket.
+ * Free the memory held by an SMTP command stream.
  *
  * @param stream Pointer to SMTP command stream.
  */
@@ -68,27 +71,19 @@ void smtp_cmd_stream_free(struct smtp_cmd_stream *stream);
  */
 int smtp_cmd_stream_fd(struct smtp_cmd_stream *stream);
 
-/**
- * Returns true if there is pending data in the stream.
- *
- * This does not mean there is a full command in the stream, and hence
- * does not mean a call to smtp_cmd_next wont block.
- *
- * @param stream SMTP command stream.
- *
- * @return True if there is data in the stream.
- */
-bool smtp_cmd_stream_pending(struct smtp_cmd_stream *stream);
-
 /**
  * Read and parse the next command from the command stream.
  *
+ * If the socket is non-blocking and a complete command has not been
+ * received yet, returns immediately with errno set to EAGAIN.
+ *
  * @param stream SMTP command stream.
  *
  * @param cmd Pointer to smtp_cmd struct which is filled on output.
  *
  * @return Number of bytes read, 0 if no bytes are read (client closed
- *   connection), -1 if an error occurred.
+ *   connection), -1 if an error occurred or no complete command is
+ *   available on a non-blocking socket.
  */
 ssize_t smtp_cmd_next(struct smtp_cmd_stream *stream, struct smtp_cmd *cmd);
 
@@ -100,4 +95,15 @@ ssize_t smtp_cmd_next(struct smtp_cmd_stream *stream, struct smtp_cmd *cmd);
  */
 void smtp_cmd_stream_data_mode(struct smtp_cmd_stream *stream, bool in_data);
 
+/**
+ * Move the remaining data in the stream's buffer to the end of a send
+ * buffer, without copying it if @a out is empty.
+ *
+ * No further commands can be read from the stream afterwards.
+ *
+ * @param stream SMTP command stream.
+ * @param out    Send buffer.
+ */
+void smtp_cmd_buffer(struct smtp_cmd_stream *stream, struct buffer *out);
+
 #endif /* OAPROXY_SMTP_CMD_H */
@@ -6,8 +6,7 @@
 
 #include "ssl.h"
 #include "xmalloc.h"
-
-#define OAP_STREAM_BUF_SIZE 1024
+#include "linebuf.h"
 
 #define STATUS_AUTH "AUTH "
 #define STATUS_AUTH_LEN strlen(STATUS_AUTH)
@@ -17,14 +16,9 @@ struct smtp_reply_stream {
     BIO *bio;
 
     /**
-     * Number of bytes in data buffer
+     * Buffer into which SMTP server replies are read
      */
-    size_t size;
-
-    /**
-     * SMTP server reply data buffer
-     */
-    char data[OAP_STREAM_BUF_SIZE];
+    struct linebuf buf;
 };
 
 /**
@@ -42,21 +36,10 @@ static size_t reply_length(const char *data, size_t size);
 /* Implementation */
 
 struct smtp_reply_stream * smtp_reply_stream_create(BIO *bio) {
-    // Create buffered BIO stream
-    BIO *bbio = BIO_new(BIO_f_buffer());
-    if (!bbio) return NULL;
-
-    // Chain BIO streams
-    BIO *chain = BIO_push(bbio, bio);
-    if (!chain) {
-        BIO_free_all(bbio);
-        return NULL;
-    }
-
     struct smtp_reply_stream *stream = xmalloc(sizeof(struct smtp_reply_stream));
 
-    stream->bio = chain;
-    stream->size = 0;
+    stream->bio = bio;
+    linebuf_init(&stream->buf);
 
     return stream;
 }
@@ -64,26 +47,33 @@ struct smtp_reply_stream * smtp_reply_stream_create(BIO *bio) {
 void smtp_reply_stream_free(struct smtp_reply_stream *stream) {
     assert(stream != NULL);
 
-    BIO_free_all(stream->bio);
+    linebuf_free(&stream->buf);
     free(stream);
 }
 
 ssize_t smtp_reply_next(struct smtp_reply_stream *stream, struct smtp_reply *reply) {
-    ssize_t n = BIO_gets(stream->bio, stream->data, OAP_STREAM_BUF_SIZE);
+    const char *line;
+    size_t n;
 
-    if (n <= 0) {
-        return n;
-    }
+    while (!(n = linebuf_next(&stream->buf, &line))) {
+        if (stream->buf.eof)
+            return 0;
 
-    stream->size = n;
+        if (linebuf_fill(&stream->buf, stream->bio) < 0)
+            return -1;
+    }
 
-    reply->data = stream->data;
-    reply->data_len = reply_length(stream->data, stream->size);
-    reply->total_len = stream->size;
+    reply->data = (char *)line;
+    reply->data_len = reply_length(line, n);
+    reply->total_len = n;
 
     return n;
 }
 
+void smtp_reply_buffer(struct smtp_reply_stream *stream, struct buffer *out) {
+    linebuf_move(&stream->buf, out);
+}
+
 static size_t reply_length(const char *data, size_t size) {
     if (size >= 1 && data[size-1] == '\n') {
         if (size >= 2 && data[size-2] == '\r') {
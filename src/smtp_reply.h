@@ -5,6 +5,8 @@
 
 #include <openssl/bio.h>
 
+#include "buffer.h"
+
 /**
  * Maximum SMTP reply line length
  */
@@ -72,16 +74,15 @@ struct smtp_reply {
 /**
  * Create an SMTP reply stream.
  *
- * @param bio SMTP Server OpenSSL BIO object. The stream takes
- *   responsibility for freeing the BIO.
+ * @param bio SMTP Server OpenSSL BIO object. The BIO is not freed
+ *   when the stream is freed.
  *
  * @return The smtp_reply_stream struct.
  */
 struct smtp_reply_stream * smtp_reply_stream_create(BIO *bio);
 
 /**
- * Free the memory held by an SMTP reply stream and free the
- * underlying BIO stream.
+ * Free the memory held by an SMTP reply stream.
  *
  * @param stream Pointer to the smtp_reply_stream struct.
  */
@@ -90,6 +91,9 @@ void smtp_reply_stream_free(struct smtp_reply_stream *stream);
 /**
  * Read the next complete reply line from the SMTP reply stream.
  *
+ * If the BIO is non-blocking and a complete reply line has not been
+ * received yet, returns immediately with errno set to EAGAIN.
+ *
  * @param stream Pointer to SMTP reply stream.
  *
  * @param reply Pointer to smtp_reply struct, which is filled
@@ -97,7 +101,8 @@ void smtp_reply_stream_free(struct smtp_reply_stream *stream);
  *   filled.
  *
  * @return Number of bytes read, 0 if no bytes are read (server closed
- *   connection), -1 if an error occurred.
+ *   connection), -1 if an error occurred or no complete reply line is
+ *   available on a non-blocking BIO.
  */
 ssize_t smtp_reply_next(struct smtp_reply_stream *stream, struct smtp_reply *reply);
 
@@ -114,4 +119,15 @@ ssize_t smtp_reply_next(struct smtp_reply_stream *stream, struct smtp_reply *rep
  */
 bool smtp_reply_parse(struct smtp_reply *reply);
 
+/**
+ * Move the remaining data in the stream's buffer to the end of a send
+ * buffer, without copying it if @a out is empty.
+ *
+ * No further replies can be read from the stream afterwards.
+ *
+ * @param stream Pointer to SMTP reply stream.
+ * @param out    Send buffer.
+ */
+void smtp_reply_buffer(struct smtp_reply_stream *stream, struct buffer *out);
+
 #endif /* OAPROXY_SMTP_REPLY_H */
@@ -0,0 +1,75 @@
+#define _GNU_SOURCE
+
+#include "splice.h"
+
+#include <fcntl.h>
+#include <syslog.h>
+
+/**
+ * Requested pipe capacity. The capacity may be limited by the system,
+ * in which case the default capacity is used.
+ */
+#define SPLICE_PIPE_SIZE (256 * 1024)
+
+/**
+ * Flags passed to splice()
+ */
+#define SPLICE_FLAGS (SPLICE_F_MOVE | SPLICE_F_NONBLOCK)
+
+void splice_pipe_init(struct splice_pipe *pipe) {
+    pipe->r = pipe->w = -1;
+    pipe->len = pipe->size = 0;
+}
+
+bool splice_pipe_open(struct splice_pipe *pipe) {
+    int fds[2];
+
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC)) {
+        syslog(LOG_ERR, "Error creating pipe: %m");
+        return false;
+    }
+
+    pipe->r = fds[0];
+    pipe->w = fds[1];
+    pipe->len = 0;
+
+    // Fails if the size exceeds the system limit, in which case the
+    // default size is kept
+    fcntl(pipe->w, F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+
+    int size = fcntl(pipe->w, F_GETPIPE_SZ);
+
+    if (size <= 0) {
+        syslog(LOG_ERR, "Error getting pipe size: %m");
+        splice_pipe_close(pipe);
+        return false;
+    }
+
+    pipe->size = size;
+    return true;
+}
+
+void splice_pipe_close(struct splice_pipe *pipe) {
+    if (pipe->r >= 0) close(pipe->r);
+    if (pipe->w >= 0) close(pipe->w);
+
+    splice_pipe_init(pipe);
+}
+
+ssize_t splice_pipe_fill(struct splice_pipe *pipe, int fd) {
+    ssize_t n = splice(fd, NULL, pipe->w, NULL, pipe->size - pipe->len, SPLICE_FLAGS);
+
+    if (n > 0)
+        pipe->len += n;
+
+    return n;
+}
+
+ssize_t splice_pipe_drain(struct splice_pipe *pipe, int fd) {
+    ssize_t n = splice(pipe->r, NULL, fd, NULL, pipe->len, SPLICE_FLAGS);
+
+    if (n > 0)
+        pipe->len -= n;
+
+    return n;
+}
@@ -0,0 +1,75 @@
+#ifndef OAPROXY_SPLICE_H
+#define OAPROXY_SPLICE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <unistd.h>
+
+/**
+ * Pipe through which data is moved from one socket to another with
+ * splice(), without being copied to user space.
+ */
+struct splice_pipe {
+    /** Read end of the pipe, -1 if not open */
+    int r;
+    /** Write end of the pipe, -1 if not open */
+    int w;
+
+    /** Number of bytes in the pipe */
+    size_t len;
+    /** Capacity of the pipe in bytes */
+    size_t size;
+};
+
+/**
+ * Initialize a pipe which is not open.
+ *
+ * @param pipe Pipe.
+ */
+void splice_pipe_init(struct splice_pipe *pipe);
+
+/**
+ * Open a pipe.
+ *
+ * The pipe's capacity is increased, if allowed, so that large
+ * amounts of data can be moved with few calls.
+ *
+ * @param pipe Pipe initialized with splice_pipe_init().
+ *
+ * @return True if successful.
+ */
+bool splice_pipe_open(struct splice_pipe *pipe);
+
+/**
+ * Close a pipe, discarding the data in it. Does nothing if the pipe
+ * is not open.
+ *
+ * @param pipe Pipe.
+ */
+void splice_pipe_close(struct splice_pipe *pipe);
+
+/**
+ * Move data received on a socket into a pipe, which is not full.
+ *
+ * @param pipe Pipe.
+ * @param fd   Non-blocking socket to receive data from.
+ *
+ * @return Number of bytes moved, 0 if the end of the stream was
+ *   reached, -1 on error. If no data is available or the pipe cannot
+ *   accept more data, -1 is returned with errno set to EAGAIN.
+ */
+ssize_t splice_pipe_fill(struct splice_pipe *pipe, int fd);
+
+/**
+ * Send the data in a pipe, which is not empty, to a socket.
+ *
+ * @param pipe Pipe.
+ * @param fd   Non-blocking socket to send data to.
+ *
+ * @return Number of bytes sent, -1 on error. If the socket would
+ *   block, -1 is returned with errno set to EAGAIN.
+ */
+ssize_t splice_pipe_drain(struct splice_pipe *pipe, int fd);
+
+#endif /* OAPROXY_SPLICE_H */
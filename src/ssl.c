@@ -1,10 +1,42 @@
 #include "ssl.h"
 
 #include <syslog.h>
+#include <time.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+#include "upstream.h"
+#include "connect.h"
+
+/**
+ * Cipher suites offered to remote servers, for TLS 1.2
+ */
+#define CLIENT_CIPHER_LIST "HIGH:!aNULL:!MD5:!RC4"
+
+/**
+ * Size of the buffer into which data is read ahead from servers
+ */
+#define SSL_READ_BUFFER_SIZE (64 * 1024)
+
+/**
+ * Record size used after a connection has been idle. Leaves room for
+ * the record, IP and TCP overhead within a 1500 byte MTU.
+ */
+#define RECORD_SIZE_SMALL 1300
+
+/**
+ * Number of bytes written without pause after which full sized
+ * records are used.
+ */
+#define RECORD_BULK_SIZE (16 * 1024)
+
+/**
+ * Time in milliseconds without writes after which a connection is
+ * considered idle.
+ */
+#define RECORD_IDLE_MS 1000
+
 /**
  * SSL error callback function, logs the error using syslog.
  *
@@ -13,6 +45,11 @@
  */
 static int ssl_log_error_cb(const char *str, size_t len, void *u);
 
+/**
+ * Return the current time from a monotonic clock, in milliseconds.
+ */
+static uint64_t now_ms(void);
+
 void initialize_ssl(void) {
     SSL_load_error_strings();
     ERR_load_crypto_strings();
@@ -36,36 +73,86 @@ int ssl_log_error_cb(const char *str, size_t len, void *u) {
     return 0;
 }
 
-BIO *server_connect(const char *host) {
-    SSL_CTX *ctx = SSL_CTX_new(SSLv23_client_method());
+SSL_CTX *ssl_client_ctx_create(void) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
     if (ctx == NULL) {
-        ssl_log_error("SMTP: Error creating SSL context");
+        ssl_log_error("Error creating SSL context");
         return NULL;
     }
 
-    BIO *bio = BIO_new_ssl_connect(ctx);
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_COMPRESSION);
+
+#ifdef SSL_OP_ENABLE_KTLS
+    // Let the kernel encrypt and decrypt records, if it supports the
+    // negotiated cipher, so that data can be spliced between sockets
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+    if (!SSL_CTX_set_cipher_list(ctx, CLIENT_CIPHER_LIST)) {
+        ssl_log_error("Error setting SSL cipher list");
+        goto free_ctx;
+    }
+
+    if (!SSL_CTX_set_default_verify_paths(ctx)) {
+        ssl_log_error("Error loading trusted certificates");
+        goto free_ctx;
+    }
+
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    SSL_CTX_set_mode(ctx, SSL_MODE_AUTO_RETRY);
+
+    // Writes are retried with the data of a send buffer, which may
+    // have been reallocated in the meantime
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    // Read as much data as is available, rather than a record at a
+    // time, to reduce the number of reads from the socket
+    SSL_CTX_set_read_ahead(ctx, 1);
+    SSL_CTX_set_default_read_buffer_len(ctx, SSL_READ_BUFFER_SIZE);
+
+    return ctx;
+
+free_ctx:
+    SSL_CTX_free(ctx);
+    return NULL;
+}
+
+BIO *server_connect(struct upstream *upstream) {
+    BIO *sock = connect_bio_new(upstream);
+    if (!sock) return NULL;
+
+    BIO *bio = BIO_new_ssl(upstream->ctx, 1);
     if (!bio) {
-        SSL_CTX_free(ctx);
+        ssl_log_error("Error creating SSL connection");
+        BIO_free(sock);
         return NULL;
     }
 
+    BIO_push(bio, sock);
+
     SSL *ssl;
 
     if (BIO_get_ssl(bio, &ssl) <= 0) {
         goto free_bio;
     }
 
-    SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY);
-
-    if (!BIO_set_conn_hostname(bio, host)) {
-        syslog(LOG_ERR, "Error setting host: %s", host);
+    if (!SSL_set_tlsext_host_name(ssl, upstream->name) ||
+        !SSL_set1_host(ssl, upstream->name)) {
+        syslog(LOG_ERR, "Error setting server name: %s", upstream->name);
         ssl_log_error(NULL);
         goto free_bio;
     }
 
-    if (BIO_do_connect(bio) <= 0) {
-        syslog(LOG_ERR, "Error connecting to host: %s", host);
-        ssl_log_error(NULL);
+    // Offer a cached session to skip the full handshake
+    SSL_SESSION *session = upstream_get_session(upstream);
+
+    if (session) {
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
+    }
+
+    if (server_handshake(bio, upstream->host) < 0) {
         goto free_bio;
     }
 
@@ -75,3 +162,82 @@ free_bio:
     BIO_free_all(bio);
     return NULL;
 }
+
+int server_handshake(BIO *bio, const char *host) {
+    // Plain socket connection, no handshake required
+    if (!BIO_find_type(bio, BIO_TYPE_SSL))
+        return 1;
+
+    if (BIO_do_handshake(bio) > 0)
+        return 1;
+
+    if (BIO_should_retry(bio))
+        return 0;
+
+    syslog(LOG_ERR, "Error connecting to host: %s", host);
+    ssl_log_error(NULL);
+
+    return -1;
+}
+
+void record_sizing_init(struct record_sizing *rs) {
+    rs->burst = 0;
+    rs->last = 0;
+    rs->size = 0;
+}
+
+int server_write(BIO *bio, struct record_sizing *rs, const char *data, int n) {
+    uint64_t now = now_ms();
+
+    if (now - rs->last >= RECORD_IDLE_MS)
+        rs->burst = 0;
+
+    size_t size = rs->burst + n >= RECORD_BULK_SIZE ?
+        SSL3_RT_MAX_PLAIN_LENGTH : RECORD_SIZE_SMALL;
+
+    SSL *ssl;
+
+    if (size != rs->size && BIO_get_ssl(bio, &ssl) > 0 && ssl &&
+        SSL_set_max_send_fragment(ssl, size)) {
+        rs->size = size;
+    }
+
+    int ret = BIO_write(bio, data, n);
+
+    if (ret > 0) {
+        rs->burst += ret;
+        rs->last = now;
+    }
+
+    return ret;
+}
+
+bool server_pending(BIO *bio) {
+    SSL *ssl;
+
+    if (BIO_get_ssl(bio, &ssl) > 0 && ssl)
+        return SSL_pending(ssl) > 0;
+
+    return BIO_pending(bio) > 0;
+}
+
+bool server_ktls(BIO *bio) {
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL *ssl;
+
+    if (BIO_get_ssl(bio, &ssl) <= 0 || !ssl)
+        return false;
+
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) &&
+        BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#else
+    return false;
+#endif
+}
+
+uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
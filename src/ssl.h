@@ -1,7 +1,13 @@
 #ifndef OAPROXY_SSL_H
 #define OAPROXY_SSL_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include <openssl/bio.h>
+#include <openssl/ssl.h>
+
+struct upstream;
 
 /* SSL Utility Functions */
 
@@ -22,13 +28,118 @@ void destroy_ssl(void);
  */
 void ssl_log_error(const char *msg);
 
+/**
+ * Create a TLS context for connections to remote servers.
+ *
+ * The system certificate store is loaded and peer verification is
+ * enabled.
+ *
+ * @return The TLS context, NULL on error.
+ */
+SSL_CTX *ssl_client_ctx_create(void);
+
 /**
  * Connect to a server using a TLS/SSL connection.
  *
- * @param host Server host to connect to.
+ * The connection is made to the upstream's cached addresses, without
+ * waiting for the host name to be resolved, racing attempts to
+ * different addresses. The connection is non-blocking. This function
+ * only initiates the connection, server_handshake() should be called, whenever the
+ * connection's socket becomes ready, until the TLS handshake is
+ * completed.
+ *
+ * The server's certificate is verified against its host name, using
+ * the upstream's shared TLS context.
+ *
+ * The descriptor returned by BIO_get_fd() changes once the TCP
+ * connection is established, see connect_bio_new(). Callers should
+ * check for a new descriptor after each call to server_handshake().
+ *
+ * @param upstream Server to connect to.
+ *
+ * @return BIO stream if connection was initiated successfully. NULL
+ *   otherwise.
+ */
+BIO *server_connect(struct upstream *upstream);
+
+/**
+ * Continue the TLS handshake with a server.
+ *
+ * @param bio  BIO stream returned by server_connect().
+ * @param host Server host, used for error reporting.
+ *
+ * @return 1 if the handshake has completed, 0 if it is still in
+ *   progress, -1 if an error occurred.
+ */
+int server_handshake(BIO *bio, const char *host);
+
+/**
+ * Adaptive sizing of the TLS records sent to a server.
+ *
+ * Data written after the connection has been idle is sent in small
+ * records, each of which fits in a single TCP segment, so that the
+ * server can decrypt an interactive command as soon as its first
+ * segment arrives. Once a large amount of data is written without
+ * pause, full sized records are used, which minimizes the per-record
+ * overhead of bulk transfers.
+ */
+struct record_sizing {
+    /** Number of bytes written since the connection was idle */
+    size_t burst;
+    /** Time of the last write, in milliseconds */
+    uint64_t last;
+    /** Current maximum record size, 0 if not set */
+    size_t size;
+};
+
+/**
+ * Initialize the record sizing state of a new connection.
+ *
+ * @param rs Record sizing state.
+ */
+void record_sizing_init(struct record_sizing *rs);
+
+/**
+ * Write data to a server, adapting the size of the TLS records to
+ * the amount of data being sent.
+ *
+ * All the data passed in a single call is coalesced into as few
+ * records as the record size allows, thus callers should buffer
+ * small writes and write them at once.
+ *
+ * @param bio  BIO stream returned by server_connect().
+ * @param rs   Record sizing state of the connection.
+ * @param data Data to write.
+ * @param n    Number of bytes to write.
+ *
+ * @return Result of BIO_write().
+ */
+int server_write(BIO *bio, struct record_sizing *rs, const char *data, int n);
+
+/**
+ * Check whether data has been received from a server, and decrypted,
+ * which has not been read from the BIO yet.
+ *
+ * Partial records, which OpenSSL has read ahead from the socket, are
+ * not included since they cannot be read until the rest of the record
+ * is received.
+ *
+ * @param bio BIO stream returned by server_connect().
+ *
+ * @return True if there is data to read.
+ */
+bool server_pending(BIO *bio);
+
+/**
+ * Check whether the encryption of a server connection is performed
+ * by the kernel, in which case data can be sent and received
+ * directly on its socket.
+ *
+ * @param bio BIO stream returned by server_connect(), after the
+ *   handshake has completed.
  *
- * @return BIO stream if connection was successful. NULL otherwise.
+ * @return True if kernel TLS is used for both sending and receiving.
  */
-BIO *server_connect(const char *host);
+bool server_ktls(BIO *bio);
 
 #endif /* OAPROXY_SSL_H */
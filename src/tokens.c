@@ -0,0 +1,629 @@
+#define _GNU_SOURCE
+
+#include "tokens.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "xmalloc.h"
+#include "xoauth2.h"
+
+/**
+ * Minimum delay, in seconds, before a token is refreshed. Limits the
+ * rate of requests if the GOA daemon returns tokens which expire
+ * within the refresh margin.
+ */
+#define REFRESH_MIN_DELAY 30
+
+/**
+ * Cached client response of an account.
+ */
+struct token_entry {
+    /** Username */
+    char *user;
+    /**
+     * Base64 encoded XOAUTH2 client response, NULL if there is no
+     * account for the username.
+     */
+    char *response;
+
+    /**
+     * Monotonic time, in seconds, after which the access token in
+     * the response is no longer used, or after which the username is
+     * looked up again if it has no account.
+     */
+    time_t expiry;
+
+    /** Next entry */
+    struct token_entry *next;
+};
+
+/**
+ * Request for a client response.
+ *
+ * The request is handled on the GOA thread, unless the response is
+ * cached, and completed on the event loop of the requesting session.
+ */
+struct token_request {
+    /** Event loop on which the request is completed */
+    struct event_loop *loop;
+
+    /** Username */
+    char *user;
+
+    /** Callback receiving the response */
+    token_cb cb;
+    /** Data passed to the callback */
+    void *data;
+
+    /** Receives the client response, NULL on error */
+    char *response;
+    /** Receives the error */
+    goa_error error;
+
+    /**
+     * True if the request has been cancelled. Only used by the
+     * request's event loop.
+     */
+    bool cancelled;
+
+    /**
+     * Next request waiting for the same fetch. Only used by the GOA
+     * thread.
+     */
+    struct token_request *next;
+};
+
+/**
+ * Fetch of a user's client response in progress on the GOA thread,
+ * shared by all requests for the user made while it is pending, and
+ * by the background refresh of the user's token.
+ *
+ * This is the only place where token requests are coalesced, thus
+ * request_access_token() is called at most once at a time per user.
+ */
+struct token_fetch {
+    /** Username */
+    char *user;
+
+    /** Requests waiting for the response, in the order they were made */
+    struct token_request *requests;
+    /** Pointer to the next pointer of the last waiting request */
+    struct token_request **last;
+
+    /**
+     * True if the token is fetched in the background, by a prefetch
+     * or refresh. If the fetch fails, the token is no longer
+     * refreshed.
+     */
+    bool background;
+};
+
+/**
+ * Lock protecting the cache.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Cached entries. There is one entry per account which has been
+ * used, thus the list is short. Entries of usernames without an
+ * account are removed once expired.
+ */
+static struct token_entry *entries = NULL;
+
+/**
+ * Number of seconds before a token expires at which it is refreshed,
+ * 0 if tokens are not refreshed.
+ */
+static size_t refresh_margin = 0;
+
+/**
+ * Refresh timers of the accounts, by username. Only used by the GOA
+ * thread.
+ */
+static GHashTable *refresh_timers = NULL;
+
+/**
+ * Fetches in progress, by username. Only used by the GOA thread.
+ */
+static GHashTable *fetches = NULL;
+
+/**
+ * Look up the account of a user and request an access token. Run on
+ * the GOA thread.
+ *
+ * If the response was cached since the request was made, the request
+ * is completed with the cached response. If a fetch for the user is
+ * already in progress, the request waits for its response.
+ *
+ * @param data The token_request.
+ */
+static void fetch_response(void *data);
+
+/**
+ * Callback receiving the access token requested for a token_fetch.
+ * Generates the client response and completes the fetch.
+ *
+ * @param token      Access token, NULL on error
+ * @param expires_in Number of seconds for which the token is valid
+ * @param error      goa_error constant, if @a token is NULL
+ * @param data       The token_fetch
+ */
+static void response_ready(const gchar *token, gint expires_in, goa_error error, void *data);
+
+/**
+ * Start fetching the client response of a user, by requesting the
+ * access token of the user's account.
+ *
+ * @param user       Username
+ * @param account    Account object
+ * @param background True if the fetch is a prefetch or refresh
+ * @param req        Request waiting for the response, NULL if none.
+ */
+static void start_fetch(const char *user, GoaObject *account, bool background, struct token_request *req);
+
+/**
+ * Find the fetch in progress for a user.
+ *
+ * @param user Username
+ *
+ * @return The fetch, NULL if no fetch is in progress for @a user.
+ */
+static struct token_fetch *find_fetch(const char *user);
+
+/**
+ * Complete all requests waiting for a fetch, and free the fetch.
+ *
+ * @param fetch    The fetch
+ * @param response Client response, NULL on error
+ * @param error    goa_error constant, if @a response is NULL
+ */
+static void complete_fetch(struct token_fetch *fetch, const char *response, goa_error error);
+
+/**
+ * Complete a request on its event loop.
+ *
+ * @param req The request
+ */
+static void complete_request(struct token_request *req);
+
+/**
+ * Call the callback of a request, unless it was cancelled, and free
+ * the request. Run on the request's event loop.
+ *
+ * @param loop Event loop
+ * @param data The token_request
+ */
+static void finish_request(struct event_loop *loop, void *data);
+
+/**
+ * Generate the client response for an access token, cache it and
+ * schedule the token's refresh. Run on the GOA thread.
+ *
+ * @param user       Username
+ * @param token      Access token
+ * @param expires_in Number of seconds for which the token is valid
+ *
+ * @return Client response, which should be freed with free(). NULL
+ *   if it could not be generated.
+ */
+static char *store_token(const char *user, const gchar *token, gint expires_in);
+
+/**
+ * Fetch the tokens of all OAuth2 accounts. Run on the GOA thread.
+ *
+ * @param data Unused
+ */
+static void prefetch_tokens(void *data);
+
+/**
+ * Request the token of an account, if it is an OAuth2 account and
+ * its token is not being fetched already.
+ *
+ * @param user    Username
+ * @param account Account object
+ * @param data    Unused
+ */
+static void prefetch_token(const char *user, GoaObject *account, void *data);
+
+/**
+ * Schedule the refresh of a user's token, replacing the previously
+ * scheduled refresh.
+ *
+ * @param user       Username
+ * @param expires_in Number of seconds until the token expires
+ */
+static void schedule_refresh(const char *user, gint expires_in);
+
+/**
+ * Refresh timer callback. Requests a new token for the user, which
+ * schedules the next refresh once obtained.
+ *
+ * @param data Username
+ *
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean refresh_token(gpointer data);
+
+/**
+ * Stop and release a refresh timer.
+ *
+ * @param source Timer source
+ */
+static void free_timer(gpointer source);
+
+/**
+ * Find the cache entry of a user.
+ *
+ * Must be called with the lock held.
+ *
+ * @param user Username
+ *
+ * @return The entry, NULL if there is no entry for @a user.
+ */
+static struct token_entry *find_entry(const char *user);
+
+/**
+ * Look up the cached response of a user.
+ *
+ * @param user     Username
+ * @param response Receives a copy of the response, NULL if @a user
+ *   has no account.
+ *
+ * @return True if an entry, which has not expired, was found for @a
+ *   user.
+ */
+static bool cached_response(const char *user, char **response);
+
+/**
+ * Add a response to the cache, replacing the existing response of
+ * the user.
+ *
+ * @param user     Username
+ * @param response Client response, NULL if @a user has no account.
+ * @param expiry   Monotonic time after which the entry expires
+ */
+static void cache_response(const char *user, const char *response, time_t expiry);
+
+/**
+ * Remove the expired entries of usernames without an account.
+ *
+ * Must be called with the lock held.
+ */
+static void remove_unknown_users(void);
+
+/**
+ * Copy a username.
+ *
+ * @param user Username
+ *
+ * @return Copy of @a user, which should be freed with free().
+ */
+static char *copy_user(const char *user);
+
+/**
+ * Return the current time from a monotonic clock, in seconds.
+ */
+static time_t now(void);
+
+
+/* Implementation */
+
+bool tokens_start(size_t margin) {
+    refresh_margin = margin < TOKEN_EXPIRY_MARGIN ? TOKEN_EXPIRY_MARGIN : margin;
+    return gaccounts_post(prefetch_tokens, NULL);
+}
+
+struct token_request *token_request(struct event_loop *loop, const char *user, token_cb cb, void *data) {
+    struct token_request *req = xmalloc(sizeof(struct token_request));
+
+    req->loop = loop;
+    req->user = copy_user(user);
+
+    req->cb = cb;
+    req->data = data;
+
+    req->response = NULL;
+    req->error = ACCOUNT_ERROR_TOKEN;
+    req->cancelled = false;
+    req->next = NULL;
+
+    // Keep the loop running until the request is completed
+    event_loop_hold(loop);
+
+    if (cached_response(user, &req->response)) {
+        if (!req->response)
+            req->error = ACCOUNT_ERROR_USER;
+
+        complete_request(req);
+    }
+    else if (!gaccounts_post(fetch_response, req)) {
+        complete_request(req);
+    }
+
+    return req;
+}
+
+void token_request_cancel(struct token_request *req) {
+    req->cancelled = true;
+}
+
+void fetch_response(void *data) {
+    struct token_request *req = data;
+
+    // Response obtained by a fetch completed after the request was made
+    if (cached_response(req->user, &req->response)) {
+        if (!req->response)
+            req->error = ACCOUNT_ERROR_USER;
+
+        complete_request(req);
+        return;
+    }
+
+    struct token_fetch *fetch = find_fetch(req->user);
+
+    if (fetch) {
+        *fetch->last = req;
+        fetch->last = &req->next;
+        return;
+    }
+
+    GoaObject *account = find_goaccount(req->user, &req->error);
+
+    if (!account) {
+        if (req->error == ACCOUNT_ERROR_USER)
+            cache_response(req->user, NULL, now() + TOKEN_UNKNOWN_USER_TTL);
+
+        complete_request(req);
+        return;
+    }
+
+    start_fetch(req->user, account, false, req);
+}
+
+void start_fetch(const char *user, GoaObject *account, bool background, struct token_request *req) {
+    if (!fetches)
+        fetches = g_hash_table_new(g_str_hash, g_str_equal);
+
+    struct token_fetch *fetch = xmalloc(sizeof(struct token_fetch));
+
+    fetch->user = copy_user(user);
+    fetch->requests = req;
+    fetch->last = req ? &req->next : &fetch->requests;
+    fetch->background = background;
+
+    g_hash_table_insert(fetches, fetch->user, fetch);
+
+    request_access_token(account, response_ready, fetch);
+}
+
+struct token_fetch *find_fetch(const char *user) {
+    return fetches ? g_hash_table_lookup(fetches, user) : NULL;
+}
+
+void response_ready(const gchar *token, gint expires_in, goa_error error, void *data) {
+    struct token_fetch *fetch = data;
+
+    char *response = token ? store_token(fetch->user, token, expires_in) : NULL;
+
+    if (!response && fetch->background) {
+        syslog(LOG_WARNING, "Could not obtain access token for %s", fetch->user);
+
+        if (refresh_timers)
+            g_hash_table_remove(refresh_timers, fetch->user);
+    }
+
+    complete_fetch(fetch, response, token ? ACCOUNT_ERROR_TOKEN : error);
+    free(response);
+}
+
+void complete_fetch(struct token_fetch *fetch, const char *response, goa_error error) {
+    g_hash_table_remove(fetches, fetch->user);
+
+    struct token_request *req = fetch->requests;
+
+    while (req) {
+        struct token_request *next = req->next;
+
+        req->response = response ? strdup(response) : NULL;
+        req->error = error;
+
+        complete_request(req);
+        req = next;
+    }
+
+    free(fetch->user);
+    free(fetch);
+}
+
+void complete_request(struct token_request *req) {
+    event_loop_post(req->loop, finish_request, req);
+}
+
+void finish_request(struct event_loop *loop, void *data) {
+    struct token_request *req = data;
+
+    if (!req->cancelled)
+        req->cb(req->response, req->error, req->data);
+
+    event_loop_release(loop);
+
+    free(req->response);
+    free(req->user);
+    free(req);
+}
+
+char *store_token(const char *user, const gchar *token, gint expires_in) {
+    time_t expiry = now() + expires_in - TOKEN_EXPIRY_MARGIN;
+
+    char *resp = xoauth2_make_client_response(user, token);
+
+    if (!resp) {
+        syslog(LOG_ERR, "Error formatting SASL client response mechanism: %m");
+        return NULL;
+    }
+
+    // GOA reports 0 if the lifetime of the token is not known
+    if (expires_in > TOKEN_EXPIRY_MARGIN) {
+        cache_response(user, resp, expiry);
+
+        if (refresh_margin)
+            schedule_refresh(user, expires_in);
+    }
+
+    return resp;
+}
+
+void prefetch_tokens(void *data) {
+    foreach_goaccount(prefetch_token, NULL);
+}
+
+void prefetch_token(const char *user, GoaObject *account, void *data) {
+    if (goa_object_peek_oauth2_based(account) && !find_fetch(user))
+        start_fetch(user, account, true, NULL);
+}
+
+void schedule_refresh(const char *user, gint expires_in) {
+    if (!refresh_timers)
+        refresh_timers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_timer);
+
+    gint delay = expires_in - (gint)refresh_margin;
+
+    if (delay < REFRESH_MIN_DELAY)
+        delay = REFRESH_MIN_DELAY;
+
+    GSource *source = g_timeout_source_new_seconds(delay);
+    g_source_set_callback(source, refresh_token, g_strdup(user), g_free);
+    g_source_attach(source, g_main_context_get_thread_default());
+
+    // Replaces, and stops, the previous timer of the user
+    g_hash_table_replace(refresh_timers, g_strdup(user), source);
+}
+
+gboolean refresh_token(gpointer data) {
+    const char *user = data;
+
+    // The token obtained by the fetch in progress schedules the next
+    // refresh
+    struct token_fetch *fetch = find_fetch(user);
+
+    if (fetch) {
+        fetch->background = true;
+        return G_SOURCE_REMOVE;
+    }
+
+    goa_error error;
+    GoaObject *account = find_goaccount(user, &error);
+
+    if (account) {
+        start_fetch(user, account, true, NULL);
+    }
+    else {
+        syslog(LOG_WARNING, "Could not refresh access token for %s", user);
+        g_hash_table_remove(refresh_timers, user);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+void free_timer(gpointer source) {
+    g_source_destroy(source);
+    g_source_unref(source);
+}
+
+struct token_entry *find_entry(const char *user) {
+    for (struct token_entry *entry = entries; entry; entry = entry->next) {
+        if (!strcmp(entry->user, user))
+            return entry;
+    }
+
+    return NULL;
+}
+
+bool cached_response(const char *user, char **response) {
+    bool found = false;
+    *response = NULL;
+
+    pthread_mutex_lock(&lock);
+
+    struct token_entry *entry = find_entry(user);
+
+    if (entry && now() < entry->expiry) {
+        if (entry->response)
+            *response = strdup(entry->response);
+
+        found = entry->response == NULL || *response != NULL;
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return found;
+}
+
+void cache_response(const char *user, const char *response, time_t expiry) {
+    char *copy = NULL;
+
+    if (response && !(copy = strdup(response)))
+        return;
+
+    pthread_mutex_lock(&lock);
+
+    remove_unknown_users();
+
+    struct token_entry *entry = find_entry(user);
+
+    if (!entry) {
+        entry = xmalloc(sizeof(struct token_entry));
+        entry->user = copy_user(user);
+        entry->response = NULL;
+
+        entry->next = entries;
+        entries = entry;
+    }
+
+    free(entry->response);
+
+    entry->response = copy;
+    entry->expiry = expiry;
+
+    pthread_mutex_unlock(&lock);
+}
+
+void remove_unknown_users(void) {
+    time_t t = now();
+    struct token_entry **next = &entries;
+
+    while (*next) {
+        struct token_entry *entry = *next;
+
+        if (!entry->response && t >= entry->expiry) {
+            *next = entry->next;
+
+            free(entry->user);
+            free(entry);
+        }
+        else {
+            next = &entry->next;
+        }
+    }
+}
+
+char *copy_user(const char *user) {
+    size_t len = strlen(user) + 1;
+
+    char *copy = xmalloc(len);
+    memcpy(copy, user, len);
+
+    return copy;
+}
+
+time_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec;
+}
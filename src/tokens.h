@@ -0,0 +1,98 @@
+#ifndef OAPROXY_TOKENS_H
+#define OAPROXY_TOKENS_H
+
+#include "gaccounts.h"
+#include "event.h"
+
+/* OAuth2 Access Token Cache */
+
+/**
+ * Number of seconds before an access token expires, after which it
+ * is no longer used. Leaves time for the server to verify the token
+ * before it expires.
+ */
+#define TOKEN_EXPIRY_MARGIN 60
+
+/**
+ * Number of seconds for which a username without a GOA account is
+ * remembered, so that clients retrying a wrong username do not cause
+ * repeated account lookups.
+ */
+#define TOKEN_UNKNOWN_USER_TTL 10
+
+/**
+ * Default number of seconds before an access token expires at which
+ * it is refreshed.
+ */
+#define TOKEN_REFRESH_MARGIN 300
+
+/**
+ * Start refreshing access tokens in the background, and fetch the
+ * tokens of all OAuth2 GOA accounts.
+ *
+ * Once a token has been obtained for an account, a new token is
+ * requested, on the GOA thread, @a margin seconds before the token
+ * expires. The cached client response is thus replaced before it
+ * expires, and logins do not wait for the token to be refreshed.
+ *
+ * @param margin Number of seconds before a token expires at which it
+ *   is refreshed.
+ *
+ * @return True if successful, false if the GOA thread is not running.
+ */
+bool tokens_start(size_t margin);
+
+/**
+ * Request for a client response, made with token_request().
+ */
+struct token_request;
+
+/**
+ * Callback receiving the client response requested with
+ * token_request().
+ *
+ * @param response Base64 encoded client response, NULL if there was
+ *   an error. Only valid until the callback returns.
+ * @param error    goa_error constant, if @a response is NULL.
+ * @param data     Data pointer passed to token_request().
+ */
+typedef void (*token_cb)(const char *response, goa_error error, void *data);
+
+/**
+ * Request the XOAUTH2 client response authenticating a user with the
+ * user's GOA account.
+ *
+ * The responses are cached, by username, for the lifetime of the
+ * access token from which they were generated. If a cached response
+ * has not expired, it is used without a request to the GOA thread.
+ * Usernames without an account are also cached, briefly. Otherwise
+ * the account is looked up, and an access token requested, on the GOA
+ * thread. Requests for a user made while a lookup for the user is in
+ * progress wait for its result, rather than looking the account up
+ * again. The token is then refreshed in the background if
+ * tokens_start() was called.
+ *
+ * The calling thread is not blocked. @a cb is always called by the
+ * event loop @a loop, after this function returns, unless the request
+ * is cancelled.
+ *
+ * @param loop Event loop on which @a cb is called
+ * @param user Username, identifying the account
+ * @param cb   Callback receiving the client response
+ * @param data Data pointer passed to @a cb
+ *
+ * @return The request, which is freed after @a cb is called.
+ */
+struct token_request *token_request(struct event_loop *loop, const char *user, token_cb cb, void *data);
+
+/**
+ * Cancel a request, so that its callback is not called.
+ *
+ * Must be called on the request's event loop, before its callback is
+ * called.
+ *
+ * @param req The request
+ */
+void token_request_cancel(struct token_request *req);
+
+#endif /* OAPROXY_TOKENS_H */
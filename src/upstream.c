@@ -0,0 +1,642 @@
+#define _GNU_SOURCE
+
+#include "upstream.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/eventfd.h>
+
+#include <openssl/pem.h>
+
+#include "xmalloc.h"
+#include "ssl.h"
+
+/**
+ * Time, in seconds, for which resolved addresses are used before they
+ * are refreshed. The resolver does not report record TTLs, thus a
+ * fixed time is used.
+ */
+#define ADDR_TTL 60
+
+/**
+ * Time, in seconds, after a failed resolution before retrying.
+ */
+#define ADDR_RETRY 5
+
+/**
+ * Minimum time, in seconds, between writes of the session file. New
+ * sessions are received on every connection, while the file only
+ * needs a recent one.
+ */
+#define SESSION_SAVE_INTERVAL 60
+
+/**
+ * OpenSSL new session callback. Adds the session to the upstream's
+ * session cache.
+ *
+ * @param ssl     SSL connection.
+ * @param session The new session.
+ *
+ * @return 1, indicating the reference to the session was taken.
+ */
+static int new_session_cb(SSL *ssl, SSL_SESSION *session);
+
+/**
+ * Check whether a TLS session can still be resumed.
+ *
+ * @param session The session.
+ *
+ * @return True if the session is resumable and has not expired.
+ */
+static bool session_valid(const SSL_SESSION *session);
+
+/**
+ * Write a TLS session to a session file.
+ *
+ * The file is replaced atomically and is only readable by the owner.
+ *
+ * @param path    Path to the session file.
+ * @param session The session.
+ */
+static void save_session(const char *path, SSL_SESSION *session);
+
+/**
+ * Load the TLS session stored in the upstream's session file.
+ *
+ * @param upstream The upstream.
+ *
+ * @return The session, NULL if there is no valid stored session.
+ */
+static SSL_SESSION *load_session(struct upstream *upstream);
+
+/**
+ * Resolve the upstream's host name and store the addresses in the
+ * address cache.
+ *
+ * On failure, the previously cached addresses are kept until the
+ * next retry.
+ *
+ * @param upstream The upstream.
+ *
+ * @return True if the host was resolved.
+ */
+static bool resolve(struct upstream *upstream);
+
+/**
+ * Start the thread resolving the upstream's host name.
+ *
+ * Must be called after setting the resolving flag.
+ *
+ * @param upstream The upstream.
+ */
+static void start_resolve(struct upstream *upstream);
+
+/**
+ * Signal and remove all descriptors waiting for the upstream's host
+ * to be resolved.
+ *
+ * Must be called with the upstream's lock held.
+ *
+ * @param upstream The upstream.
+ */
+static void notify_waiters(struct upstream *upstream);
+
+/**
+ * Thread start routine which resolves an upstream's host name.
+ *
+ * @param upstream The upstream. The reference held by the thread is
+ *   released when done.
+ *
+ * @return NULL
+ */
+static void *resolve_thread(void *upstream);
+
+/**
+ * Find an address in the upstream's address cache.
+ *
+ * Must be called with the upstream's lock held.
+ *
+ * @param upstream The upstream.
+ * @param addr     Address to find.
+ *
+ * @return Pointer to the cached address, NULL if not in the cache.
+ */
+static struct upstream_addr *find_addr(struct upstream *upstream, const struct upstream_addr *addr);
+
+/**
+ * Return the current time from a monotonic clock, in seconds.
+ */
+static time_t now(void);
+
+
+/* Implementation */
+
+struct upstream *upstream_create(const char *host) {
+    SSL_CTX *ctx = ssl_client_ctx_create();
+    if (!ctx) return NULL;
+
+    struct upstream *upstream = xmalloc(sizeof(struct upstream));
+
+    upstream->host = strdup(host);
+    upstream->name = upstream_host_name(host);
+    upstream->port = upstream_host_port(host);
+    upstream->ctx = ctx;
+
+    pthread_mutex_init(&upstream->lock, NULL);
+
+    upstream->n_sessions = 0;
+    upstream->session_file = NULL;
+    upstream->save_time = 0;
+    upstream->saving = false;
+
+    upstream->n_addrs = 0;
+    upstream->addrs_expiry = 0;
+    upstream->resolving = false;
+    upstream->waiters = NULL;
+
+    atomic_init(&upstream->refs, 1);
+
+    // Sessions are stored in the upstream rather than OpenSSL's
+    // internal cache, which does not offer them on new connections.
+
+    SSL_CTX_set_app_data(ctx, upstream);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+
+    return upstream;
+}
+
+struct upstream *upstream_ref(struct upstream *upstream) {
+    atomic_fetch_add(&upstream->refs, 1);
+    return upstream;
+}
+
+void upstream_unref(struct upstream *upstream) {
+    assert(atomic_load(&upstream->refs) > 0);
+
+    if (atomic_fetch_sub(&upstream->refs, 1) == 1) {
+        for (size_t i = 0; i < upstream->n_sessions; ++i) {
+            SSL_SESSION_free(upstream->sessions[i]);
+        }
+
+        pthread_mutex_destroy(&upstream->lock);
+        SSL_CTX_free(upstream->ctx);
+
+        free(upstream->session_file);
+        free(upstream->port);
+        free(upstream->name);
+        free(upstream->host);
+        free(upstream);
+    }
+}
+
+char *upstream_host_name(const char *host) {
+    const char *end = host[0] == '[' ? strchr(host, ']') : NULL;
+    size_t n;
+
+    if (end) {
+        host++;
+        n = end - host;
+    }
+    else {
+        end = strrchr(host, ':');
+        n = end ? end - host : strlen(host);
+    }
+
+    char *name = xmalloc(n + 1);
+    memcpy(name, host, n);
+    name[n] = 0;
+
+    return name;
+}
+
+char *upstream_host_port(const char *host) {
+    const char *sep = strrchr(host, ':');
+
+    if (!sep || strchr(sep, ']') || !sep[1])
+        return NULL;
+
+    return strdup(sep + 1);
+}
+
+
+/* Session Cache */
+
+SSL_SESSION *upstream_get_session(struct upstream *upstream) {
+    SSL_SESSION *session = NULL;
+
+    pthread_mutex_lock(&upstream->lock);
+
+    while (upstream->n_sessions && !session) {
+        // Take most recent session
+        size_t last = upstream->n_sessions - 1;
+        session = upstream->sessions[last];
+
+        if (!session_valid(session)) {
+            SSL_SESSION_free(session);
+            session = NULL;
+
+            upstream->n_sessions--;
+        }
+        else if (SSL_SESSION_get_protocol_version(session) >= TLS1_3_VERSION) {
+            upstream->n_sessions--;
+        }
+        else {
+            SSL_SESSION_up_ref(session);
+        }
+    }
+
+    pthread_mutex_unlock(&upstream->lock);
+
+    return session;
+}
+
+void upstream_add_session(struct upstream *upstream, SSL_SESSION *session) {
+    pthread_mutex_lock(&upstream->lock);
+
+    if (upstream->n_sessions == UPSTREAM_MAX_SESSIONS) {
+        SSL_SESSION_free(upstream->sessions[0]);
+
+        memmove(upstream->sessions, upstream->sessions + 1,
+                (UPSTREAM_MAX_SESSIONS - 1) * sizeof(SSL_SESSION *));
+
+        upstream->n_sessions--;
+    }
+
+    upstream->sessions[upstream->n_sessions++] = session;
+
+    char *path = NULL;
+
+    if (upstream->session_file && !upstream->saving && now() >= upstream->save_time) {
+        size_t len = strlen(upstream->session_file) + 1;
+
+        path = xmalloc(len);
+        memcpy(path, upstream->session_file, len);
+
+        SSL_SESSION_up_ref(session);
+
+        upstream->saving = true;
+        upstream->save_time = now() + SESSION_SAVE_INTERVAL;
+    }
+
+    pthread_mutex_unlock(&upstream->lock);
+
+    if (path) {
+        save_session(path, session);
+
+        SSL_SESSION_free(session);
+        free(path);
+
+        pthread_mutex_lock(&upstream->lock);
+        upstream->saving = false;
+        pthread_mutex_unlock(&upstream->lock);
+    }
+}
+
+int new_session_cb(SSL *ssl, SSL_SESSION *session) {
+    struct upstream *upstream = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+
+    if (!SSL_SESSION_is_resumable(session))
+        return 0;
+
+    upstream_add_session(upstream, session);
+    return 1;
+}
+
+bool session_valid(const SSL_SESSION *session) {
+    if (!SSL_SESSION_is_resumable(session))
+        return false;
+
+    time_t expires = SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session);
+    return time(NULL) < expires;
+}
+
+
+/* Persistence */
+
+bool upstream_set_session_dir(struct upstream *upstream, const char *dir) {
+    char *path;
+
+    if (asprintf(&path, "%s/%s.pem", dir, upstream->host) == -1) {
+        syslog(LOG_ERR, "asprintf error (formatting session file path): %m");
+        return false;
+    }
+
+    // Replace separators which may not appear in file names
+    for (char *c = path + strlen(dir) + 1; *c; ++c) {
+        if (*c == '/' || *c == ':') *c = '_';
+    }
+
+    pthread_mutex_lock(&upstream->lock);
+
+    free(upstream->session_file);
+    upstream->session_file = path;
+
+    SSL_SESSION *session = load_session(upstream);
+
+    pthread_mutex_unlock(&upstream->lock);
+
+    if (session) {
+        upstream_add_session(upstream, session);
+    }
+
+    return true;
+}
+
+SSL_SESSION *load_session(struct upstream *upstream) {
+    FILE *f = fopen(upstream->session_file, "r");
+
+    if (!f) {
+        if (errno != ENOENT)
+            syslog(LOG_WARNING, "Error opening TLS session file '%s': %m", upstream->session_file);
+
+        return NULL;
+    }
+
+    SSL_SESSION *session = PEM_read_SSL_SESSION(f, NULL, NULL, NULL);
+    fclose(f);
+
+    if (session && !session_valid(session)) {
+        SSL_SESSION_free(session);
+        return NULL;
+    }
+
+    return session;
+}
+
+void save_session(const char *path, SSL_SESSION *session) {
+    char *tmp;
+
+    if (asprintf(&tmp, "%s.tmp", path) == -1) {
+        syslog(LOG_ERR, "asprintf error (formatting session file path): %m");
+        return;
+    }
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    if (fd < 0) {
+        syslog(LOG_WARNING, "Error creating TLS session file '%s': %m", tmp);
+        goto free_tmp;
+    }
+
+    FILE *f = fdopen(fd, "w");
+
+    if (!f) {
+        close(fd);
+        goto remove_tmp;
+    }
+
+    bool ok = PEM_write_SSL_SESSION(f, session);
+
+    if (fclose(f) || !ok) {
+        syslog(LOG_WARNING, "Error writing TLS session file '%s'", tmp);
+        goto remove_tmp;
+    }
+
+    if (rename(tmp, path)) {
+        syslog(LOG_WARNING, "Error replacing TLS session file '%s': %m", path);
+        goto remove_tmp;
+    }
+
+    goto free_tmp;
+
+remove_tmp:
+    unlink(tmp);
+
+free_tmp:
+    free(tmp);
+}
+
+
+/* Address Resolution */
+
+void upstream_resolve(struct upstream *upstream) {
+    pthread_mutex_lock(&upstream->lock);
+
+    bool start = !upstream->resolving;
+    upstream->resolving = true;
+
+    pthread_mutex_unlock(&upstream->lock);
+
+    if (start)
+        start_resolve(upstream);
+}
+
+void start_resolve(struct upstream *upstream) {
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    upstream_ref(upstream);
+
+    int err = pthread_create(&thread, &attr, resolve_thread, upstream);
+    pthread_attr_destroy(&attr);
+
+    if (err) {
+        syslog(LOG_ERR, "Error creating resolver thread: %s", strerror(err));
+
+        pthread_mutex_lock(&upstream->lock);
+
+        upstream->resolving = false;
+        notify_waiters(upstream);
+
+        pthread_mutex_unlock(&upstream->lock);
+
+        upstream_unref(upstream);
+    }
+}
+
+size_t upstream_get_addrs(struct upstream *upstream, struct upstream_addr *addrs, size_t n, int notify) {
+    pthread_mutex_lock(&upstream->lock);
+
+    // A failed resolution also sets the expiry time, after which it
+    // is retried
+    bool start = !upstream->resolving && now() >= upstream->addrs_expiry;
+
+    if (start)
+        upstream->resolving = true;
+
+    if (!upstream->n_addrs && notify >= 0) {
+        if (upstream->resolving) {
+            struct upstream_waiter *waiter = xmalloc(sizeof(struct upstream_waiter));
+
+            waiter->fd = notify;
+            waiter->next = upstream->waiters;
+            upstream->waiters = waiter;
+        }
+        else {
+            eventfd_write(notify, 1);
+        }
+    }
+
+    if (n > upstream->n_addrs)
+        n = upstream->n_addrs;
+
+    memcpy(addrs, upstream->addrs, n * sizeof(struct upstream_addr));
+
+    pthread_mutex_unlock(&upstream->lock);
+
+    if (start)
+        start_resolve(upstream);
+
+    return n;
+}
+
+void upstream_cancel_notify(struct upstream *upstream, int notify) {
+    pthread_mutex_lock(&upstream->lock);
+
+    struct upstream_waiter **next = &upstream->waiters;
+
+    while (*next) {
+        struct upstream_waiter *waiter = *next;
+
+        if (waiter->fd == notify) {
+            *next = waiter->next;
+            free(waiter);
+        }
+        else {
+            next = &waiter->next;
+        }
+    }
+
+    pthread_mutex_unlock(&upstream->lock);
+}
+
+void notify_waiters(struct upstream *upstream) {
+    while (upstream->waiters) {
+        struct upstream_waiter *waiter = upstream->waiters;
+
+        eventfd_write(waiter->fd, 1);
+
+        upstream->waiters = waiter->next;
+        free(waiter);
+    }
+}
+
+void *resolve_thread(void *obj) {
+    struct upstream *upstream = obj;
+
+    resolve(upstream);
+
+    pthread_mutex_lock(&upstream->lock);
+
+    upstream->resolving = false;
+    notify_waiters(upstream);
+
+    pthread_mutex_unlock(&upstream->lock);
+
+    upstream_unref(upstream);
+    return NULL;
+}
+
+bool resolve(struct upstream *upstream) {
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_ADDRCONFIG
+    };
+
+    struct addrinfo *result;
+    int err = getaddrinfo(upstream->name, upstream->port, &hints, &result);
+
+    if (err) {
+        syslog(LOG_ERR, "Error resolving host %s: %s", upstream->host, gai_strerror(err));
+
+        pthread_mutex_lock(&upstream->lock);
+        upstream->addrs_expiry = now() + ADDR_RETRY;
+        pthread_mutex_unlock(&upstream->lock);
+
+        return false;
+    }
+
+    struct upstream_addr addrs[UPSTREAM_MAX_ADDRS];
+    size_t n = 0;
+
+    for (struct addrinfo *ai = result; ai && n < UPSTREAM_MAX_ADDRS; ai = ai->ai_next) {
+        if (ai->ai_addrlen > sizeof(struct sockaddr_storage))
+            continue;
+
+        struct upstream_addr *addr = &addrs[n++];
+
+        memset(addr, 0, sizeof(struct upstream_addr));
+
+        addr->family = ai->ai_family;
+        addr->len = ai->ai_addrlen;
+        memcpy(&addr->addr, ai->ai_addr, ai->ai_addrlen);
+    }
+
+    pthread_mutex_lock(&upstream->lock);
+
+    // Keep the connection statistics of addresses which are still
+    // returned by the resolver
+
+    for (size_t i = 0; i < n; ++i) {
+        struct upstream_addr *old = find_addr(upstream, &addrs[i]);
+
+        if (old) {
+            addrs[i].rtt = old->rtt;
+            addrs[i].failures = old->failures;
+        }
+    }
+
+    memcpy(upstream->addrs, addrs, n * sizeof(struct upstream_addr));
+
+    upstream->n_addrs = n;
+    upstream->addrs_expiry = now() + ADDR_TTL;
+
+    pthread_mutex_unlock(&upstream->lock);
+
+    freeaddrinfo(result);
+    return true;
+}
+
+void upstream_report_addr(struct upstream *upstream, const struct upstream_addr *addr, long rtt) {
+    pthread_mutex_lock(&upstream->lock);
+
+    struct upstream_addr *cached = find_addr(upstream, addr);
+
+    if (cached) {
+        if (rtt < 0) {
+            cached->failures++;
+        }
+        else {
+            cached->rtt = cached->rtt ? (3 * cached->rtt + rtt) / 4 : rtt;
+            cached->failures = 0;
+
+            // 0 is reserved for addresses which were never connected to
+            if (!cached->rtt)
+                cached->rtt = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&upstream->lock);
+}
+
+struct upstream_addr *find_addr(struct upstream *upstream, const struct upstream_addr *addr) {
+    for (size_t i = 0; i < upstream->n_addrs; ++i) {
+        struct upstream_addr *cached = &upstream->addrs[i];
+
+        if (cached->len == addr->len && !memcmp(&cached->addr, &addr->addr, addr->len))
+            return cached;
+    }
+
+    return NULL;
+}
+
+time_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec;
+}
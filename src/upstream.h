@@ -0,0 +1,269 @@
+#ifndef OAPROXY_UPSTREAM_H
+#define OAPROXY_UPSTREAM_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/socket.h>
+
+#include <openssl/ssl.h>
+
+/**
+ * Maximum number of resumable TLS sessions cached per upstream.
+ */
+#define UPSTREAM_MAX_SESSIONS 8
+
+/**
+ * Maximum number of resolved addresses cached per upstream.
+ */
+#define UPSTREAM_MAX_ADDRS 8
+
+/**
+ * Resolved address of an upstream server
+ */
+struct upstream_addr {
+    /** Address family */
+    int family;
+    /** Socket address, including the port */
+    struct sockaddr_storage addr;
+    /** Length of the socket address */
+    socklen_t len;
+
+    /**
+     * Smoothed time, in milliseconds, taken to connect to the
+     * address. 0 if no connection was made to the address.
+     */
+    unsigned rtt;
+    /** Number of consecutive failed connection attempts */
+    unsigned failures;
+};
+
+/**
+ * Descriptor notified once an upstream's host has been resolved.
+ */
+struct upstream_waiter {
+    /** Eventfd file descriptor */
+    int fd;
+    /** Next waiter */
+    struct upstream_waiter *next;
+};
+
+/**
+ * Remote server to which client connections are proxied.
+ *
+ * Holds the state shared by all connections to the server. Each
+ * session holds a reference to the upstream for as long as it is
+ * connected, thus an upstream may outlive the configuration from
+ * which it was created.
+ */
+struct upstream {
+    /** Server host of the form host:port */
+    char *host;
+
+    /**
+     * Server host name without the port, used for SNI and
+     * certificate verification.
+     */
+    char *name;
+
+    /** Server port or service name, NULL if not given */
+    char *port;
+
+    /** TLS context shared by all connections to the server */
+    SSL_CTX *ctx;
+
+    /** Lock protecting the session and address caches */
+    pthread_mutex_t lock;
+
+    /** Resumable TLS sessions, oldest first */
+    SSL_SESSION *sessions[UPSTREAM_MAX_SESSIONS];
+    /** Number of cached sessions */
+    size_t n_sessions;
+
+    /**
+     * Path to the file in which the most recent session is
+     * persisted. NULL if sessions are not persisted.
+     */
+    char *session_file;
+    /** Monotonic time, in seconds, before which no session is persisted */
+    time_t save_time;
+    /** True while a session is being written to the session file */
+    bool saving;
+
+    /** Resolved server addresses, in the order returned by the resolver */
+    struct upstream_addr addrs[UPSTREAM_MAX_ADDRS];
+    /** Number of resolved addresses */
+    size_t n_addrs;
+
+    /** Monotonic time, in seconds, after which the addresses are refreshed */
+    time_t addrs_expiry;
+    /** True while the addresses are being resolved in the background */
+    bool resolving;
+    /**
+     * Descriptors notified once the addresses being resolved are
+     * stored, or the resolution fails.
+     */
+    struct upstream_waiter *waiters;
+
+    /** Reference count */
+    atomic_uint refs;
+};
+
+/**
+ * Create an upstream server.
+ *
+ * @param host Server host of the form host:port.
+ *
+ * @return The upstream, with a reference count of 1. NULL if the TLS
+ *   context could not be created.
+ */
+struct upstream *upstream_create(const char *host);
+
+/**
+ * Extract the host name from a host:port string.
+ *
+ * IPv6 addresses enclosed in brackets are returned without the
+ * brackets.
+ *
+ * @param host Host of the form host:port.
+ *
+ * @return The host name, allocated with xmalloc.
+ */
+char *upstream_host_name(const char *host);
+
+/**
+ * Extract the port from a host:port string.
+ *
+ * @param host Host of the form host:port.
+ *
+ * @return The port, allocated with malloc. NULL if @a host does not
+ *   contain a port.
+ */
+char *upstream_host_port(const char *host);
+
+/**
+ * Increment the reference count of an upstream.
+ *
+ * @param upstream The upstream.
+ *
+ * @return @a upstream
+ */
+struct upstream *upstream_ref(struct upstream *upstream);
+
+/**
+ * Decrement the reference count of an upstream, freeing it when the
+ * count reaches zero.
+ *
+ * @param upstream The upstream.
+ */
+void upstream_unref(struct upstream *upstream);
+
+/**
+ * Take a resumable TLS session from the upstream's session cache.
+ *
+ * TLS 1.3 sessions are removed from the cache, since tickets should
+ * only be used once. Older sessions remain in the cache.
+ *
+ * Thread safe.
+ *
+ * @param upstream The upstream.
+ *
+ * @return The session, which the caller must free with
+ *   SSL_SESSION_free(). NULL if there are no cached sessions.
+ */
+SSL_SESSION *upstream_get_session(struct upstream *upstream);
+
+/**
+ * Add a resumable TLS session to the upstream's session cache.
+ *
+ * The oldest session is evicted when the cache is full. If a session
+ * file was set, the session is also written to the file, at most once
+ * every few seconds. The file is written without holding the
+ * upstream's lock.
+ *
+ * Thread safe.
+ *
+ * @param upstream The upstream.
+ * @param session  The session. The cache takes ownership of the
+ *   reference.
+ */
+void upstream_add_session(struct upstream *upstream, SSL_SESSION *session);
+
+/**
+ * Persist the upstream's TLS sessions in a directory, so that they
+ * survive restarts.
+ *
+ * The session previously stored in the directory, if any and not
+ * expired, is loaded into the session cache.
+ *
+ * @param upstream The upstream.
+ * @param dir      Path to the directory.
+ *
+ * @return True if successful.
+ */
+bool upstream_set_session_dir(struct upstream *upstream, const char *dir);
+
+/**
+ * Resolve the upstream's host name in the background, unless it is
+ * already being resolved.
+ *
+ * The addresses are stored in the upstream's address cache, replacing
+ * the cached addresses once the resolution completes.
+ *
+ * Thread safe.
+ *
+ * @param upstream The upstream.
+ */
+void upstream_resolve(struct upstream *upstream);
+
+/**
+ * Retrieve the upstream's cached addresses.
+ *
+ * If the cached addresses have expired, they are still returned and
+ * are refreshed in the background. The host is never resolved on the
+ * calling thread. If no addresses are cached, the resolution is only
+ * retried once the previous failed resolution has expired.
+ *
+ * Thread safe.
+ *
+ * @param upstream The upstream.
+ * @param addrs    Array receiving the addresses.
+ * @param n        Size of @a addrs.
+ * @param notify   Eventfd, or -1. If no addresses are cached, it is
+ *   signalled once the host has been resolved in the background, or
+ *   immediately if it is not being resolved. It must be removed with
+ *   upstream_cancel_notify() if it is closed before then.
+ *
+ * @return Number of addresses copied to @a addrs, 0 if there are no
+ *   cached addresses.
+ */
+size_t upstream_get_addrs(struct upstream *upstream, struct upstream_addr *addrs, size_t n, int notify);
+
+/**
+ * Stop notifying a descriptor passed to upstream_get_addrs(), which
+ * has not been signalled yet.
+ *
+ * Thread safe.
+ *
+ * @param upstream The upstream.
+ * @param notify   Eventfd.
+ */
+void upstream_cancel_notify(struct upstream *upstream, int notify);
+
+/**
+ * Record the outcome of a connection attempt to one of the
+ * upstream's addresses, used to order future attempts.
+ *
+ * Thread safe.
+ *
+ * @param upstream The upstream.
+ * @param addr     The address, as returned by upstream_get_addrs().
+ * @param rtt      Time, in milliseconds, taken to connect. Negative if
+ *   the connection attempt failed.
+ */
+void upstream_report_addr(struct upstream *upstream, const struct upstream_addr *addr, long rtt);
+
+#endif /* OAPROXY_UPSTREAM_H */
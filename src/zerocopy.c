@@ -0,0 +1,236 @@
+#include "zerocopy.h"
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#include "xmalloc.h"
+
+/**
+ * Minimum number of bytes sent with MSG_ZEROCOPY. Setting up a
+ * zero-copy send costs more than copying smaller amounts of data.
+ */
+#define ZEROCOPY_MIN_SIZE (16 * 1024)
+
+/**
+ * Create a block for the data in a buffer, taking ownership of the
+ * buffer's memory. The buffer is left empty.
+ *
+ * @param zc  Zero-copy state.
+ * @param buf Buffer.
+ *
+ * @return The block.
+ */
+static struct zerocopy_block *new_block(struct zerocopy *zc, struct buffer *buf);
+
+/**
+ * Free the blocks of which all data has been sent and all sends have
+ * completed.
+ *
+ * @param zc Zero-copy state.
+ */
+static void free_completed(struct zerocopy *zc);
+
+/**
+ * Handle a notification read from the socket's error queue.
+ *
+ * @param zc  Zero-copy state.
+ * @param msg Message read from the error queue.
+ *
+ * @return True if the message is a completion notification.
+ */
+static bool handle_notification(struct zerocopy *zc, struct msghdr *msg);
+
+
+/* Implementation */
+
+void zerocopy_init(struct zerocopy *zc, int fd) {
+    zc->fd = fd;
+    zc->enabled = false;
+
+    zc->seq = zc->done = 0;
+    zc->blocks = zc->last = NULL;
+}
+
+bool zerocopy_enable(struct zerocopy *zc) {
+#ifdef SO_ZEROCOPY
+    int one = 1;
+
+    if (!setsockopt(zc->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)))
+        zc->enabled = true;
+#endif
+
+    return zc->enabled;
+}
+
+void zerocopy_free(struct zerocopy *zc) {
+    if (zerocopy_busy(zc))
+        zerocopy_complete(zc);
+
+    if (zerocopy_busy(zc)) {
+        struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+        setsockopt(zc->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    }
+
+    while (zc->blocks) {
+        struct zerocopy_block *block = zc->blocks;
+        zc->blocks = block->next;
+
+        buffer_free(&block->data);
+        free(block);
+    }
+
+    zc->last = NULL;
+}
+
+ssize_t zerocopy_send(struct zerocopy *zc, struct buffer *buf, int flags) {
+    struct zerocopy_block *block = zc->last;
+
+    if (!zerocopy_pending(zc)) {
+        if (!zc->enabled || buffer_len(buf) < ZEROCOPY_MIN_SIZE) {
+            ssize_t n = send(zc->fd, buffer_data(buf), buffer_len(buf), flags | MSG_NOSIGNAL);
+
+            if (n > 0)
+                buffer_consume(buf, n);
+
+            return n;
+        }
+
+        block = new_block(zc, buf);
+    }
+
+    flags |= MSG_NOSIGNAL;
+
+    if (zc->enabled)
+        flags |= MSG_ZEROCOPY;
+
+    ssize_t n = send(zc->fd, buffer_data(&block->data), buffer_len(&block->data), flags);
+
+    // The memory used to track zero-copy sends is limited, copy the
+    // data when it is exhausted.
+    if (n < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+        flags &= ~MSG_ZEROCOPY;
+        n = send(zc->fd, buffer_data(&block->data), buffer_len(&block->data), flags);
+    }
+
+    if (n > 0) {
+        buffer_consume(&block->data, n);
+
+        if (flags & MSG_ZEROCOPY)
+            block->seq = zc->seq++;
+    }
+
+    return n;
+}
+
+size_t zerocopy_pending(const struct zerocopy *zc) {
+    return zc->last ? buffer_len(&zc->last->data) : 0;
+}
+
+bool zerocopy_busy(const struct zerocopy *zc) {
+    return zc->blocks != NULL;
+}
+
+bool zerocopy_complete(struct zerocopy *zc) {
+    bool ok = true;
+
+    while (true) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 2];
+
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control)
+        };
+
+        if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                ok = false;
+
+            break;
+        }
+
+        if (!handle_notification(zc, &msg))
+            ok = false;
+    }
+
+    free_completed(zc);
+
+    // Errors which are not queued, such as a reset connection
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(zc->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err)
+        ok = false;
+
+    return ok;
+}
+
+struct zerocopy_block *new_block(struct zerocopy *zc, struct buffer *buf) {
+    struct zerocopy_block *block = xmalloc(sizeof(struct zerocopy_block));
+
+    block->data = *buf;
+    buffer_init(buf);
+
+    // Until data is sent with MSG_ZEROCOPY, the block only waits for
+    // the preceding sends to complete.
+    block->seq = zc->seq - 1;
+    block->next = NULL;
+
+    if (zc->last)
+        zc->last->next = block;
+    else
+        zc->blocks = block;
+
+    zc->last = block;
+    return block;
+}
+
+void free_completed(struct zerocopy *zc) {
+    // Sequence numbers wrap around, thus are compared by their
+    // difference.
+    while (zc->blocks && !buffer_len(&zc->blocks->data) &&
+           (int32_t)(zc->done - zc->blocks->seq) > 0) {
+
+        struct zerocopy_block *block = zc->blocks;
+        zc->blocks = block->next;
+
+        if (zc->last == block)
+            zc->last = NULL;
+
+        buffer_free(&block->data);
+        free(block);
+    }
+}
+
+bool handle_notification(struct zerocopy *zc, struct msghdr *msg) {
+    bool completion = false;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+            !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+            continue;
+
+        struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+
+        if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno)
+            continue;
+
+        // Notifications report the range of completed sends, from
+        // ee_info to ee_data, in order.
+        zc->done = err->ee_data + 1;
+        completion = true;
+
+        // The kernel copied the data, zero-copy sends have no benefit
+        // on this connection.
+        if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            zc->enabled = false;
+    }
+
+    return completion;
+}
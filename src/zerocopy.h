@@ -0,0 +1,138 @@
+#ifndef OAPROXY_ZEROCOPY_H
+#define OAPROXY_ZEROCOPY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <unistd.h>
+
+#include "buffer.h"
+
+/**
+ * Data sent to a socket with MSG_ZEROCOPY.
+ *
+ * The kernel references the memory of the data, rather than copying
+ * it, until it notifies the completion of the send. Thus the memory
+ * is kept until then.
+ */
+struct zerocopy_block {
+    /** Data, of which the pending bytes have not been sent yet */
+    struct buffer data;
+
+    /**
+     * Sequence number of the last zero-copy send of the data. The
+     * block is freed once this send has completed.
+     */
+    uint32_t seq;
+
+    /** Next block, sent after this block */
+    struct zerocopy_block *next;
+};
+
+/**
+ * Zero-copy sends to a socket.
+ *
+ * Large amounts of data are sent with MSG_ZEROCOPY. The completions
+ * of the sends are reported by the kernel on the socket's error
+ * queue, which makes the socket report EPOLLERR, and are handled by
+ * zerocopy_complete().
+ */
+struct zerocopy {
+    /** Socket descriptor */
+    int fd;
+    /** True if MSG_ZEROCOPY is used for large sends */
+    bool enabled;
+
+    /** Sequence number which the kernel assigns to the next send */
+    uint32_t seq;
+    /** Sequence number following the last completed send */
+    uint32_t done;
+
+    /** Blocks which have not completed, oldest first */
+    struct zerocopy_block *blocks;
+    /** Last block, which is sent before any other data */
+    struct zerocopy_block *last;
+};
+
+/**
+ * Initialize the zero-copy state of a socket. Zero-copy sends are
+ * disabled until zerocopy_enable() is called.
+ *
+ * @param zc Zero-copy state.
+ * @param fd Socket descriptor.
+ */
+void zerocopy_init(struct zerocopy *zc, int fd);
+
+/**
+ * Enable zero-copy sends on the socket.
+ *
+ * @param zc Zero-copy state.
+ *
+ * @return True if successful, false if the socket does not support
+ *   zero-copy sends.
+ */
+bool zerocopy_enable(struct zerocopy *zc);
+
+/**
+ * Free the blocks of the sends which have not completed.
+ *
+ * Since the memory may be reused once freed, any data still
+ * referenced by the kernel is discarded, by resetting the connection
+ * when the socket is closed. Must be called before the socket is
+ * closed.
+ *
+ * @param zc Zero-copy state.
+ */
+void zerocopy_free(struct zerocopy *zc);
+
+/**
+ * Send data to the socket.
+ *
+ * The remaining data of the last zero-copy send is sent first. If
+ * there is none, the data in @a buf is sent. If zero-copy sends are
+ * enabled and there is enough data, the buffer's memory is moved to a
+ * new block which is sent with MSG_ZEROCOPY, leaving @a buf empty.
+ * Otherwise the data is copied to the socket as usual and removed
+ * from @a buf.
+ *
+ * @param zc    Zero-copy state.
+ * @param buf   Data to send.
+ * @param flags Additional send() flags, such as MSG_MORE.
+ *
+ * @return Number of bytes sent, -1 on error. If the socket would
+ *   block, -1 is returned with errno set to EAGAIN.
+ */
+ssize_t zerocopy_send(struct zerocopy *zc, struct buffer *buf, int flags);
+
+/**
+ * Return the number of bytes of the last zero-copy send which have
+ * not been sent yet.
+ *
+ * @param zc Zero-copy state.
+ *
+ * @return Number of bytes.
+ */
+size_t zerocopy_pending(const struct zerocopy *zc);
+
+/**
+ * Check whether there are zero-copy sends which have not completed.
+ *
+ * @param zc Zero-copy state.
+ *
+ * @return True if there are sends which have not completed.
+ */
+bool zerocopy_busy(const struct zerocopy *zc);
+
+/**
+ * Handle the completion notifications on the socket's error queue,
+ * and free the blocks of the completed sends.
+ *
+ * @param zc Zero-copy state.
+ *
+ * @return True if successful, false if an error, other than the
+ *   notifications, occurred on the socket.
+ */
+bool zerocopy_complete(struct zerocopy *zc);
+
+#endif /* OAPROXY_ZEROCOPY_H */
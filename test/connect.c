@@ -0,0 +1,155 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <netinet/in.h>
+
+#include <cmocka.h>
+
+#include "connect.h"
+
+/* Helper Functions */
+
+/**
+ * Create an address with given connection statistics.
+ *
+ * @param family   Address family, AF_INET or AF_INET6.
+ * @param port     Port, used to identify the address.
+ * @param rtt      Smoothed connection time, 0 if never connected.
+ * @param failures Number of consecutive failed attempts.
+ *
+ * @return The address.
+ */
+static struct upstream_addr make_addr(int family, int port, unsigned rtt, unsigned failures) {
+    struct upstream_addr addr;
+    memset(&addr, 0, sizeof(addr));
+
+    addr.family = family;
+    addr.rtt = rtt;
+    addr.failures = failures;
+
+    if (family == AF_INET6) {
+        struct sockaddr_in6 *sa = (struct sockaddr_in6 *)&addr.addr;
+
+        sa->sin6_family = AF_INET6;
+        sa->sin6_port = htons(port);
+        addr.len = sizeof(struct sockaddr_in6);
+    }
+    else {
+        struct sockaddr_in *sa = (struct sockaddr_in *)&addr.addr;
+
+        sa->sin_family = AF_INET;
+        sa->sin_port = htons(port);
+        addr.len = sizeof(struct sockaddr_in);
+    }
+
+    return addr;
+}
+
+/**
+ * Return the port identifying an address created with make_addr().
+ */
+static int addr_port(const struct upstream_addr *addr) {
+    if (addr->family == AF_INET6)
+        return ntohs(((const struct sockaddr_in6 *)&addr->addr)->sin6_port);
+
+    return ntohs(((const struct sockaddr_in *)&addr->addr)->sin_port);
+}
+
+/**
+ * Check the order of addresses, by their ports.
+ *
+ * @param addrs Array of addresses.
+ * @param ports Expected ports, in order.
+ * @param n     Number of addresses.
+ */
+static void assert_order(const struct upstream_addr *addrs, const int *ports, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        assert_int_equal(addr_port(&addrs[i]), ports[i]);
+    }
+}
+
+
+/* Tests */
+
+static void test_order_empty(void ** state) {
+    struct upstream_addr addrs[1];
+
+    connect_order_addrs(addrs, 0);
+}
+
+static void test_order_untried(void ** state) {
+    // Resolver order is kept within a family
+    struct upstream_addr addrs[] = {
+        make_addr(AF_INET, 1, 0, 0),
+        make_addr(AF_INET, 2, 0, 0),
+        make_addr(AF_INET, 3, 0, 0)
+    };
+
+    const int exp[] = {1, 2, 3};
+
+    connect_order_addrs(addrs, 3);
+    assert_order(addrs, exp, 3);
+}
+
+static void test_order_alternate(void ** state) {
+    // Families alternate, starting with the family of the first address
+    struct upstream_addr addrs[] = {
+        make_addr(AF_INET6, 1, 0, 0),
+        make_addr(AF_INET6, 2, 0, 0),
+        make_addr(AF_INET, 3, 0, 0),
+        make_addr(AF_INET, 4, 0, 0),
+        make_addr(AF_INET6, 5, 0, 0)
+    };
+
+    const int exp[] = {1, 3, 2, 4, 5};
+
+    connect_order_addrs(addrs, 5);
+    assert_order(addrs, exp, 5);
+}
+
+static void test_order_rtt(void ** state) {
+    // Faster addresses first, then untried addresses
+    struct upstream_addr addrs[] = {
+        make_addr(AF_INET6, 1, 0, 0),
+        make_addr(AF_INET6, 2, 50, 0),
+        make_addr(AF_INET, 3, 10, 0),
+        make_addr(AF_INET, 4, 30, 0)
+    };
+
+    const int exp[] = {3, 2, 4, 1};
+
+    connect_order_addrs(addrs, 4);
+    assert_order(addrs, exp, 4);
+}
+
+static void test_order_failures(void ** state) {
+    // Addresses which failed last are tried after all others
+    struct upstream_addr addrs[] = {
+        make_addr(AF_INET6, 1, 5, 2),
+        make_addr(AF_INET6, 2, 0, 0),
+        make_addr(AF_INET, 3, 20, 0),
+        make_addr(AF_INET, 4, 8, 1)
+    };
+
+    const int exp[] = {3, 2, 4, 1};
+
+    connect_order_addrs(addrs, 4);
+    assert_order(addrs, exp, 4);
+}
+
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_order_empty),
+        cmocka_unit_test(test_order_untried),
+        cmocka_unit_test(test_order_alternate),
+        cmocka_unit_test(test_order_rtt),
+        cmocka_unit_test(test_order_failures)
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
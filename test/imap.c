@@ -18,6 +18,7 @@
 
 #include "xmalloc.h"
 #include "ssl.h"
+#include "upstream.h"
 #include "imap.h"
 
 #include "gaccounts.h"
@@ -35,26 +36,28 @@
  * If the host is equal to LOCAL_SERVER the mock return value is
  * returned.
  */
-BIO *__real_server_connect(const char *host);
-BIO *__wrap_server_connect(const char *host) {
-    if (!strcmp(host, LOCAL_SERVER)) {
+BIO *__real_server_connect(struct upstream *upstream);
+BIO *__wrap_server_connect(struct upstream *upstream) {
+    if (!strcmp(upstream->host, LOCAL_SERVER)) {
         return mock_ptr_type(BIO*);
     }
 
-    return __real_server_connect(host);
+    return __real_server_connect(upstream);
 }
 
-GList *__wrap_find_goaccount(GList *accounts, const char *user) {
+GoaObject *__wrap_find_goaccount(const char *user, goa_error *gerr) {
     if (!strcmp(user, USER1_ID)) {
-        return g_list_prepend(NULL, USER1_TOK);
+        return (GoaObject *)USER1_TOK;
     }
 
+    *gerr = ACCOUNT_ERROR_USER;
     return NULL;
 }
 
-gchar *__wrap_get_access_token(GList *account, goa_error *gerr) {
+void __wrap_request_access_token(GoaObject *account, access_token_cb cb, void *data) {
     assert(account);
-    return strdup(account->data);
+
+    cb((const gchar *)account, 3600, 0, data);
 }
 
 /* Server Process Routine */
@@ -651,6 +654,35 @@ static void test_login_cmd6(void ** state) {
     assert_int_equal(imap_exit_status(tstate), 0);
 }
 
+static void test_login_cmd7(void ** state) {
+    struct test_state *tstate = * state;
+
+    // Write initial server reply
+
+    test_proxy(tstate->s_fd_in, tstate->c_fd_in, "* OK imap ready for requests from localhost\r\n");
+
+    // Write LOGIN command with non-synchronizing literal, which
+    // should not be forwarded to the server
+
+    test_proxy2(tstate->c_fd_in, tstate->c_fd_in,
+                "a1 LOGIN user1@example.com {8+}\r\n"
+                "password\r\n",
+                "a1 BAD Literals not supported in LOGIN\r\n");
+
+    // Write logout command
+
+    test_proxy(tstate->c_fd_in, tstate->s_fd_in, "a2 logout\r\n");
+
+    // Write logout response
+
+    test_proxy(tstate->s_fd_in, tstate->c_fd_in,
+               "* BYE server terminating connection\r\n"
+               "a2 OK LOGOUT completed\r\n");
+
+    // Check exit status
+    assert_int_equal(imap_exit_status(tstate), 0);
+}
+
 
 /* Closing Socket */
 
@@ -778,6 +810,7 @@ int main(void) {
         imap_unit_test(test_login_cmd4),
         imap_unit_test(test_login_cmd5),
         imap_unit_test(test_login_cmd6),
+        imap_unit_test(test_login_cmd7),
         imap_unit_test(test_client_close1),
         imap_unit_test(test_client_close2),
         imap_unit_test(test_server_close1),
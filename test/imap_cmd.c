@@ -113,7 +113,7 @@ static void test_imap_cap(void ** state) {
 
     // Read command
     struct imap_cmd cmd;
-    ssize_t n = imap_cmd_next(tstate->stream, &cmd, true);
+    ssize_t n = imap_cmd_next(tstate->stream, &cmd);
 
     // Check return value and command type
     assert_int_equal(n, cmd_len);
@@ -145,7 +145,7 @@ static void test_imap_login1(void ** state) {
 
     // Read command
     struct imap_cmd cmd;
-    ssize_t n = imap_cmd_next(tstate->stream, &cmd, true);
+    ssize_t n = imap_cmd_next(tstate->stream, &cmd);
 
     // Check return value and command type
     assert_int_equal(n, cmd_len);
@@ -181,7 +181,7 @@ static void test_imap_login2(void ** state) {
 
     // Read command
     struct imap_cmd cmd;
-    ssize_t n = imap_cmd_next(tstate->stream, &cmd, true);
+    ssize_t n = imap_cmd_next(tstate->stream, &cmd);
 
     // Check return value and command type
     assert_int_equal(n, cmd_len);
@@ -220,7 +220,7 @@ static void test_cmd_multi1(void ** state) {
 
     // Read command
     struct imap_cmd cmd;
-    ssize_t n = imap_cmd_next(tstate->stream, &cmd, true);
+    ssize_t n = imap_cmd_next(tstate->stream, &cmd);
 
     // Check return value and command type
     assert_int_equal(n, exp_len);
@@ -252,8 +252,8 @@ static void test_cmd_multi2(void ** state) {
 
     // Read command
     struct imap_cmd cmd;
-    ssize_t n = imap_cmd_next(tstate->stream, &cmd, true);
-    n = imap_cmd_next(tstate->stream, &cmd, true);
+    ssize_t n = imap_cmd_next(tstate->stream, &cmd);
+    n = imap_cmd_next(tstate->stream, &cmd);
 
     // Check return value and command type
     assert_int_equal(n, exp_len);
@@ -285,7 +285,7 @@ static void test_cmd_malformed1(void ** state) {
 
     // Read command
     struct imap_cmd cmd;
-    ssize_t n = imap_cmd_next(tstate->stream, &cmd, true);
+    ssize_t n = imap_cmd_next(tstate->stream, &cmd);
 
     // Check return value and command type
     assert_int_equal(n, cmd_len);
@@ -319,7 +319,7 @@ static void test_cmd_malformed2(void ** state) {
 
     // Read command
     struct imap_cmd cmd;
-    ssize_t n = imap_cmd_next(tstate->stream, &cmd, true);
+    ssize_t n = imap_cmd_next(tstate->stream, &cmd);
 
     // Check return value and command type
     assert_int_equal(n, cmd_len);
@@ -357,6 +357,285 @@ static void test_parse_string3(void ** state) {
     assert_string_equal(imap_parse_string(str, strlen(str)), exp);
 }
 
+static void test_parse_string4(void ** state) {
+    const char *str = "{8}";
+
+    assert_null(imap_parse_string(str, strlen(str)));
+}
+
+
+/* Literals */
+
+static void test_cmd_literal1(void ** state) {
+    struct test_state *tstate = *state;
+
+    const char *str_cmd = "a001 APPEND INBOX {13+}\r\n"
+        "b LOGIN x y\r\n"
+        "\r\n"
+        "a002 NOOP\r\n";
+
+    const char *exp_cmd1 = "a001 APPEND INBOX {13+}\r\n";
+    const char *exp_data = "b LOGIN x y\r\n";
+    const char *exp_cont = "\r\n";
+    const char *exp_cmd2 = "a002 NOOP\r\n";
+
+    // Write APPEND command with non-synchronizing literal
+    assert_write(tstate->c_fd, str_cmd);
+
+    // Read command line
+    struct imap_cmd cmd;
+    ssize_t n = imap_cmd_next(tstate->stream, &cmd);
+
+    assert_int_equal(n, strlen(exp_cmd1));
+    assert_int_equal(cmd.command, IMAP_CMD);
+    assert_string_equal(cmd.line, exp_cmd1);
+
+    // Read literal data, which should not be parsed as a command
+    n = imap_cmd_next(tstate->stream, &cmd);
+
+    assert_int_equal(n, strlen(exp_data));
+    assert_int_equal(cmd.command, IMAP_CMD_LITERAL);
+    assert_string_equal(cmd.line, exp_data);
+
+    // Read the end of the command line
+    n = imap_cmd_next(tstate->stream, &cmd);
+
+    assert_int_equal(n, strlen(exp_cont));
+    assert_int_equal(cmd.command, IMAP_CMD_CONTINUATION);
+
+    // Read next command
+    n = imap_cmd_next(tstate->stream, &cmd);
+
+    assert_int_equal(n, strlen(exp_cmd2));
+    assert_int_equal(cmd.command, IMAP_CMD);
+    assert_string_equal(cmd.line, exp_cmd2);
+}
+
+static void test_cmd_literal2(void ** state) {
+    struct test_state *tstate = *state;
+
+    const char *str_cmd = "a001 APPEND INBOX {13}\r\n";
+    const char *str_data = "b LOGIN x y\r\n";
+
+    // Write APPEND command with synchronizing literal
+    assert_write(tstate->c_fd, str_cmd);
+
+    // Read command line
+    struct imap_cmd cmd;
+    ssize_t n = imap_cmd_next(tstate->stream, &cmd);
+
+    assert_int_equal(n, strlen(str_cmd));
+    assert_int_equal(cmd.command, IMAP_CMD);
+
+    // Continuation reply sent to client
+    imap_cmd_literal_accept(tstate->stream);
+
+    // Write literal data
+    assert_write(tstate->c_fd, str_data);
+
+    n = imap_cmd_next(tstate->stream, &cmd);
+
+    assert_int_equal(n, strlen(str_data));
+    assert_int_equal(cmd.command, IMAP_CMD_LITERAL);
+    assert_string_equal(cmd.line, str_data);
+}
+
+static void test_cmd_literal3(void ** state) {
+    struct test_state *tstate = *state;
+
+    const char *str_cmd = "a001 APPEND INBOX {13}\r\n";
+    const char *str_next = "b LOGIN x y\r\n";
+
+    // Write APPEND command with synchronizing literal
+    assert_write(tstate->c_fd, str_cmd);
+
+    // Read command line
+    struct imap_cmd cmd;
+    ssize_t n = imap_cmd_next(tstate->stream, &cmd);
+
+    assert_int_equal(n, strlen(str_cmd));
+    assert_int_equal(cmd.command, IMAP_CMD);
+
+    // Command rejected by server, literal data is not sent
+    imap_cmd_literal_reject(tstate->stream, "a001", 4);
+    imap_cmd_literal_accept(tstate->stream);
+
+    // Write next command
+    assert_write(tstate->c_fd, str_next);
+
+    n = imap_cmd_next(tstate->stream, &cmd);
+
+    assert_int_equal(n, strlen(str_next));
+    assert_int_equal(cmd.command, IMAP_CMD_LOGIN);
+    assert_string_equal(cmd.line, str_next);
+}
+
+static void test_cmd_literal4(void ** state) {
+    struct test_state *tstate = *state;
+
+    const char *str_cmd = "a001 APPEND INBOX {5+}\r\n"
+        "hello"
+        " b LOGIN x y\r\n"
+        "a002 NOOP\r\n";
+
+    const char *exp_data = "hello";
+    const char *exp_cont = " b LOGIN x y\r\n";
+    const char *exp_cmd2 = "a002 NOOP\r\n";
+
+    assert_write(tstate->c_fd, str_cmd);
+
+    // Read command line
+    struct imap_cmd cmd;
+    ssize_t n = imap_cmd_next(tstate->stream, &cmd);
+
+    assert_int_equal(cmd.command, IMAP_CMD);
+    assert_true(cmd.literal);
+
+    // Read literal data
+    n = imap_cmd_next(tstate->stream, &cmd);
+
+    assert_int_equal(n, strlen(exp_data));
+    assert_int_equal(cmd.command, IMAP_CMD_LITERAL);
+
+    // Read the rest of the command line, which should not be parsed
+    n = imap_cmd_next(tstate->stream, &cmd);
+
+    assert_int_equal(n, strlen(exp_cont));
+    assert_int_equal(cmd.command, IMAP_CMD_CONTINUATION);
+    assert_string_equal(cmd.line, exp_cont);
+
+    // Read next command
+    n = imap_cmd_next(tstate->stream, &cmd);
+
+    assert_int_equal(n, strlen(exp_cmd2));
+    assert_int_equal(cmd.command, IMAP_CMD);
+    assert_string_equal(cmd.line, exp_cmd2);
+}
+
+static void test_cmd_literal5(void ** state) {
+    struct test_state *tstate = *state;
+
+    const char *str_cmd = "a001 APPEND INBOX {0}\r\n";
+    const char *str_cont = "b LOGIN x y\r\n";
+
+    assert_write(tstate->c_fd, str_cmd);
+
+    // Read command line, with an empty synchronizing literal
+    struct imap_cmd cmd;
+    imap_cmd_next(tstate->stream, &cmd);
+
+    assert_int_equal(cmd.command, IMAP_CMD);
+    assert_true(cmd.literal);
+
+    imap_cmd_literal_accept(tstate->stream);
+
+    // Read the rest of the command line
+    assert_write(tstate->c_fd, str_cont);
+
+    ssize_t n = imap_cmd_next(tstate->stream, &cmd);
+
+    assert_int_equal(n, strlen(str_cont));
+    assert_int_equal(cmd.command, IMAP_CMD_CONTINUATION);
+}
+
+static void test_cmd_literal6(void ** state) {
+    struct test_state *tstate = *state;
+
+    const char *str_cmd = "a001 NOOP\r\na002 APPEND INBOX {13}\r\n";
+    const char *str_data = "b LOGIN x y\r\n";
+
+    // Write NOOP pipelined with APPEND with synchronizing literal
+    assert_write(tstate->c_fd, str_cmd);
+
+    struct imap_cmd cmd;
+
+    imap_cmd_next(tstate->stream, &cmd);
+    assert_int_equal(cmd.command, IMAP_CMD);
+
+    imap_cmd_next(tstate->stream, &cmd);
+    assert_int_equal(cmd.command, IMAP_CMD);
+    assert_true(cmd.literal);
+
+    // Reply to NOOP does not end APPEND
+    imap_cmd_literal_reject(tstate->stream, "a001", 4);
+    imap_cmd_literal_accept(tstate->stream);
+
+    assert_write(tstate->c_fd, str_data);
+
+    ssize_t n = imap_cmd_next(tstate->stream, &cmd);
+
+    assert_int_equal(n, strlen(str_data));
+    assert_int_equal(cmd.command, IMAP_CMD_LITERAL);
+    assert_string_equal(cmd.line, str_data);
+}
+
+static void test_cmd_login_literal1(void ** state) {
+    struct test_state *tstate = *state;
+
+    const char *str_cmd = "a001 LOGIN user {8+}\r\n"
+        "password\r\n"
+        "a002 NOOP\r\n";
+
+    const char *exp_cmd2 = "a002 NOOP\r\n";
+
+    assert_write(tstate->c_fd, str_cmd);
+
+    // Read LOGIN command
+    struct imap_cmd cmd;
+    imap_cmd_next(tstate->stream, &cmd);
+
+    assert_int_equal(cmd.command, IMAP_CMD_LOGIN);
+    assert_true(cmd.literal);
+
+    // The literal, and the rest of the command line, are discarded
+    ssize_t n = imap_cmd_next(tstate->stream, &cmd);
+
+    assert_int_equal(n, strlen(exp_cmd2));
+    assert_int_equal(cmd.command, IMAP_CMD);
+    assert_string_equal(cmd.line, exp_cmd2);
+}
+
+static void test_cmd_login_literal2(void ** state) {
+    struct test_state *tstate = *state;
+
+    const char *str_cmd = "a001 LOGIN {4}\r\n";
+    const char *str_next = "a002 NOOP\r\n";
+
+    assert_write(tstate->c_fd, str_cmd);
+
+    // Read LOGIN command with synchronizing literal
+    struct imap_cmd cmd;
+    imap_cmd_next(tstate->stream, &cmd);
+
+    assert_int_equal(cmd.command, IMAP_CMD_LOGIN);
+    assert_true(cmd.literal);
+
+    // Command rejected, literal data is not sent
+    imap_cmd_literal_reject(tstate->stream, "a001", 4);
+
+    assert_write(tstate->c_fd, str_next);
+
+    ssize_t n = imap_cmd_next(tstate->stream, &cmd);
+
+    assert_int_equal(n, strlen(str_next));
+    assert_int_equal(cmd.command, IMAP_CMD);
+    assert_string_equal(cmd.line, str_next);
+}
+
+static void test_cmd_empty_tag(void ** state) {
+    struct test_state *tstate = *state;
+
+    const char *str_cmd = " LOGIN x y\r\n";
+
+    assert_write(tstate->c_fd, str_cmd);
+
+    struct imap_cmd cmd;
+    ssize_t n = imap_cmd_next(tstate->stream, &cmd);
+
+    assert_int_equal(n, strlen(str_cmd));
+    assert_int_equal(cmd.command, IMAP_CMD);
+}
+
 
 int main(void) {
     const struct CMUnitTest tests[] = {
@@ -370,9 +649,20 @@ int main(void) {
         imap_cmd_unit_test(test_cmd_malformed1),
         imap_cmd_unit_test(test_cmd_malformed2),
 
+        imap_cmd_unit_test(test_cmd_literal1),
+        imap_cmd_unit_test(test_cmd_literal2),
+        imap_cmd_unit_test(test_cmd_literal3),
+        imap_cmd_unit_test(test_cmd_literal4),
+        imap_cmd_unit_test(test_cmd_literal5),
+        imap_cmd_unit_test(test_cmd_literal6),
+        imap_cmd_unit_test(test_cmd_login_literal1),
+        imap_cmd_unit_test(test_cmd_login_literal2),
+        imap_cmd_unit_test(test_cmd_empty_tag),
+
         cmocka_unit_test(test_parse_string1),
         cmocka_unit_test(test_parse_string2),
-        cmocka_unit_test(test_parse_string3)
+        cmocka_unit_test(test_parse_string3),
+        cmocka_unit_test(test_parse_string4)
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);
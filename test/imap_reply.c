@@ -129,7 +129,7 @@ static void test_reply_untagged(void ** state) {
 
     // Read reply
     struct imap_reply reply;
-    ssize_t n = imap_reply_next(tstate->stream, &reply, true);
+    ssize_t n = imap_reply_next(tstate->stream, &reply);
 
     // Check length
     assert_int_equal(n, reply_len);
@@ -162,7 +162,7 @@ static void test_reply_tagged(void ** state) {
 
     // Read reply
     struct imap_reply reply;
-    ssize_t n = imap_reply_next(tstate->stream, &reply, true);
+    ssize_t n = imap_reply_next(tstate->stream, &reply);
 
     // Check length
     assert_int_equal(n, reply_len);
@@ -192,7 +192,7 @@ static void test_reply_cont(void ** state) {
 
     // Read reply
     struct imap_reply reply;
-    ssize_t n = imap_reply_next(tstate->stream, &reply, true);
+    ssize_t n = imap_reply_next(tstate->stream, &reply);
 
     // Check length
     assert_int_equal(n, reply_len);
@@ -228,7 +228,7 @@ static void test_reply_multi1(void ** state) {
 
     // Read reply
     struct imap_reply reply;
-    ssize_t n = imap_reply_next(tstate->stream, &reply, true);
+    ssize_t n = imap_reply_next(tstate->stream, &reply);
 
     // Check length
     assert_int_equal(n, exp_len);
@@ -264,8 +264,8 @@ static void test_reply_multi2(void ** state) {
 
     // Read reply
     struct imap_reply reply;
-    ssize_t n = imap_reply_next(tstate->stream, &reply, true);
-    n = imap_reply_next(tstate->stream, &reply, true);
+    ssize_t n = imap_reply_next(tstate->stream, &reply);
+    n = imap_reply_next(tstate->stream, &reply);
 
     // Check length
     assert_int_equal(n, exp_len);
@@ -301,7 +301,7 @@ static void test_reply_capability1(void ** state) {
 
     // Read reply
     struct imap_reply reply;
-    ssize_t n = imap_reply_next(tstate->stream, &reply, true);
+    ssize_t n = imap_reply_next(tstate->stream, &reply);
 
     // Check length
     assert_int_equal(n, reply_len);
@@ -338,7 +338,7 @@ static void test_reply_capability2(void ** state) {
 
     // Read reply
     struct imap_reply reply;
-    ssize_t n = imap_reply_next(tstate->stream, &reply, true);
+    ssize_t n = imap_reply_next(tstate->stream, &reply);
 
     // Check length
     assert_int_equal(n, reply_len);
@@ -375,7 +375,7 @@ static void test_reply_malformed1(void ** state) {
 
     // Read reply
     struct imap_reply reply;
-    ssize_t n = imap_reply_next(tstate->stream, &reply, true);
+    ssize_t n = imap_reply_next(tstate->stream, &reply);
 
     // Check length
     assert_int_equal(n, reply_len);
@@ -409,7 +409,7 @@ static void test_reply_malformed2(void ** state) {
 
     // Read reply
     struct imap_reply reply;
-    ssize_t n = imap_reply_next(tstate->stream, &reply, true);
+    ssize_t n = imap_reply_next(tstate->stream, &reply);
 
     // Check length
     assert_int_equal(n, reply_len);
@@ -439,7 +439,7 @@ static void test_reply_malformed3(void ** state) {
 
     // Read reply
     struct imap_reply reply;
-    ssize_t n = imap_reply_next(tstate->stream, &reply, true);
+    ssize_t n = imap_reply_next(tstate->stream, &reply);
 
     // Check length
     assert_int_equal(n, reply_len);
@@ -459,6 +459,90 @@ static void test_reply_malformed3(void ** state) {
 }
 
 
+/* Literals */
+
+static void test_reply_literal(void ** state) {
+    struct test_state *tstate = *state;
+
+    const char *str_reply = "* 1 FETCH (BODY[] {11}\r\n"
+        "a OK done\r\n"
+        ")\r\n";
+
+    const char *exp_reply = "* 1 FETCH (BODY[] {11}\r\n";
+    const char *exp_data = "a OK done\r\n";
+    const char *exp_end = ")\r\n";
+
+    // Write reply
+    assert_write(tstate->s_fd, str_reply);
+
+    // Read reply line
+    struct imap_reply reply;
+    ssize_t n = imap_reply_next(tstate->stream, &reply);
+
+    assert_int_equal(n, strlen(exp_reply));
+    assert_int_equal(reply.type, IMAP_REPLY_UNTAGGED);
+    assert_string_equal(reply.line, exp_reply);
+
+    // Read literal data, which should not be parsed as a reply
+    n = imap_reply_next(tstate->stream, &reply);
+
+    assert_int_equal(n, strlen(exp_data));
+    assert_int_equal(reply.code, IMAP_REPLY);
+    assert_int_equal(reply.type, IMAP_REPLY_LITERAL);
+    assert_string_equal(reply.line, exp_data);
+
+    // Read remainder of reply, which is not a new reply
+    n = imap_reply_next(tstate->stream, &reply);
+
+    assert_int_equal(n, strlen(exp_end));
+    assert_int_equal(reply.type, IMAP_REPLY_CONTINUATION);
+    assert_string_equal(reply.line, exp_end);
+}
+
+static void test_reply_literal2(void ** state) {
+    struct test_state *tstate = *state;
+
+    const char *str_reply = "* 1 FETCH (BODY[1] {2}\r\n"
+        "ab"
+        " BODY[2] {0}\r\n"
+        "+ ok\r\n"
+        "a OK done\r\n";
+
+    const char *exp_cont1 = " BODY[2] {0}\r\n";
+    const char *exp_cont2 = "+ ok\r\n";
+    const char *exp_tagged = "a OK done\r\n";
+
+    assert_write(tstate->s_fd, str_reply);
+
+    struct imap_reply reply;
+
+    imap_reply_next(tstate->stream, &reply);
+    assert_int_equal(reply.type, IMAP_REPLY_UNTAGGED);
+
+    imap_reply_next(tstate->stream, &reply);
+    assert_int_equal(reply.type, IMAP_REPLY_LITERAL);
+
+    // Continuation line announcing an empty literal
+    ssize_t n = imap_reply_next(tstate->stream, &reply);
+
+    assert_int_equal(n, strlen(exp_cont1));
+    assert_int_equal(reply.type, IMAP_REPLY_CONTINUATION);
+
+    // Not a continuation request
+    n = imap_reply_next(tstate->stream, &reply);
+
+    assert_int_equal(n, strlen(exp_cont2));
+    assert_int_equal(reply.type, IMAP_REPLY_CONTINUATION);
+
+    // Next reply
+    n = imap_reply_next(tstate->stream, &reply);
+
+    assert_int_equal(n, strlen(exp_tagged));
+    assert_int_equal(reply.type, IMAP_REPLY_TAGGED);
+    assert_int_equal(reply.tag_len, 1);
+}
+
+
 /* Main Function */
 
 int main(void) {
@@ -476,6 +560,9 @@ int main(void) {
         imap_reply_unit_test(test_reply_malformed1),
         imap_reply_unit_test(test_reply_malformed2),
         imap_reply_unit_test(test_reply_malformed3),
+
+        imap_reply_unit_test(test_reply_literal),
+        imap_reply_unit_test(test_reply_literal2),
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);
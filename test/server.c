@@ -34,6 +34,18 @@ int __wrap_listen(int sockfd, int backlog) {
     return 0;
 }
 
+/**
+ * Number of sockets on which SO_REUSEPORT was set
+ */
+static int reuseport_socks = 0;
+
+int __wrap_setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen) {
+    if (level == SOL_SOCKET && optname == SO_REUSEPORT)
+        reuseport_socks++;
+
+    return 0;
+}
+
 
 /* Test Functions */
 
@@ -50,6 +62,9 @@ void test_simple_conf(void ** state) {
     assert_non_null(servers);
     assert_int_equal(n, 4);
 
+    // REUSEPORT not enabled
+    assert_int_equal(reuseport_socks, 0);
+
     // First server
 
     assert_int_equal(servers[0].type, TYPE_SMTP); // Server type
@@ -91,6 +106,12 @@ void test_malformed_conf1(void ** state) {
     assert_int_equal(servers[0].type, TYPE_SMTP); // Server type
     assert_int_equal(servers[0].port, 3000); // Port
     assert_string_equal(servers[0].host, "smtp.example.com:465");
+
+    // Upstream server
+
+    assert_non_null(servers[0].upstream);
+    assert_string_equal(servers[0].upstream->host, "smtp.example.com:465");
+    assert_string_equal(servers[0].upstream->name, "smtp.example.com");
 }
 
 void test_malformed_conf2(void ** state) {
@@ -144,6 +165,49 @@ void test_socket_fail(void ** state) {
     assert_string_equal(servers[2].host, "smtp.mail.com:100");
 }
 
+void test_options_conf(void ** state) {
+    will_return(__wrap_socket, TEST_SOCK_FD);
+
+    // Parse config file test5.conf
+    size_t n = 0;
+    struct proxy_server *servers = parse_servers(CONF_TEST_DIR "test5.conf", &n);
+
+    assert_non_null(servers);
+    assert_int_equal(n, 1);
+
+    assert_int_equal(servers[0].type, TYPE_SMTP); // Server type
+    assert_int_equal(servers[0].port, 3000); // Port
+    assert_string_equal(servers[0].host, "smtp.example.com:465");
+
+    // Options, invalid values ignored, 0 accepted where valid
+
+    assert_int_equal(proxy_options.workers, 3);
+    assert_int_equal(proxy_options.queue_limit, 64);
+    assert_true(proxy_options.reuseport);
+    assert_string_equal(proxy_options.session_dir, "/nonexistent/oaproxy");
+    assert_int_equal(proxy_options.pool_size, 4);
+    assert_int_equal(proxy_options.handshake_threads, 0);
+    assert_int_equal(proxy_options.token_refresh, 600);
+}
+
+void test_reuseport_conf(void ** state) {
+    will_return(__wrap_socket, TEST_SOCK_FD);
+
+    reuseport_socks = 0;
+    proxy_options.reuseport = false;
+
+    // Parse config file test6.conf, which enables REUSEPORT after the
+    // server line
+    size_t n = 0;
+    struct proxy_server *servers = parse_servers(CONF_TEST_DIR "test6.conf", &n);
+
+    assert_non_null(servers);
+    assert_int_equal(n, 1);
+
+    assert_true(proxy_options.reuseport);
+    assert_int_equal(reuseport_socks, 1);
+}
+
 /* Main Function */
 
 int main(void) {
@@ -152,7 +216,9 @@ int main(void) {
         cmocka_unit_test(test_malformed_conf1),
         cmocka_unit_test(test_malformed_conf2),
         cmocka_unit_test(test_empty_conf),
-        cmocka_unit_test(test_socket_fail)
+        cmocka_unit_test(test_socket_fail),
+        cmocka_unit_test(test_options_conf),
+        cmocka_unit_test(test_reuseport_conf)
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);
@@ -19,6 +19,7 @@
 
 #include "xmalloc.h"
 #include "ssl.h"
+#include "upstream.h"
 #include "smtp.h"
 
 #include "gaccounts.h"
@@ -36,26 +37,28 @@
  * If the host is equal to LOCAL_SERVER the mock return value is
  * returned.
  */
-BIO *__real_server_connect(const char *host);
-BIO *__wrap_server_connect(const char *host) {
-    if (!strcmp(host, LOCAL_SERVER)) {
+BIO *__real_server_connect(struct upstream *upstream);
+BIO *__wrap_server_connect(struct upstream *upstream) {
+    if (!strcmp(upstream->host, LOCAL_SERVER)) {
         return mock_ptr_type(BIO*);
     }
 
-    return __real_server_connect(host);
+    return __real_server_connect(upstream);
 }
 
-GList *__wrap_find_goaccount(GList *accounts, const char *user) {
+GoaObject *__wrap_find_goaccount(const char *user, goa_error *gerr) {
     if (!strcmp(user, USER1_ID)) {
-        return g_list_prepend(NULL, USER1_TOK);
+        return (GoaObject *)USER1_TOK;
     }
 
+    *gerr = ACCOUNT_ERROR_USER;
     return NULL;
 }
 
-gchar *__wrap_get_access_token(GList *account, goa_error *gerr) {
+void __wrap_request_access_token(GoaObject *account, access_token_cb cb, void *data) {
     assert(account);
-    return strdup(account->data);
+
+    cb((const gchar *)account, 3600, 0, data);
 }
 
 /* Server Process Routine */
@@ -756,6 +759,33 @@ static void test_data2(void ** state) {
     assert_int_equal(smtp_exit_status(tstate), 0);
 }
 
+static void test_auth_relay(void ** state) {
+    struct test_state *tstate = *state;
+
+    // Write initial server reply
+    test_proxy(tstate->s_fd_in, tstate->c_fd_in, "220 smtp.example.com ESMTP\r\n");
+
+    // Write auth command
+
+    // Credentials: \0user1@example.com\0
+
+    test_proxy2(tstate->c_fd_in, tstate->s_fd_in,
+                "AUTH PLAIN AHVzZXIxQGV4YW1wbGUuY29tAA==\r\n",
+                "AUTH XOAUTH2 dXNlcj11c2VyMUBleGFtcGxlLmNvbQFhdXRoPUJlYXJlciB0b2t1c2VyMWFiYwEB\r\n");
+
+    // Write server response, followed by data in the same write
+    test_proxy(tstate->s_fd_in, tstate->c_fd_in, "235 Accepted\r\n250-AUTH LOGIN");
+
+    // Write remaining data which should not be modified, since the
+    // client has authenticated.
+    test_proxy(tstate->s_fd_in, tstate->c_fd_in, " XOAUTH2\r\n");
+
+    test_proxy(tstate->c_fd_in, tstate->s_fd_in, "AUTH PLAIN AHVzZXIxQGV4YW1wbGUuY29tAA==\r\n");
+
+    // Check exit status
+    assert_int_equal(smtp_exit_status(tstate), 0);
+}
+
 
 /* Closing Socket */
 
@@ -879,6 +909,7 @@ int main(void)
 
         smtp_cmd_unit_test(test_data1),
         smtp_cmd_unit_test(test_data2),
+        smtp_cmd_unit_test(test_auth_relay),
 
         smtp_cmd_unit_test(test_client_close1),
         smtp_cmd_unit_test(test_client_close2),
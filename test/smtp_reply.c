@@ -22,6 +22,9 @@ struct test_state {
     // Server side socket
     int s_fd;
 
+    // Client side BIO
+    BIO *c_bio;
+
     // SMTP Command Stream
     struct smtp_reply_stream *stream;
 };
@@ -39,14 +42,14 @@ static int smtp_test_setup(void ** state) {
 
     // Create client side BIO
 
-    BIO *c_bio = BIO_new_socket(sv[1], true);
+    tstate->c_bio = BIO_new_socket(sv[1], true);
 
-    if (!c_bio) {
+    if (!tstate->c_bio) {
         close(sv[1]);
         goto close_s_fd;
     }
 
-    tstate->stream = smtp_reply_stream_create(c_bio);
+    tstate->stream = smtp_reply_stream_create(tstate->c_bio);
     if (!tstate->stream) {
         goto close_bio;
     }
@@ -55,7 +58,7 @@ static int smtp_test_setup(void ** state) {
     return 0;
 
 close_bio:
-    BIO_free_all(c_bio);
+    BIO_free_all(tstate->c_bio);
 
 close_s_fd:
     close(tstate->s_fd);
@@ -67,6 +70,7 @@ static int smtp_test_teardown(void ** state) {
     struct test_state *tstate = *state;
 
     smtp_reply_stream_free(tstate->stream);
+    BIO_free_all(tstate->c_bio);
 
     if (tstate->s_fd >= 0) close(tstate->s_fd);
 
@@ -204,6 +208,47 @@ static void test_reply_multi2(void ** state) {
     assert_true(reply.last);
 }
 
+/* Long Replies */
+
+static void test_reply_long(void ** state) {
+    struct test_state *tstate = *state;
+
+    // Write a reply line longer than the initial buffer size,
+    // followed by another reply line
+    size_t line_len = 40000;
+    char *str_reply = xmalloc(line_len + 9);
+
+    memcpy(str_reply, "250 ", 4);
+    memset(str_reply + 4, 'x', line_len - 6);
+    memcpy(str_reply + line_len - 2, "\r\n250 OK\r\n", 11);
+
+    size_t reply_len = strlen(str_reply);
+
+    if (write(tstate->s_fd, str_reply, reply_len) < reply_len) {
+        fail_msg("Error writing reply to socket");
+    }
+
+    // Read long reply, which should not be split
+    struct smtp_reply reply;
+    ssize_t n = smtp_reply_next(tstate->stream, &reply);
+
+    assert_int_equal(n, line_len);
+    assert_int_equal(reply.data_len, line_len - 2);
+    assert_memory_equal(reply.data, str_reply, line_len);
+
+    assert_true(smtp_reply_parse(&reply));
+    assert_int_equal(reply.code, 250);
+    assert_true(reply.last);
+
+    // Read following reply
+    n = smtp_reply_next(tstate->stream, &reply);
+
+    assert_int_equal(n, 8);
+    assert_string_equal(reply.data, "250 OK\r\n");
+
+    free(str_reply);
+}
+
 /* AUTH Replies */
 
 static void test_reply_auth1(void ** state) {
@@ -498,6 +543,7 @@ int main(void) {
         smtp_reply_unit_test(test_reply_server_id),
         smtp_reply_unit_test(test_reply_multi1),
         smtp_reply_unit_test(test_reply_multi2),
+        smtp_reply_unit_test(test_reply_long),
         smtp_reply_unit_test(test_reply_auth1),
         smtp_reply_unit_test(test_reply_auth2),
         smtp_reply_unit_test(test_reply_auth3),
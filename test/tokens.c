@@ -0,0 +1,296 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <cmocka.h>
+
+#include "tokens.h"
+#include "xoauth2.h"
+
+/* Mocked Functions */
+
+/**
+ * Wrapped find_goaccount function.
+ *
+ * Returns the mock account, which is the account's token.
+ */
+GoaObject *__wrap_find_goaccount(const char *user, goa_error *gerr) {
+    GoaObject *account = mock_ptr_type(GoaObject*);
+
+    if (!account)
+        *gerr = ACCOUNT_ERROR_USER;
+
+    return account;
+}
+
+/**
+ * Pending mock access token request.
+ */
+struct mock_token {
+    /** Token, NULL if an error is returned */
+    const gchar *token;
+    /** Number of seconds for which the token is valid */
+    int expiry;
+
+    /** Callback receiving the token */
+    access_token_cb cb;
+    /** Data passed to the callback */
+    void *data;
+};
+
+/**
+ * Call the callback of a pending mock token request, and free it.
+ *
+ * @param data The mock_token
+ *
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean complete_token(gpointer data) {
+    struct mock_token *mock = data;
+
+    if (mock->token)
+        mock->cb(mock->token, mock->expiry, 0, mock->data);
+    else
+        mock->cb(NULL, 0, ACCOUNT_ERROR_CRED, mock->data);
+
+    free(mock);
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * Wrapped request_access_token function.
+ *
+ * Calls the callback on the next iteration of the calling thread's
+ * main context, like the asynchronous GOA calls, with the account as
+ * the token, which expires after the mock number of seconds. If the
+ * mock value is negative, an error is returned.
+ */
+void __wrap_request_access_token(GoaObject *account, access_token_cb cb, void *data) {
+    struct mock_token *mock = malloc(sizeof(struct mock_token));
+    assert_non_null(mock);
+
+    mock->expiry = mock_type(int);
+    mock->token = mock->expiry < 0 ? NULL : (const gchar *)account;
+    mock->cb = cb;
+    mock->data = data;
+
+    GSource *source = g_idle_source_new();
+    g_source_set_callback(source, complete_token, mock, NULL);
+    g_source_attach(source, g_main_context_get_thread_default());
+    g_source_unref(source);
+}
+
+/* Helpers */
+
+/**
+ * Result of a token request.
+ */
+struct result {
+    /** True if the callback was called */
+    bool called;
+
+    /** Copy of the response */
+    char *response;
+    /** Error */
+    goa_error error;
+};
+
+/**
+ * Token request callback, which stores the result.
+ */
+static void store_result(const char *response, goa_error error, void *data) {
+    struct result *result = data;
+
+    result->called = true;
+    result->response = response ? strdup(response) : NULL;
+    result->error = error;
+}
+
+/**
+ * Request the client response of a user and wait for the request to
+ * complete.
+ *
+ * @param user Username
+ * @param gerr Receives the error
+ *
+ * @return The response, NULL on error.
+ */
+static char *request_response(const char *user, goa_error *gerr) {
+    struct event_loop *loop = event_loop_create();
+    assert_non_null(loop);
+
+    struct result result = { .called = false };
+
+    assert_non_null(token_request(loop, user, store_result, &result));
+
+    // Not completed before token_request returns
+    assert_false(result.called);
+
+    event_loop_run(loop, true);
+    event_loop_free(loop);
+
+    assert_true(result.called);
+
+    *gerr = result.error;
+    return result.response;
+}
+
+/* Tests */
+
+static void test_response_cached(void **state) {
+    const char *user = "user1@example.com";
+    const char *token = "tokuser1abc";
+
+    char *exp = xoauth2_make_client_response(user, token);
+    goa_error gerr = 0;
+
+    will_return(__wrap_find_goaccount, token);
+    will_return(__wrap_request_access_token, 3600);
+
+    char *resp1 = request_response(user, &gerr);
+    assert_non_null(resp1);
+    assert_string_equal(resp1, exp);
+
+    // Served from the cache, without a second token request
+    char *resp2 = request_response(user, &gerr);
+    assert_non_null(resp2);
+    assert_string_equal(resp2, exp);
+
+    free(resp1);
+    free(resp2);
+    free(exp);
+}
+
+static void test_response_unknown_expiry(void **state) {
+    const char *user = "user2@example.com";
+    const char *token = "tokuser2abc";
+
+    char *exp = xoauth2_make_client_response(user, token);
+    goa_error gerr = 0;
+
+    for (int i = 0; i < 2; ++i) {
+        will_return(__wrap_find_goaccount, token);
+        will_return(__wrap_request_access_token, 0);
+
+        char *resp = request_response(user, &gerr);
+
+        assert_non_null(resp);
+        assert_string_equal(resp, exp);
+
+        free(resp);
+    }
+
+    free(exp);
+}
+
+static void test_response_error(void **state) {
+    const char *user = "user3@example.com";
+    const char *token = "tokuser3abc";
+
+    goa_error gerr = 0;
+
+    will_return(__wrap_find_goaccount, token);
+    will_return(__wrap_request_access_token, -1);
+
+    assert_null(request_response(user, &gerr));
+    assert_int_equal(gerr, ACCOUNT_ERROR_CRED);
+
+    // Errors are not cached
+    will_return(__wrap_find_goaccount, token);
+    will_return(__wrap_request_access_token, 3600);
+
+    char *resp = request_response(user, &gerr);
+    assert_non_null(resp);
+
+    free(resp);
+}
+
+static void test_response_unknown_user(void **state) {
+    goa_error gerr = 0;
+
+    will_return(__wrap_find_goaccount, NULL);
+
+    assert_null(request_response("unknown@example.com", &gerr));
+    assert_int_equal(gerr, ACCOUNT_ERROR_USER);
+
+    // Answered from the cache, without a second lookup
+    gerr = 0;
+
+    assert_null(request_response("unknown@example.com", &gerr));
+    assert_int_equal(gerr, ACCOUNT_ERROR_USER);
+}
+
+static void test_request_cancel(void **state) {
+    const char *user = "user4@example.com";
+    const char *token = "tokuser4abc";
+
+    struct event_loop *loop = event_loop_create();
+    assert_non_null(loop);
+
+    struct result result = { .called = false };
+
+    will_return(__wrap_find_goaccount, token);
+    will_return(__wrap_request_access_token, 3600);
+
+    struct token_request *req = token_request(loop, user, store_result, &result);
+    assert_non_null(req);
+
+    token_request_cancel(req);
+
+    // Returns once the request has completed
+    event_loop_run(loop, true);
+    event_loop_free(loop);
+
+    assert_false(result.called);
+}
+
+static void test_request_coalesced(void **state) {
+    const char *user = "user5@example.com";
+    const char *token = "tokuser5abc";
+
+    char *exp = xoauth2_make_client_response(user, token);
+
+    struct event_loop *loop = event_loop_create();
+    assert_non_null(loop);
+
+    struct result result1 = { .called = false };
+    struct result result2 = { .called = false };
+
+    // A single lookup and token request for both requests
+    will_return(__wrap_find_goaccount, token);
+    will_return(__wrap_request_access_token, 3600);
+
+    assert_non_null(token_request(loop, user, store_result, &result1));
+    assert_non_null(token_request(loop, user, store_result, &result2));
+
+    event_loop_run(loop, true);
+    event_loop_free(loop);
+
+    assert_true(result1.called);
+    assert_non_null(result1.response);
+    assert_string_equal(result1.response, exp);
+
+    assert_true(result2.called);
+    assert_non_null(result2.response);
+    assert_string_equal(result2.response, exp);
+
+    free(result1.response);
+    free(result2.response);
+    free(exp);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_response_cached),
+        cmocka_unit_test(test_response_unknown_expiry),
+        cmocka_unit_test(test_response_error),
+        cmocka_unit_test(test_response_unknown_user),
+        cmocka_unit_test(test_request_cancel),
+        cmocka_unit_test(test_request_coalesced)
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,80 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <cmocka.h>
+
+#include "upstream.h"
+
+/* Test Macros */
+
+/**
+ * Check the host name and port parsed from a host string.
+ *
+ * @param host Host string of the form host:port.
+ * @param name Expected host name.
+ * @param port Expected port, NULL if no port is expected.
+ */
+static void assert_host(const char *host, const char *name, const char *port) {
+    char *p_name = upstream_host_name(host);
+    char *p_port = upstream_host_port(host);
+
+    assert_string_equal(p_name, name);
+
+    if (port)
+        assert_string_equal(p_port, port);
+    else
+        assert_null(p_port);
+
+    free(p_name);
+    free(p_port);
+}
+
+
+/* Tests */
+
+static void test_host_port(void ** state) {
+    assert_host("imap.example.com:993", "imap.example.com", "993");
+}
+
+static void test_host_service(void ** state) {
+    assert_host("smtp.example.com:submissions", "smtp.example.com", "submissions");
+}
+
+static void test_host_no_port(void ** state) {
+    assert_host("imap.example.com", "imap.example.com", NULL);
+}
+
+static void test_host_empty_port(void ** state) {
+    assert_host("imap.example.com:", "imap.example.com", NULL);
+}
+
+static void test_host_ipv4(void ** state) {
+    assert_host("192.0.2.1:465", "192.0.2.1", "465");
+}
+
+static void test_host_ipv6(void ** state) {
+    assert_host("[2001:db8::1]:993", "2001:db8::1", "993");
+}
+
+static void test_host_ipv6_no_port(void ** state) {
+    assert_host("[2001:db8::1]", "2001:db8::1", NULL);
+}
+
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_host_port),
+        cmocka_unit_test(test_host_service),
+        cmocka_unit_test(test_host_no_port),
+        cmocka_unit_test(test_host_empty_port),
+        cmocka_unit_test(test_host_ipv4),
+        cmocka_unit_test(test_host_ipv6),
+        cmocka_unit_test(test_host_ipv6_no_port)
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}